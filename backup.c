@@ -15,8 +15,11 @@
 #include <sys/time.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <pthread.h>
 #include <time.h>
 
+#include "catalog/catalog.h"
+#include "catalog/pg_tablespace.h"
 #include "libpq/pqsignal.h"
 #include "pgut/pgut-port.h"
 
@@ -31,12 +34,80 @@ static bool		 in_backup = false;	/* TODO: more robust logic */
 /* list of files contained in backup */
 parray			*backup_files_list;
 
+/* data file split into chunks by backup_files(), for any worker to take */
+typedef struct ChunkedFile
+{
+	pgFile	   *file;
+	int			nchunks;
+	int			next;			/* next chunk to back up */
+	int			ndone;			/* chunks backed up */
+} ChunkedFile;
+
+/* arguments shared by the workers of backup_files() */
+typedef struct
+{
+	const char *from_root;
+	const char *to_root;
+	parray	   *prev_files;
+	time_t		prev_start_time;	/* when the backup of prev_files started */
+	const XLogRecPtr *lsn;
+	const char *prefix;
+	time_t		start_time;		/* time when backup_files() started */
+
+	/* queue of regular files to copy, largest first */
+	parray	   *queue;
+	int			next;			/* next item of queue to process */
+
+	/* containers of the workers, NULL unless saving files into containers */
+	pgContainer *containers;
+	int			ncontainers;
+	int			next_container;	/* next container to hand out */
+
+	/* files split into chunks, taken before the next file of queue */
+	parray	   *chunked;		/* ChunkedFile */
+	int			next_chunked;	/* first item of chunked with chunks left */
+
+	pthread_mutex_t lock;		/* protects next, next_container and chunks */
+} backup_files_args;
+
+/* key identifying a relation segment */
+typedef struct RelSegKey
+{
+	RelFileNode	rnode;
+	ForkNumber	forknum;
+	BlockNumber	segno;
+} RelSegKey;
+
+/* entry of the relation segment index, free if file is NULL */
+typedef struct RelSegEntry
+{
+	RelSegKey	key;
+	pgFile	   *file;
+} RelSegEntry;
+
+/* open addressing hash table of the relation segments being tracked */
+static RelSegEntry *relseg_index = NULL;
+static uint32		relseg_index_mask = 0;
+static RelSegEntry *relseg_last_hit = NULL;
+
 /*
  * Backup routines
  */
 static void backup_cleanup(bool fatal, void *userdata);
 static void backup_files(const char *from_root, const char *to_root,
-	parray *files, parray *prev_files, const XLogRecPtr *lsn, const char *prefix);
+	parray *files, parray *prev_files, time_t prev_start_time,
+	const XLogRecPtr *lsn, const char *prefix);
+static bool file_is_unchanged(const pgFile *prev_file, const pgFile *file,
+							  time_t prev_start_time);
+static void *backup_files_worker(void *arg);
+static ChunkedFile *start_chunked_file(backup_files_args *args, pgFile *file);
+static ChunkedFile *next_file_chunk(backup_files_args *args, int *chunkno);
+static void backup_file_chunk(backup_files_args *args, ChunkedFile *cf,
+							  int chunkno);
+static void open_containers(backup_files_args *args, int ncontainers);
+static void close_containers(backup_files_args *args);
+static const char *backup_files_display_path(backup_files_args *args,
+											 pgFile *file);
 static parray *do_backup_database(parray *backup_list, pgBackupOption bkupopt);
 static void confirm_block_size(const char *name, int blcksz);
 static void pg_start_backup(const char *label, bool smooth, pgBackup *backup);
@@ -45,13 +116,17 @@ static bool pg_is_standby(void);
 static void get_lsn(PGresult *res, XLogRecPtr *lsn);
 static void get_xid(PGresult *res, uint32 *xid);
 
-static void add_files(parray *files, const char *root, bool add_root, bool is_pgdata);
 static void create_file_list(parray *files,
 							 const char *root,
 							 const char *subdir,
 							 const char *prefix,
 							 bool is_append);
 static void wait_for_archive(pgBackup *backup, const char *sql);
+static char *datasegpath(RelFileNode rnode, ForkNumber forknum,
+						 BlockNumber segno);
+static bool parse_relseg_path(const char *relpath, RelSegKey *key);
+static uint32 relseg_hash(const RelSegKey *key);
+static pgFile *relseg_lookup(const RelSegKey *key);
 
 /*
  * Take a backup of database and return the list of files backed up.
@@ -68,6 +143,7 @@ do_backup_database(parray *backup_list, pgBackupOption bkupopt)
 	char		prev_file_txt[MAXPGPATH];	/* path of the previous backup
 											 * list file */
 	bool		has_backup_label  = true;	/* flag if backup_label is there */
+	ControlFileData ControlFile;
 
 	/* repack the options */
 	bool	smooth_checkpoint = bkupopt.smooth_checkpoint;
@@ -92,6 +168,10 @@ do_backup_database(parray *backup_list, pgBackupOption bkupopt)
 	 */
 	current.tli = get_current_timeline();
 
+	/* restore --rewind checks that $PGDATA is the cluster backed up */
+	get_control_file(&ControlFile);
+	current.system_identifier = ControlFile.system_identifier;
+
 	/*
 	 * In differential backup mode, check if there is an already-validated
 	 * full backup on current timeline.
@@ -128,7 +208,8 @@ do_backup_database(parray *backup_list, pgBackupOption bkupopt)
 
 	/*
 	 * List directories and symbolic links with the physical path to make
-	 * mkdirs.sh, then sort them in order of path. Omit $PGDATA.
+	 * mkdirs.sh and the list of directories read by restore, then sort them
+	 * in order of path. Omit $PGDATA.
 	 */
 	backup_files_list = parray_new();
 	dir_list_file(backup_files_list, pgdata, NULL, false, false);
@@ -145,6 +226,17 @@ do_backup_database(parray *backup_list, pgBackupOption bkupopt)
 		if (chmod(path, DIR_PERMISSION) == -1)
 			elog(ERROR, "can't change mode of \"%s\": %s", path,
 				strerror(errno));
+		sync_file(path);
+
+		/* the same, but made by restore itself */
+		pgBackupGetPath(&current, path, lengthof(path), MKDIRS_LIST_FILE);
+		fp = fopen(path, "wt");
+		if (fp == NULL)
+			elog(ERROR, "can't open directory list \"%s\": %s",
+				path, strerror(errno));
+		dir_print_mkdirs_list(fp, backup_files_list, pgdata);
+		fclose(fp);
+		sync_file(path);
 	}
 
 	/* clear directory list */
@@ -196,7 +288,7 @@ do_backup_database(parray *backup_list, pgBackupOption bkupopt)
 		wait_for_archive(&current, "SELECT * FROM pg_switch_xlog()");
 
 		/* Now build the page map */
-		parray_qsort(backup_files_list, pgFileComparePathDesc);
+		build_relseg_index(backup_files_list, pgdata);
 		elog(LOG, "extractPageMap");
 		elog(LOG, "current_tli:%X", current.tli);
 		elog(LOG, "prev_backup->start_lsn: %X/%X",
@@ -206,10 +298,19 @@ do_backup_database(parray *backup_list, pgBackupOption bkupopt)
 			 (uint32) (current.start_lsn >> 32),
 			 (uint32) (current.start_lsn));
 		extractPageMap(arclog_path, prev_backup->start_lsn, current.tli,
-					   current.start_lsn);
+					   current.start_lsn, true);
+		mark_covered_relsegs(backup_files_list, prev_files, pgdata);
+		free_relseg_index();
 	}
 
-	backup_files(pgdata, path, backup_files_list, prev_files, lsn, NULL);
+	/* pages are saved into the store shared by the backups of the catalog */
+	if (current.dedup && !check)
+		dedup_store_open();
+
+	throttle_adapt_start();
+	backup_files(pgdata, path, backup_files_list, prev_files,
+				 prev_backup ? prev_backup->start_time : 0, lsn, NULL);
+	throttle_adapt_stop();
 
 	/* notify end of backup */
 	pg_stop_backup(&current);
@@ -315,10 +416,29 @@ do_backup(pgBackupOption bkupopt)
 	/* set the error processing function for the backup process */
 	pgut_atexit_push(backup_cleanup, NULL);
 
+	/* the files written from now on are synced before the backup is done */
+	sync_start();
+
 	/* backup data */
 	files_database = do_backup_database(backup_list, bkupopt);
 	pgut_atexit_pop(backup_cleanup, NULL);
 
+	/*
+	 * Save the references of the backup to the dedup store just before it
+	 * is marked as done, the references of backups which are not being
+	 * released when they are deleted.
+	 */
+	dedup_store_close(true);
+
+	/* a backup is done only once all its files are on disk */
+	if (!check)
+	{
+		char		backup_dir[MAXPGPATH];
+
+		pgBackupGetPath(&current, backup_dir, lengthof(backup_dir), NULL);
+		sync_finish(backup_dir, backup_path);
+	}
+
 	/* update backup status to DONE */
 	current.end_time = time(NULL);
 	current.status = BACKUP_STATUS_DONE;
@@ -632,33 +752,262 @@ backup_cleanup(bool fatal, void *userdata)
 
 /*
  * Take differential backup at page level.
+ *
+ * Directories are created first in path order, then regular files are
+ * copied by a pool of num_jobs workers pulling from a shared queue sorted
+ * by size in descending order, so as the largest relation segments are
+ * started first and do not end up serialized at the tail of the backup.
  */
 static void
 backup_files(const char *from_root,
 			 const char *to_root,
 			 parray *files,
 			 parray *prev_files,
+			 time_t prev_start_time,
 			 const XLogRecPtr *lsn,
 			 const char *prefix)
 {
-	int				i;
-	struct timeval	tv;
+	int					i;
+	int					njobs;
+	struct timeval		tv;
+	backup_files_args	args;
+	pthread_t		   *workers;
 
 	/* sort pathname ascending */
 	parray_qsort(files, pgFileComparePath);
 
 	gettimeofday(&tv, NULL);
 
-	/* backup a file or create a directory */
+	args.from_root = from_root;
+	args.to_root = to_root;
+	args.prev_files = prev_files;
+	args.prev_start_time = prev_start_time;
+	args.lsn = lsn;
+	args.prefix = prefix;
+	args.start_time = tv.tv_sec;
+	args.queue = parray_new();
+	args.next = 0;
+	args.containers = NULL;
+	args.ncontainers = 0;
+	args.next_container = 0;
+	args.chunked = parray_new();
+	args.next_chunked = 0;
+	pthread_mutex_init(&args.lock, NULL);
+
+	/* create directories, and queue regular files for the workers */
 	for (i = 0; i < parray_num(files); i++)
 	{
+		pgFile *file = (pgFile *) parray_get(files, i);
+
+		/* check for interrupt */
+		if (interrupted)
+			elog(ERROR, "interrupted during backup");
+
+		if (S_ISDIR(file->mode))
+		{
+			struct stat	buf;
+			char		dirpath[MAXPGPATH];
+
+			if (verbose)
+				elog(LOG, "(%d/%lu) %s", i + 1,
+					 (unsigned long) parray_num(files),
+					 backup_files_display_path(&args, file));
+
+			/* skip directories removed since they have been listed */
+			if (stat(file->path, &buf) == -1)
+			{
+				if (errno != ENOENT)
+					elog(ERROR, "can't stat backup mode. \"%s\": %s",
+						 file->path, strerror(errno));
+				file->write_size = BYTES_INVALID;
+				elog(LOG, "skip");
+				continue;
+			}
+
+			/* containers need no directory, restore makes them */
+			join_path_components(dirpath, to_root, JoinPathEnd(file->path, from_root));
+			if (!check && current.backup_format != BACKUP_FORMAT_CONTAINER)
+				dir_create_dir(dirpath, DIR_PERMISSION);
+			elog(LOG, "directory");
+		}
+		else if (S_ISREG(file->mode))
+			parray_append(args.queue, file);
+		else
+			elog(LOG, "unexpected file type %d", file->mode);
+	}
+
+	/* largest files first */
+	parray_qsort(args.queue, pgFileCompareSizeDesc);
+
+	/*
+	 * In check mode all the files are written to the same temporary file,
+	 * so stick with a single worker.
+	 */
+	njobs = check ? 1 : num_jobs;
+	if (njobs > parray_num(args.queue))
+		njobs = parray_num(args.queue);
+
+	/* each worker appends the files it copies to a container of its own */
+	if (!check && current.backup_format == BACKUP_FORMAT_CONTAINER)
+		open_containers(&args, Max(njobs, 1));
+
+	if (njobs <= 1)
+		backup_files_worker(&args);
+	else
+	{
+		elog(LOG, "starting %d backup workers", njobs);
+
+		workers = pgut_newarray(pthread_t, njobs);
+		for (i = 0; i < njobs; i++)
+		{
+			int		ret;
+
+			ret = pthread_create(&workers[i], NULL, backup_files_worker, &args);
+			if (ret != 0)
+				elog(ERROR, "cannot create backup worker: %s", strerror(ret));
+		}
+		for (i = 0; i < njobs; i++)
+			pthread_join(workers[i], NULL);
+		free(workers);
+	}
+
+	/* the error has been reported by the thread which failed */
+	if (worker_failed)
+		elog(ERROR, "backup worker failed");
+
+	if (args.containers != NULL)
+		close_containers(&args);
+
+	pthread_mutex_destroy(&args.lock);
+	parray_free(args.queue);
+	parray_walk(args.chunked, free);
+	parray_free(args.chunked);
+}
+
+/*
+ * Create the containers of the workers of backup_files() in the database
+ * directory of the backup.
+ */
+static void
+open_containers(backup_files_args *args, int ncontainers)
+{
+	int		i;
+
+	args->containers = pgut_newarray(pgContainer, ncontainers);
+	args->ncontainers = ncontainers;
+	for (i = 0; i < ncontainers; i++)
+	{
+		pgContainer *container = &args->containers[i];
+
+		container->id = i;
+		snprintf(container->path, lengthof(container->path), "%s/%s.%d",
+				 args->to_root, CONTAINER_FILE_PREFIX, i);
+		container->fp = fopen(container->path, "w");
+		if (container->fp == NULL)
+			elog(ERROR, "cannot open container \"%s\": %s",
+				 container->path, strerror(errno));
+		if (chmod(container->path, FILE_PERMISSION) == -1)
+			elog(ERROR, "cannot change mode of \"%s\": %s",
+				 container->path, strerror(errno));
+	}
+}
+
+/*
+ * Close the containers once all the files are copied, removing those which
+ * received none.
+ */
+static void
+close_containers(backup_files_args *args)
+{
+	int		i;
+
+	for (i = 0; i < args->ncontainers; i++)
+	{
+		pgContainer *container = &args->containers[i];
+		off_t		size = ftello(container->fp);
+
+		if (size < 0 || fflush(container->fp) != 0)
+			elog(ERROR, "cannot write container \"%s\": %s",
+				 container->path, strerror(errno));
+		io_drop_cache(fileno(container->fp), container->path, 0, 0, true);
+		if (fclose(container->fp) != 0)
+			elog(ERROR, "cannot write container \"%s\": %s",
+				 container->path, strerror(errno));
+		if (size > 0)
+			sync_file(container->path);
+		if (size == 0 && remove(container->path) == -1)
+			elog(ERROR, "cannot remove file \"%s\": %s",
+				 container->path, strerror(errno));
+	}
+
+	free(args->containers);
+	args->containers = NULL;
+}
+
+/*
+ * Return the path of a file as shown in progress messages.
+ */
+static const char *
+backup_files_display_path(backup_files_args *args, pgFile *file)
+{
+	return file->path + strlen(args->from_root) + 1;
+}
+
+/*
+ * Worker of backup_files(). Pull files from the shared queue until it is
+ * empty and copy them into the backup. The results of each copy are saved
+ * in the pgFile itself, which is only touched by the worker that owns it.
+ *
+ * With --chunk-size, a data file larger than a chunk is instead split into
+ * chunks, which the workers take before pulling another file, so as the
+ * largest files do not keep a single worker busy at the end of the backup.
+ * The chunks are backed up like files of their own, and the worker doing
+ * the last one puts them together.
+ */
+static void *
+backup_files_worker(void *arg)
+{
+	backup_files_args *args = (backup_files_args *) arg;
+	pgContainer *container = NULL;
+
+	if (args->containers != NULL)
+	{
+		pthread_mutex_lock(&args->lock);
+		container = &args->containers[args->next_container++];
+		pthread_mutex_unlock(&args->lock);
+	}
+
+	for (;;)
+	{
+		int			idx = 0;
 		int			ret;
 		struct stat	buf;
+		pgFile	   *file;
+		ChunkedFile *cf;
+		int			chunkno;
 
-		pgFile *file = (pgFile *) parray_get(files, i);
+		/* stop if another thread failed */
+		if (worker_failed)
+			break;
+
+		pthread_mutex_lock(&args->lock);
+		cf = next_file_chunk(args, &chunkno);
+		if (cf == NULL)
+			idx = args->next++;
+		pthread_mutex_unlock(&args->lock);
+
+		if (cf != NULL)
+		{
+			backup_file_chunk(args, cf, chunkno);
+			continue;
+		}
+
+		if (idx >= parray_num(args->queue))
+			break;
+		file = (pgFile *) parray_get(args->queue, idx);
 
 		/* If current time is rewinded, abort this backup. */
-		if (tv.tv_sec < file->mtime)
+		if (args->start_time < file->mtime)
 			elog(ERROR,
 				 "current time may be rewound. Please retry with full backup mode.");
 
@@ -669,16 +1018,18 @@ backup_files(const char *from_root,
 		/* print progress in verbose mode */
 		if (verbose)
 		{
-			if (prefix)
+			if (args->prefix)
 			{
 				char path[MAXPGPATH];
-				join_path_components(path, prefix, file->path + strlen(from_root) + 1);
-				elog(LOG, "(%d/%lu) %s", i + 1,
-					 (unsigned long) parray_num(files), path);
+				join_path_components(path, args->prefix,
+									 backup_files_display_path(args, file));
+				elog(LOG, "(%d/%lu) %s", idx + 1,
+					 (unsigned long) parray_num(args->queue), path);
 			}
 			else
-				elog(LOG, "(%d/%lu) %s", i + 1, (unsigned long) parray_num(files),
-					file->path + strlen(from_root) + 1);
+				elog(LOG, "(%d/%lu) %s", idx + 1,
+					 (unsigned long) parray_num(args->queue),
+					 backup_files_display_path(args, file));
 		}
 
 		/* stat file to get file type, size and modify timestamp */
@@ -700,102 +1051,222 @@ backup_files(const char *from_root,
 			}
 		}
 
-		/* if the entry was a directory, create it in the backup */
-		if (S_ISDIR(buf.st_mode))
+		if (!S_ISREG(buf.st_mode))
 		{
-			char dirpath[MAXPGPATH];
-
-			join_path_components(dirpath, to_root, JoinPathEnd(file->path, from_root));
-			if (!check)
-				dir_create_dir(dirpath, DIR_PERMISSION);
-			elog(LOG, "directory");
+			elog(LOG, "unexpected file type %d", buf.st_mode);
+			continue;
 		}
-		else if (S_ISREG(buf.st_mode))
+
+		/* skip files which have not been modified since last backup */
+		if (args->prev_files)
 		{
-			/* skip files which have not been modified since last backup */
-			if (prev_files)
+			pgFile *prev_file = NULL;
+
+			/*
+			 * If prefix is not NULL, the table space is backup from the snapshot.
+			 * Therefore, adjust file name to correspond to the file list.
+			 */
+			if (args->prefix)
 			{
-				pgFile *prev_file = NULL;
+				int j;
 
-				/*
-				 * If prefix is not NULL, the table space is backup from the snapshot.
-				 * Therefore, adjust file name to correspond to the file list.
-				 */
-				if (prefix)
+				for (j = 0; j < parray_num(args->prev_files); j++)
 				{
-					int j;
-
-					for (j = 0; j < parray_num(prev_files); j++)
+					pgFile *p = (pgFile *) parray_get(args->prev_files, j);
+					char *prev_path;
+					char curr_path[MAXPGPATH];
+
+					prev_path = p->path + strlen(args->from_root) + 1;
+					join_path_components(curr_path, args->prefix,
+										 backup_files_display_path(args, file));
+					if (strcmp(curr_path, prev_path) == 0)
 					{
-						pgFile *p = (pgFile *) parray_get(prev_files, j);
-						char *prev_path;
-						char curr_path[MAXPGPATH];
-
-						prev_path = p->path + strlen(from_root) + 1;
-						join_path_components(curr_path, prefix, file->path + strlen(from_root) + 1);
-						if (strcmp(curr_path, prev_path) == 0)
-						{
-							prev_file = p;
-							break;
-						}
+						prev_file = p;
+						break;
 					}
 				}
-				else
-				{
-					pgFile **p = (pgFile **) parray_bsearch(prev_files, file, pgFileComparePath);
-					if (p)
-						prev_file = *p;
-				}
-
-				if (prev_file && prev_file->mtime == file->mtime)
-				{
-					/* record as skipped file in file_xxx.txt */
-					file->write_size = BYTES_INVALID;
-					elog(LOG, "skip");
-					continue;
-				}
 			}
-
-			/*
-			 * We will wait until the next second of mtime so that backup
-			 * file should contain all modifications at the clock of mtime.
-			 * timer resolution of ext3 file system is one second.
-			 */
-
-			if (tv.tv_sec == file->mtime)
+			else
 			{
-				/* update time and recheck */
-				gettimeofday(&tv, NULL);
-				while (tv.tv_sec <= file->mtime)
-				{
-					usleep(1000000 - tv.tv_usec);
-					gettimeofday(&tv, NULL);
-				}
+				pgFile **p = (pgFile **) parray_bsearch(args->prev_files, file,
+														pgFileComparePath);
+				if (p)
+					prev_file = *p;
 			}
 
-			/* copy the file into backup */
-			if (!(file->is_datafile
-					? backup_data_file(from_root, to_root, file, lsn)
-					: copy_file(from_root, to_root, file)))
+			if (prev_file &&
+				file_is_unchanged(prev_file, file, args->prev_start_time))
 			{
 				/* record as skipped file in file_xxx.txt */
 				file->write_size = BYTES_INVALID;
 				elog(LOG, "skip");
 				continue;
 			}
+		}
 
-			elog(LOG, "copied %lu", (unsigned long) file->write_size);
+		/* no block of the file changed according to the WAL scanned */
+		if (file->pagemap_valid && datapagemap_is_empty(&file->pagemap))
+		{
+			/* record as skipped file in file_xxx.txt */
+			file->write_size = BYTES_INVALID;
+			elog(LOG, "skip, unchanged");
+			continue;
 		}
-		else
-			elog(LOG, "unexpected file type %d", buf.st_mode);
+
+		/* split the data files larger than a chunk */
+		if (file->is_datafile && chunk_size > 0 && container == NULL &&
+			!check && file->size > (size_t) chunk_size * 1024 * 1024)
+		{
+			backup_file_chunk(args, start_chunked_file(args, file), 0);
+			continue;
+		}
+
+		/* copy the file into backup */
+		if (!(file->is_datafile
+				? backup_data_file(args->from_root, args->to_root, file,
+								   args->lsn, container)
+				: copy_file(args->from_root, args->to_root, file, container,
+						    true)))
+		{
+			/* record as skipped file in file_xxx.txt */
+			file->write_size = BYTES_INVALID;
+			elog(LOG, "skip");
+			continue;
+		}
+
+		elog(LOG, "copied %lu", (unsigned long) file->write_size);
 	}
+
+	return NULL;
 }
 
+/*
+ * Split file into chunks of --chunk-size for the workers of backup_files(),
+ * the first chunk being taken by the caller.
+ */
+static ChunkedFile *
+start_chunked_file(backup_files_args *args, pgFile *file)
+{
+	BlockNumber	nblocks = (BlockNumber) ((file->size + BLCKSZ - 1) / BLCKSZ);
+	BlockNumber	chunk_blocks;
+	ChunkedFile *cf;
+
+	/* very large segments are split into larger chunks */
+	chunk_blocks = (BlockNumber) ((int64) chunk_size * 1024 * 1024 / BLCKSZ);
+	chunk_blocks = Max(chunk_blocks,
+					   (nblocks + MAX_FILE_CHUNKS - 1) / MAX_FILE_CHUNKS);
+
+	file->chunk_blocks = chunk_blocks;
+	file->nchunks = (int) ((nblocks + chunk_blocks - 1) / chunk_blocks);
+	file->chunks = pgut_newarray(pgFileChunk, file->nchunks);
+	memset(file->chunks, 0, sizeof(pgFileChunk) * file->nchunks);
+	elog(LOG, "split into %d chunks", file->nchunks);
+
+	cf = pgut_new(ChunkedFile);
+	cf->file = file;
+	cf->nchunks = file->nchunks;
+	cf->next = 1;
+	cf->ndone = 0;
+
+	pthread_mutex_lock(&args->lock);
+	pthread_cleanup_push(pgut_mutex_unlock, &args->lock);
+	parray_append(args->chunked, cf);
+	pthread_cleanup_pop(1);
+
+	return cf;
+}
 
 /*
- * Append files to the backup list array.
+ * Take the next chunk left of the files split, setting chunkno. Return NULL
+ * if there is none. Called under the lock of args.
+ */
+static ChunkedFile *
+next_file_chunk(backup_files_args *args, int *chunkno)
+{
+	while (args->next_chunked < parray_num(args->chunked))
+	{
+		ChunkedFile *cf = (ChunkedFile *) parray_get(args->chunked,
+													 args->next_chunked);
+
+		if (cf->next < cf->nchunks)
+		{
+			*chunkno = cf->next++;
+			return cf;
+		}
+		args->next_chunked++;
+	}
+
+	return NULL;
+}
+
+/*
+ * Back up a chunk of a file split by start_chunked_file(). The worker which
+ * completes the last chunk of the file puts its chunks together.
  */
 static void
+backup_file_chunk(backup_files_args *args, ChunkedFile *cf, int chunkno)
+{
+	pgFile	   *file = cf->file;
+	bool		last;
+
+	/* check for interrupt */
+	if (interrupted)
+		elog(ERROR, "interrupted during backup");
+
+	backup_data_chunk(args->from_root, args->to_root, file, args->lsn,
+					  chunkno);
+
+	pthread_mutex_lock(&args->lock);
+	last = (++cf->ndone == cf->nchunks);
+	pthread_mutex_unlock(&args->lock);
+	if (!last)
+		return;
+
+	if (!backup_data_chunks_end(args->from_root, args->to_root, file))
+	{
+		/* record as skipped file in file_xxx.txt */
+		file->write_size = BYTES_INVALID;
+		elog(LOG, "skip");
+		return;
+	}
+
+	elog(LOG, "copied %lu", (unsigned long) file->write_size);
+}
+
+/*
+ * Return true if file has not been modified since it was listed by the
+ * previous backup as prev_file, so as it does not need to be copied again.
+ *
+ * The size, mtime and ctime with nanoseconds must not have changed. This is
+ * not enough for files modified around the start of the previous backup:
+ * a modification after the file has been listed could leave its times as
+ * they were with a coarse timestamp granularity, so such files are copied
+ * again. Lists of older backups only have mtime in seconds, but they were
+ * taken waiting for the second of mtime to pass before copying each file,
+ * so an identical mtime is enough for them.
+ */
+static bool
+file_is_unchanged(const pgFile *prev_file, const pgFile *file,
+				  time_t prev_start_time)
+{
+	if (prev_file->mtime != file->mtime)
+		return false;
+
+	/* list of an older backup */
+	if (prev_file->ctime == 0)
+		return true;
+
+	return prev_file->mtime_nsec == file->mtime_nsec &&
+		prev_file->ctime == file->ctime &&
+		prev_file->ctime_nsec == file->ctime_nsec &&
+		prev_file->size == file->size &&
+		prev_file->mtime < prev_start_time - 1;
+}
+
+/*
+ * Append files to the backup list array.
+ */
+void
 add_files(parray *files, const char *root, bool add_root, bool is_pgdata)
 {
 	parray	*list_file;
@@ -862,6 +1333,7 @@ create_file_list(parray *files,
 				strerror(errno));
 		dir_print_file_list(fp, files, root, prefix);
 		fclose(fp);
+		sync_file(path);
 	}
 }
 
@@ -888,39 +1360,235 @@ datasegpath(RelFileNode rnode, ForkNumber forknum, BlockNumber segno)
 }
 
 /*
- * This routine gets called while reading WAL segments from the WAL archive,
- * for every block that have changed in the target system. It makes note of
- * all the changed blocks in the pagemap of the file and adds them in the
- * things to track for the backup.
+ * Parse the path of a relation segment, relative to the root of the data
+ * folder, into the key used by the relation segment index. Return false
+ * if the path is not the one of a relation segment.
+ */
+static bool
+parse_relseg_path(const char *relpath, RelSegKey *key)
+{
+	const char *fname;
+	const char *p;
+	char	   *path;
+	bool		result;
+
+	memset(key, 0, sizeof(RelSegKey));
+
+	if (sscanf(relpath, "global/%u", &key->rnode.relNode) == 1)
+	{
+		key->rnode.spcNode = GLOBALTABLESPACE_OID;
+		key->rnode.dbNode = 0;
+	}
+	else if (sscanf(relpath, "base/%u/%u",
+					&key->rnode.dbNode, &key->rnode.relNode) == 2)
+		key->rnode.spcNode = DEFAULTTABLESPACE_OID;
+	else if (sscanf(relpath, "pg_tblspc/%u/" TABLESPACE_VERSION_DIRECTORY "/%u/%u",
+					&key->rnode.spcNode, &key->rnode.dbNode,
+					&key->rnode.relNode) != 3)
+		return false;
+
+	/* fork and segment number follow the relfilenode in the file name */
+	fname = last_dir_separator(relpath);
+	fname = fname ? fname + 1 : relpath;
+	p = fname + strspn(fname, "0123456789");
+
+	key->forknum = MAIN_FORKNUM;
+	if (*p == '_')
+	{
+		char	forkname[FORKNAMECHARS + 1];
+		size_t	len = strcspn(p + 1, ".");
+
+		if (len > FORKNAMECHARS)
+			return false;
+		memcpy(forkname, p + 1, len);
+		forkname[len] = '\0';
+		key->forknum = forkname_to_number(forkname);
+		if (key->forknum == InvalidForkNumber)
+			return false;
+		p += len + 1;
+	}
+
+	key->segno = 0;
+	if (*p == '.')
+		key->segno = (BlockNumber) strtoul(p + 1, NULL, 10);
+
+	/* make sure that the path is exactly the one of this relation segment */
+	path = datasegpath(key->rnode, key->forknum, key->segno);
+	result = (strcmp(path, relpath) == 0);
+	pg_free(path);
+
+	return result;
+}
+
+static uint32
+relseg_hash(const RelSegKey *key)
+{
+	uint32		h;
+
+	h = key->rnode.relNode;
+	h = h * 0x9E3779B1 + key->rnode.dbNode;
+	h = h * 0x9E3779B1 + key->rnode.spcNode;
+	h = h * 0x9E3779B1 + key->segno;
+	h = h * 0x9E3779B1 + (uint32) key->forknum;
+
+	/* final avalanche, from MurmurHash3 */
+	h ^= h >> 16;
+	h *= 0x85EBCA6B;
+	h ^= h >> 13;
+	h *= 0xC2B2AE35;
+	h ^= h >> 16;
+
+	return h;
+}
+
+/*
+ * Build the index of relation segments, mapping each relation segment of
+ * "files" to its pgFile entry. Paths of "files" are absolute and located
+ * under "root". This is done once after listing the files, so as the
+ * lookups done for each block reference found in WAL records are cheap
+ * and do not allocate anything.
  */
 void
-process_block_change(ForkNumber forknum, RelFileNode rnode, BlockNumber blkno)
+build_relseg_index(parray *files, const char *root)
 {
-	char		*path;
-	char		*rel_path;
-	BlockNumber blkno_inseg;
-	int			segno;
-	pgFile		*file_item = NULL;
-	int			j;
+	int			i;
+	uint32		nslots = 16;
 
-	segno = blkno / RELSEG_SIZE;
-	blkno_inseg = blkno % RELSEG_SIZE;
+	free_relseg_index();
 
-	rel_path = datasegpath(rnode, forknum, segno);
-	path = pg_malloc(strlen(rel_path) + strlen(pgdata) + 2);
-	sprintf(path, "%s/%s", pgdata, rel_path);
+	/* keep the load factor of the open addressing table under 0.5 */
+	while (nslots < parray_num(files) * 2)
+		nslots *= 2;
 
-	for (j = 0; j < parray_num(backup_files_list); j++)
+	relseg_index = pgut_newarray(RelSegEntry, nslots);
+	memset(relseg_index, 0, sizeof(RelSegEntry) * nslots);
+	relseg_index_mask = nslots - 1;
+
+	for (i = 0; i < parray_num(files); i++)
 	{
-		pgFile *p = (pgFile *) parray_get(backup_files_list, j);
+		pgFile	   *file = (pgFile *) parray_get(files, i);
+		RelSegKey	key;
+		uint32		slot;
 
-		if (strcmp(p->path, path) == 0)
+		if (!S_ISREG(file->mode) || !file->is_datafile)
+			continue;
+
+		if (!parse_relseg_path(JoinPathEnd(file->path, root), &key))
+			continue;
+
+		slot = relseg_hash(&key) & relseg_index_mask;
+		while (relseg_index[slot].file != NULL)
+			slot = (slot + 1) & relseg_index_mask;
+
+		relseg_index[slot].key = key;
+		relseg_index[slot].file = file;
+	}
+}
+
+/*
+ * Release the index of relation segments.
+ */
+void
+free_relseg_index(void)
+{
+	free(relseg_index);
+	relseg_index = NULL;
+	relseg_index_mask = 0;
+	relseg_last_hit = NULL;
+}
+
+/*
+ * Find the entry of a relation segment in the index, or NULL if the
+ * segment is not tracked.
+ */
+static pgFile *
+relseg_lookup(const RelSegKey *key)
+{
+	uint32		slot;
+
+	if (relseg_index == NULL)
+		return NULL;
+
+	/* consecutive block references often touch the same segment */
+	if (relseg_last_hit != NULL &&
+		memcmp(&relseg_last_hit->key, key, sizeof(RelSegKey)) == 0)
+		return relseg_last_hit->file;
+
+	slot = relseg_hash(key) & relseg_index_mask;
+	while (relseg_index[slot].file != NULL)
+	{
+		if (memcmp(&relseg_index[slot].key, key, sizeof(RelSegKey)) == 0)
 		{
-			file_item = p;
-			break;
+			relseg_last_hit = &relseg_index[slot];
+			return relseg_last_hit->file;
 		}
+		slot = (slot + 1) & relseg_index_mask;
 	}
 
+	return NULL;
+}
+
+/*
+ * Mark the relation segments whose changes since the previous backup are
+ * all known from the WAL scanned, so as their page map gives exactly the
+ * blocks to read, none if it is empty. Only the main fork of WAL-logged
+ * relations qualifies, the other forks and unlogged relations being not
+ * fully WAL-logged. Segments created since the previous backup are left
+ * out as well, as CREATE DATABASE copies files without block references
+ * in WAL. A rewinding restore uses it the same way, prev_files being the
+ * files of the backup restored.
+ */
+void
+mark_covered_relsegs(parray *files, parray *prev_files, const char *root)
+{
+	int			i;
+
+	for (i = 0; i < parray_num(files); i++)
+	{
+		pgFile	   *file = (pgFile *) parray_get(files, i);
+		RelSegKey	key;
+		RelSegKey	init_key;
+
+		if (!S_ISREG(file->mode) || !file->is_datafile)
+			continue;
+
+		if (!parse_relseg_path(JoinPathEnd(file->path, root), &key) ||
+			key.forknum != MAIN_FORKNUM)
+			continue;
+
+		/* unlogged relations have an init fork */
+		init_key = key;
+		init_key.forknum = INIT_FORKNUM;
+		init_key.segno = 0;
+		if (relseg_lookup(&init_key) != NULL)
+			continue;
+
+		if (parray_bsearch(prev_files, file, pgFileComparePath) == NULL)
+			continue;
+
+		file->pagemap_valid = true;
+	}
+}
+
+/*
+ * This routine gets called while reading WAL segments from the WAL archive,
+ * for every block that have changed in the target system. It makes note of
+ * all the changed blocks in the pagemap of the file and adds them in the
+ * things to track for the backup.
+ */
+void
+process_block_change(ForkNumber forknum, RelFileNode rnode, BlockNumber blkno)
+{
+	RelSegKey	key;
+	pgFile	   *file_item;
+
+	memset(&key, 0, sizeof(RelSegKey));
+	key.rnode = rnode;
+	key.forknum = forknum;
+	key.segno = blkno / RELSEG_SIZE;
+
+	file_item = relseg_lookup(&key);
+
 	/*
 	 * If we don't have any record of this file in the file map, it means
 	 * that it's a relation that did not have much activity since the last
@@ -928,8 +1596,5 @@ process_block_change(ForkNumber forknum, RelFileNode rnode, BlockNumber blkno)
 	 * backup would simply copy it as-is.
 	 */
 	if (file_item)
-		datapagemap_add(&file_item->pagemap, blkno_inseg);
-
-	pg_free(path);
-	pg_free(rel_path);
+		datapagemap_add(&file_item->pagemap, blkno % RELSEG_SIZE);
 }
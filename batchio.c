@@ -0,0 +1,433 @@
+/*-------------------------------------------------------------------------
+ *
+ * batchio.c: batches of reads or writes of data pages
+ *
+ * The pages read by a differential backup and written by a restore are
+ * scattered over the data files. Instead of one blocking system call per
+ * page, the requests are gathered in a batch run at once. With io_uring,
+ * all the requests of a batch are in flight together, which lets fast
+ * storage process them in parallel. Otherwise, or if io_uring cannot be
+ * used, the requests are run one after the other with pread and pwrite.
+ * Each thread running batches has a ring of its own, set up the first time
+ * and used for all the files it reads or writes. The ring of a thread which
+ * ends, like the reader thread of a file, is kept for the next one.
+ *
+ * The page cache policy of --cache-policy is applied here too, so as a
+ * backup reading the whole data directory does not evict the working set
+ * of the server from the cache of the OS.
+ *
+ * Copyright (c) 2009-2013, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_arman.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+/* alignment of the buffers of direct I/O */
+#define IO_BUFFER_ALIGN		4096
+
+/* written files smaller than this are left in the cache */
+#define DROP_WRITTEN_MIN_SIZE	(1024 * 1024)
+
+#ifdef HAVE_LIBURING
+/* requests in flight at once in a ring, larger batches are run in rounds */
+#define IO_RING_ENTRIES		64
+
+/* ring of each thread, and those left by the threads ended */
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static parray *free_rings = NULL;
+static bool ring_failed = false;	/* io_uring cannot be set up */
+#endif
+
+static void io_batch_throttle(IoBatch *batch);
+static void io_batch_drop_cache(IoBatch *batch, int fd, const char *path);
+static void io_batch_run_sync(IoBatch *batch, int fd, const char *path,
+							  bool write);
+#ifdef HAVE_LIBURING
+static struct io_uring *io_ring_get(void);
+static void io_batch_run_uring(IoBatch *batch, struct io_uring *ring, int fd,
+							   const char *path, bool write);
+#endif
+
+/*
+ * Create a batch able to hold up to maxrequests requests.
+ */
+IoBatch *
+io_batch_new(int maxrequests)
+{
+	IoBatch    *batch = pgut_new(IoBatch);
+
+	batch->requests = pgut_newarray(IoRequest, maxrequests);
+	batch->nrequests = 0;
+	batch->maxrequests = maxrequests;
+
+	return batch;
+}
+
+void
+io_batch_free(IoBatch *batch)
+{
+	if (batch == NULL)
+		return;
+	free(batch->requests);
+	free(batch);
+}
+
+/*
+ * Forget the requests of the batch, to fill it again.
+ */
+void
+io_batch_reset(IoBatch *batch)
+{
+	batch->nrequests = 0;
+}
+
+/*
+ * Add a request to transfer len bytes between buf and the given offset of
+ * the file. The caller is responsible for not overfilling the batch.
+ */
+void
+io_batch_add(IoBatch *batch, char *buf, size_t len, off_t offset)
+{
+	IoRequest  *req;
+
+	Assert(batch->nrequests < batch->maxrequests);
+
+	req = &batch->requests[batch->nrequests++];
+	req->buf = buf;
+	req->len = len;
+	req->offset = offset;
+	req->done = 0;
+}
+
+/*
+ * Charge the requests of the batch to the I/O limits before running them.
+ */
+static void
+io_batch_throttle(IoBatch *batch)
+{
+	int64		bytes = 0;
+	int			i;
+
+	for (i = 0; i < batch->nrequests; i++)
+		bytes += batch->requests[i].len;
+	throttle_io(bytes, batch->nrequests);
+}
+
+/*
+ * Drop from the page cache what the requests of the batch have read.
+ */
+static void
+io_batch_drop_cache(IoBatch *batch, int fd, const char *path)
+{
+	int			i;
+
+	if (cache_policy == CACHE_POLICY_KEEP)
+		return;
+
+	for (i = 0; i < batch->nrequests; i++)
+		if (batch->requests[i].done > 0)
+			io_drop_cache(fd, path, batch->requests[i].offset,
+						  (off_t) batch->requests[i].done, false);
+}
+
+/*
+ * Run all the requests of the batch as reads. The number of bytes read by
+ * a request is lower than requested only at the end of the file.
+ */
+void
+io_batch_read(IoBatch *batch, int fd, const char *path)
+{
+#ifdef HAVE_LIBURING
+	struct io_uring *ring = io_ring_get();
+#endif
+
+	io_batch_throttle(batch);
+
+#ifdef HAVE_LIBURING
+	if (ring != NULL)
+	{
+		io_batch_run_uring(batch, ring, fd, path, false);
+		io_batch_drop_cache(batch, fd, path);
+		return;
+	}
+#endif
+	io_batch_run_sync(batch, fd, path, false);
+	io_batch_drop_cache(batch, fd, path);
+}
+
+/*
+ * Run all the requests of the batch as writes.
+ */
+void
+io_batch_write(IoBatch *batch, int fd, const char *path)
+{
+#ifdef HAVE_LIBURING
+	struct io_uring *ring = io_ring_get();
+#endif
+
+	io_batch_throttle(batch);
+
+#ifdef HAVE_LIBURING
+	if (ring != NULL)
+	{
+		io_batch_run_uring(batch, ring, fd, path, true);
+		return;
+	}
+#endif
+	io_batch_run_sync(batch, fd, path, true);
+}
+
+/*
+ * Allocate size bytes aligned for direct I/O.
+ */
+char *
+io_buffer_alloc(size_t size)
+{
+	void	   *buf;
+	int			errnum;
+
+	errnum = posix_memalign(&buf, IO_BUFFER_ALIGN, size);
+	if (errnum != 0)
+		elog(ERROR, "could not allocate memory (%lu bytes): %s",
+			 (unsigned long) size, strerror(errnum));
+
+	return (char *) buf;
+}
+
+/*
+ * Open a data file of the server to read its pages, bypassing the page
+ * cache with --cache-policy=direct. Direct I/O is silently not used if the
+ * file system refuses it, like tmpfs does. The reads of the file must then
+ * use buffers from io_buffer_alloc() and aligned offsets and lengths, which
+ * is the case of whole blocks.
+ */
+int
+io_open_data_file(const char *path)
+{
+#ifdef O_DIRECT
+	if (cache_policy == CACHE_POLICY_DIRECT)
+	{
+		int			fd = open(path, O_RDONLY | PG_BINARY | O_DIRECT, 0);
+
+		if (fd != -1 || errno != EINVAL)
+			return fd;
+	}
+#endif
+
+	return open(path, O_RDONLY | PG_BINARY, 0);
+}
+
+/*
+ * Drop from the page cache len bytes of the file fd starting at offset, up
+ * to the end of the file if len is 0, unless --cache-policy=keep. Written
+ * pages need to be flushed to be dropped, which is only worth it for the
+ * files large enough to evict anything else.
+ */
+void
+io_drop_cache(int fd, const char *path, off_t offset, off_t len, bool written)
+{
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_DONTNEED)
+	if (cache_policy == CACHE_POLICY_KEEP)
+		return;
+
+	if (written)
+	{
+		struct stat	st;
+
+		if (fstat(fd, &st) == -1)
+			elog(ERROR, "cannot stat \"%s\": %s", path, strerror(errno));
+		if (st.st_size < DROP_WRITTEN_MIN_SIZE)
+			return;
+		if (fdatasync(fd) != 0)
+			elog(ERROR, "cannot flush \"%s\": %s", path, strerror(errno));
+	}
+
+	(void) posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED);
+#endif
+}
+
+/*
+ * Complete the requests of the batch with pread or pwrite. This is also
+ * used to finish the requests io_uring has only partially done.
+ */
+static void
+io_batch_run_sync(IoBatch *batch, int fd, const char *path, bool write)
+{
+	int			i;
+
+	for (i = 0; i < batch->nrequests; i++)
+	{
+		IoRequest  *req = &batch->requests[i];
+
+		while (req->done < req->len)
+		{
+			ssize_t		rc;
+
+			if (write)
+				rc = pwrite(fd, req->buf + req->done, req->len - req->done,
+							req->offset + req->done);
+			else
+				rc = pread(fd, req->buf + req->done, req->len - req->done,
+						   req->offset + req->done);
+
+			if (rc < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				elog(ERROR, "cannot %s \"%s\" at offset %llu: %s",
+					 write ? "write" : "read", path,
+					 (unsigned long long) (req->offset + req->done),
+					 strerror(errno));
+			}
+			if (rc == 0)
+			{
+				if (write)
+					elog(ERROR, "cannot write \"%s\" at offset %llu: no space written",
+						 path, (unsigned long long) (req->offset + req->done));
+				break;		/* end of file */
+			}
+			req->done += rc;
+		}
+	}
+}
+
+#ifdef HAVE_LIBURING
+/*
+ * Keep the ring of a thread which ends for the next thread.
+ */
+static void
+io_ring_release(void *arg)
+{
+	pthread_mutex_lock(&ring_lock);
+	pthread_cleanup_push(pgut_mutex_unlock, &ring_lock);
+	parray_append(free_rings, arg);
+	pthread_cleanup_pop(1);
+}
+
+static void
+io_ring_init_key(void)
+{
+	int			errnum;
+
+	free_rings = parray_new();
+	errnum = pthread_key_create(&ring_key, io_ring_release);
+	if (errnum != 0)
+		elog(ERROR, "cannot create key of io_uring rings: %s",
+			 strerror(errnum));
+}
+
+/*
+ * Return the ring of the calling thread, set up on its first use, or NULL
+ * if io_uring is not used.
+ */
+static struct io_uring *
+io_ring_get(void)
+{
+	struct io_uring *ring;
+	int			ret;
+
+	if (io_method != IO_METHOD_IO_URING || ring_failed)
+		return NULL;
+
+	pthread_once(&ring_key_once, io_ring_init_key);
+	ring = (struct io_uring *) pthread_getspecific(ring_key);
+	if (ring != NULL)
+		return ring;
+
+	pthread_mutex_lock(&ring_lock);
+	if (parray_num(free_rings) > 0)
+		ring = (struct io_uring *) parray_remove(free_rings,
+												 parray_num(free_rings) - 1);
+	pthread_mutex_unlock(&ring_lock);
+
+	if (ring == NULL)
+	{
+		ring = pgut_new(struct io_uring);
+		ret = io_uring_queue_init(IO_RING_ENTRIES, ring, 0);
+		if (ret < 0)
+		{
+			/* the kernel may not support it, or forbid it */
+			elog(LOG, "cannot set up io_uring, using synchronous I/O: %s",
+				 strerror(-ret));
+			free(ring);
+			ring_failed = true;
+			return NULL;
+		}
+	}
+
+	pthread_setspecific(ring_key, ring);
+	return ring;
+}
+
+static void
+io_batch_run_uring(IoBatch *batch, struct io_uring *ring, int fd,
+				   const char *path, bool write)
+{
+	int			first;
+	int			i;
+	int			ret;
+
+	for (first = 0; first < batch->nrequests; first += IO_RING_ENTRIES)
+	{
+		int			nrequests = Min(batch->nrequests - first, IO_RING_ENTRIES);
+
+		for (i = first; i < first + nrequests; i++)
+		{
+			IoRequest  *req = &batch->requests[i];
+			struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+
+			/* the ring is drained after each round */
+			Assert(sqe != NULL);
+
+			if (write)
+				io_uring_prep_write(sqe, fd, req->buf, req->len, req->offset);
+			else
+				io_uring_prep_read(sqe, fd, req->buf, req->len, req->offset);
+			io_uring_sqe_set_data(sqe, req);
+		}
+
+		ret = io_uring_submit(ring);
+		if (ret < 0)
+			elog(ERROR, "cannot submit I/O requests for \"%s\": %s",
+				 path, strerror(-ret));
+
+		for (i = 0; i < nrequests; i++)
+		{
+			struct io_uring_cqe *cqe;
+			IoRequest  *req;
+
+			do
+			{
+				ret = io_uring_wait_cqe(ring, &cqe);
+			} while (ret == -EINTR);
+			if (ret < 0)
+				elog(ERROR, "cannot wait for I/O requests on \"%s\": %s",
+					 path, strerror(-ret));
+
+			req = (IoRequest *) io_uring_cqe_get_data(cqe);
+			if (cqe->res < 0 && cqe->res != -EINTR && cqe->res != -EAGAIN)
+				elog(ERROR, "cannot %s \"%s\" at offset %llu: %s",
+					 write ? "write" : "read", path,
+					 (unsigned long long) req->offset, strerror(-cqe->res));
+			if (cqe->res > 0)
+				req->done = cqe->res;
+			io_uring_cqe_seen(ring, cqe);
+		}
+	}
+
+	/* short transfers and interrupted requests are finished synchronously */
+	io_batch_run_sync(batch, fd, path, write);
+}
+#endif
@@ -154,6 +154,11 @@ catalog_get_backup_list(const pgBackupRange *range)
 		if (strcmp(date_ent->d_name, RESTORE_WORK_DIR) == 0)
 			continue;
 
+		/* skip summaries of archived WAL segments and the dedup store */
+		if (strcmp(date_ent->d_name, WAL_SUMMARY_DIR) == 0 ||
+			strcmp(date_ent->d_name, DEDUP_DIR) == 0)
+			continue;
+
 		/* If the date is out of range, skip it. */
 		if (pgBackupRangeIsValid(range) &&
 				(strcmp(begin_date, date_ent->d_name) > 0 ||
@@ -290,6 +295,14 @@ pgBackupWriteConfigSection(FILE *out, pgBackup *backup)
 
 	fprintf(out, "# configuration\n");
 	fprintf(out, "BACKUP_MODE=%s\n", modes[backup->backup_mode]);
+	fprintf(out, "BACKUP_FORMAT=%s\n",
+			backup->backup_format == BACKUP_FORMAT_CONTAINER ? "container" : "plain");
+	fprintf(out, "COMPRESS_ALGORITHM=%s\n",
+			compress_alg2str(backup->compress_alg));
+	if (backup->compress_alg != COMPRESS_NONE)
+		fprintf(out, "COMPRESS_LEVEL=%d\n", backup->compress_level);
+	if (backup->dedup)
+		fprintf(out, "DEDUP=true\n");
 }
 
 /*
@@ -328,6 +341,9 @@ pgBackupWriteResultSection(FILE *out, pgBackup *backup)
 				backup->data_bytes);
 	fprintf(out, "BLOCK_SIZE=%u\n", backup->block_size);
 	fprintf(out, "XLOG_BLOCK_SIZE=%u\n", backup->wal_block_size);
+	if (backup->system_identifier != 0)
+		fprintf(out, "SYSTEM_IDENTIFIER=" UINT64_FORMAT "\n",
+				backup->system_identifier);
 
 	fprintf(out, "STATUS=%s\n", status2str(backup->status));
 }
@@ -338,11 +354,14 @@ pgBackupWriteIni(pgBackup *backup)
 {
 	FILE   *fp = NULL;
 	char	ini_path[MAXPGPATH];
+	char	tmp_path[MAXPGPATH];
 
+	/* written aside and renamed, so as a crash leaves the old or new one */
 	pgBackupGetPath(backup, ini_path, lengthof(ini_path), BACKUP_INI_FILE);
-	fp = fopen(ini_path, "wt");
+	snprintf(tmp_path, lengthof(tmp_path), "%s.tmp", ini_path);
+	fp = fopen(tmp_path, "wt");
 	if (fp == NULL)
-		elog(ERROR, "cannot open INI file \"%s\": %s", ini_path,
+		elog(ERROR, "cannot open INI file \"%s\": %s", tmp_path,
 			strerror(errno));
 
 	/* configuration section */
@@ -351,7 +370,10 @@ pgBackupWriteIni(pgBackup *backup)
 	/* result section */
 	pgBackupWriteResultSection(fp, backup);
 
-	fclose(fp);
+	if (fclose(fp) != 0)
+		elog(ERROR, "cannot write INI file \"%s\": %s", tmp_path,
+			strerror(errno));
+	durable_rename(tmp_path, ini_path);
 }
 
 /*
@@ -364,6 +386,8 @@ catalog_read_ini(const char *path)
 {
 	pgBackup   *backup;
 	char	   *backup_mode = NULL;
+	char	   *backup_format = NULL;
+	char	   *compress_alg = NULL;
 	char	   *start_lsn = NULL;
 	char	   *stop_lsn = NULL;
 	char	   *status = NULL;
@@ -372,6 +396,10 @@ catalog_read_ini(const char *path)
 	pgut_option options[] =
 	{
 		{ 's', 0, "backup-mode"			, NULL, SOURCE_ENV },
+		{ 's', 0, "backup-format"		, NULL, SOURCE_ENV },
+		{ 's', 0, "compress-algorithm"	, NULL, SOURCE_ENV },
+		{ 'i', 0, "compress-level"		, NULL, SOURCE_ENV },
+		{ 'b', 0, "dedup"				, NULL, SOURCE_ENV },
 		{ 'u', 0, "timelineid"			, NULL, SOURCE_ENV },
 		{ 's', 0, "start-lsn"			, NULL, SOURCE_ENV },
 		{ 's', 0, "stop-lsn"			, NULL, SOURCE_ENV },
@@ -382,6 +410,7 @@ catalog_read_ini(const char *path)
 		{ 'I', 0, "data-bytes"		, NULL, SOURCE_ENV },
 		{ 'u', 0, "block-size"			, NULL, SOURCE_ENV },
 		{ 'u', 0, "xlog-block-size"		, NULL, SOURCE_ENV },
+		{ 'U', 0, "system-identifier"	, NULL, SOURCE_ENV },
 		{ 's', 0, "status"				, NULL, SOURCE_ENV },
 		{ 0 }
 	};
@@ -394,6 +423,10 @@ catalog_read_ini(const char *path)
 
 	i = 0;
 	options[i++].var = &backup_mode;
+	options[i++].var = &backup_format;
+	options[i++].var = &compress_alg;
+	options[i++].var = &backup->compress_level;
+	options[i++].var = &backup->dedup;
 	options[i++].var = &backup->tli;
 	options[i++].var = &start_lsn;
 	options[i++].var = &stop_lsn;
@@ -404,6 +437,7 @@ catalog_read_ini(const char *path)
 	options[i++].var = &backup->data_bytes;
 	options[i++].var = &backup->block_size;
 	options[i++].var = &backup->wal_block_size;
+	options[i++].var = &backup->system_identifier;
 	options[i++].var = &status;
 	Assert(i == lengthof(options) - 1);
 
@@ -415,6 +449,20 @@ catalog_read_ini(const char *path)
 		free(backup_mode);
 	}
 
+	/* backups taken without this setting are plain */
+	if (backup_format)
+	{
+		backup->backup_format = parse_backup_format(backup_format);
+		free(backup_format);
+	}
+
+	/* backups taken without this setting are not compressed */
+	if (compress_alg)
+	{
+		backup->compress_alg = parse_compress_algorithm(compress_alg);
+		free(compress_alg);
+	}
+
 	if (start_lsn)
 	{
 		uint32 xlogid;
@@ -484,6 +532,40 @@ parse_backup_mode(const char *value)
 	return BACKUP_MODE_INVALID;
 }
 
+BackupFormat
+parse_backup_format(const char *value)
+{
+	if (pg_strcasecmp(value, "plain") == 0)
+		return BACKUP_FORMAT_PLAIN;
+	else if (pg_strcasecmp(value, "container") == 0)
+		return BACKUP_FORMAT_CONTAINER;
+
+	elog(ERROR, "invalid backup-format \"%s\"", value);
+	return BACKUP_FORMAT_PLAIN;
+}
+
+CompressAlg
+parse_compress_algorithm(const char *value)
+{
+	if (pg_strcasecmp(value, "none") == 0)
+		return COMPRESS_NONE;
+	else if (pg_strcasecmp(value, "pglz") == 0)
+		return COMPRESS_PGLZ;
+	else if (pg_strcasecmp(value, "zlib") == 0)
+		return COMPRESS_ZLIB;
+
+	elog(ERROR, "invalid compress-algorithm \"%s\"", value);
+	return COMPRESS_NONE;
+}
+
+const char *
+compress_alg2str(CompressAlg alg)
+{
+	static const char *names[] = { "none", "pglz", "zlib" };
+
+	return names[alg];
+}
+
 /* free pgBackup object */
 void
 pgBackupFree(void *backup)
@@ -545,4 +627,9 @@ catalog_init_config(pgBackup *backup)
 	backup->recovery_xid = 0;
 	backup->recovery_time = (time_t) 0;
 	backup->data_bytes = BYTES_INVALID;
+	backup->backup_format = BACKUP_FORMAT_PLAIN;
+	backup->compress_alg = COMPRESS_NONE;
+	backup->compress_level = 1;
+	backup->dedup = false;
+	backup->system_identifier = 0;
 }
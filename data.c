@@ -9,11 +9,24 @@
 
 #include "pg_arman.h"
 
+#include <fcntl.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+
+#include "common/pg_lzcompress.h"
 #include "libpq/pqsignal.h"
 #include "storage/block.h"
 #include "storage/bufpage.h"
@@ -29,8 +42,89 @@ typedef struct BackupPageHeader
 	BlockNumber	block;			/* block number */
 	uint16		hole_offset;	/* number of bytes before "hole" */
 	uint16		hole_length;	/* number of bytes in "hole" */
+	/* the following fields are only present in compressed backups */
+	uint16		flags;			/* BACKUP_PAGE_* */
+	uint16		compressed_size;	/* number of bytes following the header */
 } BackupPageHeader;
 
+/* page data compressed, else stored as is because it did not compress */
+#define BACKUP_PAGE_COMPRESSED	0x0001
+/* page data saved in the dedup store, its hash follows the header */
+#define BACKUP_PAGE_DEDUP		0x0002
+
+/* size of the page header in backups with or without compression or dedup */
+#define BACKUP_PAGE_HEADER_SIZE(backup) \
+	((backup)->compress_alg == COMPRESS_NONE && !(backup)->dedup ? \
+	 offsetof(BackupPageHeader, flags) : sizeof(BackupPageHeader))
+
+/* large enough for any compressed page */
+#define COMPRESS_BUFSIZE		(2 * BLCKSZ)
+
+/* largest number of blocks read by one request when backing up a file */
+#define READ_EXTENT_BLOCKS	128
+
+/* largest number of blocks and requests of a batch of reads */
+#define READ_BATCH_BLOCKS	512
+#define READ_BATCH_REQUESTS	32
+
+/* largest number of pages written at once when restoring a file */
+#define WRITE_BATCH_BLOCKS	64
+
+/* largest number of bytes copied by one call of copy_file_range() */
+#define COPY_RANGE_SIZE		(64 * 1024 * 1024)
+#define COPY_THROTTLED_SIZE	(1024 * 1024)
+
+/* range of changed blocks, read by a request of a batch */
+typedef struct BlockRange
+{
+	BlockNumber	start;
+	BlockNumber	nblocks;
+	int			extent;			/* request of the batch reading it */
+} BlockRange;
+
+/* number of batches of a data file being read or backed up at once */
+#define READ_AHEAD_SLOTS	2
+
+/* batch of extents of a data file, read ahead of the backup of its pages */
+typedef struct ReadSlot
+{
+	char	   *buf;			/* extents are read here */
+	IoBatch    *batch;
+	BlockRange *ranges;			/* blocks to back up, by extent */
+	int			nranges;
+	bool		filled;			/* read, and not backed up yet */
+	bool		last;			/* no batch follows this one */
+} ReadSlot;
+
+/*
+ * Reader of the batches of extents of a data file being backed up. For a
+ * file larger than one batch, a thread reads the next batches while the
+ * pages of the current one are checked and written, so as the disk and the
+ * CPU work at the same time. At most READ_AHEAD_SLOTS batches are then in
+ * memory, and the slots are used in turn.
+ */
+typedef struct PageReader
+{
+	int			fd;
+	pgFile	   *file;
+	BlockNumber	batch_blocks;	/* size of the buffer of a slot */
+	BlockNumber	first_block;	/* blocks read, of the chunk being backed up */
+	BlockNumber	end_block;
+	BlockNumber	next_block;		/* next block of a full scan */
+	datapagemap_iterator_t *iter;	/* else next range of the page map */
+	BlockNumber	start;
+	BlockNumber	nblocks;
+	bool		pending;
+	ReadSlot	slots[READ_AHEAD_SLOTS];
+	int			nslots;
+	bool		threaded;
+	pthread_t	thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;		/* a slot has been filled or released */
+	bool		stop;			/* the reader thread must exit */
+	bool		failed;			/* the reader thread stopped on an error */
+} PageReader;
+
 static bool
 parse_page(const DataPage *page,
 		   XLogRecPtr *lsn, uint16 *offset, uint16 *length)
@@ -60,376 +154,1670 @@ parse_page(const DataPage *page,
 }
 
 /*
- * Backup data file in the from_root directory to the to_root directory with
- * same relative path.
- * If lsn is not NULL, pages only which are modified after the lsn will be
- * copied.
+ * Compress src into dst with the given algorithm. Return the size of the
+ * compressed data, or -1 if it could not be compressed.
  */
-bool
-backup_data_file(const char *from_root, const char *to_root,
-				 pgFile *file, const XLogRecPtr *lsn)
+static int
+compress_page_data(char *dst, size_t dst_size, const char *src,
+				   size_t src_size, CompressAlg alg, int level)
 {
-	char				to_path[MAXPGPATH];
-	FILE			   *in;
-	FILE			   *out;
-	BackupPageHeader	header;
-	DataPage			page;		/* used as read buffer */
-	BlockNumber			blknum = 0;
-	size_t				read_len = 0;
-	pg_crc32			crc;
-	off_t				offset;
+	switch (alg)
+	{
+		case COMPRESS_PGLZ:
+			return pglz_compress(src, src_size, dst, PGLZ_strategy_always);
+		case COMPRESS_ZLIB:
+#ifdef HAVE_LIBZ
+			{
+				uLongf		len = dst_size;
 
-	INIT_CRC32C(crc);
+				if (compress2((Bytef *) dst, &len, (const Bytef *) src,
+							  src_size, level) != Z_OK)
+					return -1;
+				return (int) len;
+			}
+#endif
+		case COMPRESS_NONE:
+			break;
+	}
 
-	/* reset size summary */
-	file->read_size = 0;
-	file->write_size = 0;
+	return -1;
+}
 
-	/* open backup mode file for read */
-	in = fopen(file->path, "r");
-	if (in == NULL)
+/*
+ * Decompress src into dst, which must end up with exactly dst_size bytes.
+ * Return false if the data is broken.
+ */
+static bool
+decompress_page_data(char *dst, size_t dst_size, const char *src,
+					 size_t src_size, CompressAlg alg)
+{
+	switch (alg)
 	{
-		FIN_CRC32C(crc);
-		file->crc = crc;
+		case COMPRESS_PGLZ:
+			return pglz_decompress(src, src_size, dst, dst_size) == (int32) dst_size;
+		case COMPRESS_ZLIB:
+#ifdef HAVE_LIBZ
+			{
+				uLongf		len = dst_size;
 
-		/* maybe vanished, it's not error */
-		if (errno == ENOENT)
-			return false;
+				return uncompress((Bytef *) dst, &len, (const Bytef *) src,
+								  src_size) == Z_OK && len == dst_size;
+			}
+#else
+			elog(ERROR, "zlib compression is not supported by this build of pg_arman");
+#endif
+		case COMPRESS_NONE:
+			break;
+	}
 
-		elog(ERROR, "cannot open backup mode file \"%s\": %s",
-			 file->path, strerror(errno));
+	return false;
+}
+
+/*
+ * Open the output receiving the backup of file. It is a file of its own
+ * under to_root, or the end of container, whose position is then recorded
+ * into file. to_path receives the path of the output.
+ */
+static FILE *
+open_backup_output(const char *from_root, const char *to_root,
+				   pgFile *file, pgContainer *container, char *to_path)
+{
+	FILE	   *out;
+
+	if (container != NULL)
+	{
+		strlcpy(to_path, container->path, MAXPGPATH);
+		file->container = container->id;
+		file->container_offset = (int64) ftello(container->fp);
+		if (file->container_offset < 0)
+			elog(ERROR, "cannot get position in \"%s\": %s",
+				 to_path, strerror(errno));
+		return container->fp;
 	}
 
-	/* open backup file for write  */
 	if (check)
-		snprintf(to_path, lengthof(to_path), "%s/tmp", backup_path);
+		snprintf(to_path, MAXPGPATH, "%s/tmp", backup_path);
 	else
 		join_path_components(to_path, to_root, file->path + strlen(from_root) + 1);
 	out = fopen(to_path, "w");
 	if (out == NULL)
+		elog(ERROR, "cannot open backup file \"%s\": %s",
+			 to_path, strerror(errno));
+
+	return out;
+}
+
+/*
+ * Forget what has been written of the backup of file into container, so as
+ * the next file overwrites it.
+ */
+static void
+discard_backup_output(pgFile *file, pgContainer *container)
+{
+	if (fflush(container->fp) != 0 ||
+		ftruncate(fileno(container->fp), (off_t) file->container_offset) != 0 ||
+		fseeko(container->fp, (off_t) file->container_offset, SEEK_SET) != 0)
+		elog(ERROR, "cannot truncate \"%s\": %s", container->path,
+			 strerror(errno));
+
+	file->container = -1;
+	file->container_offset = 0;
+}
+
+/*
+ * Close the backup of a file written to a file of its own, dropping it from
+ * the page cache if asked for. It is up to the caller to hand it over to be
+ * synced once it is sure to be kept.
+ */
+static void
+close_backup_output(FILE *out, const char *to_path)
+{
+	if (cache_policy != CACHE_POLICY_KEEP && !check)
+	{
+		if (fflush(out) != 0)
+			elog(ERROR, "cannot write to \"%s\": %s", to_path,
+				 strerror(errno));
+		io_drop_cache(fileno(out), to_path, 0, 0, true);
+	}
+	fclose(out);
+}
+
+/*
+ * Open the backup of file for read, positioned at its start. It is either
+ * file->path or a part of a container of the database directory from_root.
+ */
+static FILE *
+open_backup_input(const char *from_root, pgFile *file)
+{
+	char		path[MAXPGPATH];
+	FILE	   *in;
+
+	if (file->container < 0)
+		return fopen(file->path, "r");
+
+	pgFileGetContainerPath(from_root, file, path);
+	in = fopen(path, "r");
+	if (in != NULL &&
+		fseeko(in, (off_t) file->container_offset, SEEK_SET) != 0)
 	{
 		int errno_tmp = errno;
 		fclose(in);
-		elog(ERROR, "cannot open backup file \"%s\": %s",
-			 to_path, strerror(errno_tmp));
+		errno = errno_tmp;
+		return NULL;
 	}
 
-	/* confirm server version */
-	check_server_version();
+	return in;
+}
 
-	/*
-	 * Read each page and write the page excluding hole. If it has been
-	 * determined that the page can be copied safely, but no page map
-	 * has been built, it means that we are in presence of a relation
-	 * file that needs to be completely scanned. If a page map is present
-	 * only scan the blocks needed. In each case, pages are copied without
-	 * their hole to ensure some basic level of compression.
-	 */
-	if (file->pagemap.bitmapsize == 0)
+/*
+ * Write a data page read from the file being backed up, excluding its
+ * hole and compressed if the backup is. Pages not modified since lsn are
+ * skipped. The sizes and CRC of the backup are accumulated into result.
+ * Return false if the page is not a valid data page.
+ */
+static bool
+backup_data_page(DataPage *page, BlockNumber blknum, const XLogRecPtr *lsn,
+				 FILE *out, const char *to_path, pgFileChunk *result)
+{
+	BackupPageHeader	header;
+	size_t				header_size = BACKUP_PAGE_HEADER_SIZE(&current);
+	XLogRecPtr			page_lsn;
+	int					upper_offset;
+	int					upper_length;
+	char				raw[BLCKSZ];	/* page data without its hole */
+	char				compressed[COMPRESS_BUFSIZE];
+	uint8				hash[DEDUP_HASH_LEN];
+	char			   *data;
+	int					data_len;
+
+	memset(&header, 0, sizeof(header));
+	header.block = blknum;
+
+	if (!parse_page(page, &page_lsn, &header.hole_offset, &header.hole_length))
+		return false;
+
+	result->read_size += BLCKSZ;
+
+	/* if the page has not been modified since last backup, skip it */
+	if (lsn && !XLogRecPtrIsInvalid(page_lsn) && page_lsn < *lsn)
+		return true;
+
+	upper_offset = header.hole_offset + header.hole_length;
+	upper_length = BLCKSZ - upper_offset;
+
+	/* data page excluding hole */
+	memcpy(raw, page->data, header.hole_offset);
+	memcpy(raw + header.hole_offset, page->data + upper_offset, upper_length);
+	data = raw;
+	data_len = header.hole_offset + upper_length;
+
+	/* pages which do not get smaller are stored as is */
+	if (current.compress_alg != COMPRESS_NONE)
 	{
-		for (blknum = 0;
-			 (read_len = fread(&page, 1, sizeof(page), in)) == sizeof(page);
-			 ++blknum)
+		int		compressed_len;
+
+		compressed_len = compress_page_data(compressed, sizeof(compressed),
+											raw, data_len,
+											current.compress_alg,
+											current.compress_level);
+		if (compressed_len > 0 && compressed_len < data_len)
 		{
-			XLogRecPtr	page_lsn;
-			int		upper_offset;
-			int		upper_length;
-
-			header.block = blknum;
-
-			/*
-			 * If an invalid data page was found, fallback to simple copy to ensure
-			 * all pages in the file don't have BackupPageHeader.
-			 */
-			if (!parse_page(&page, &page_lsn,
-							&header.hole_offset, &header.hole_length))
-			{
-				elog(LOG, "%s fall back to simple copy", file->path);
-				fclose(in);
-				fclose(out);
-				file->is_datafile = false;
-				return copy_file(from_root, to_root, file);
-			}
+			header.flags |= BACKUP_PAGE_COMPRESSED;
+			data = compressed;
+			data_len = compressed_len;
+		}
+		header.compressed_size = data_len;
+	}
 
-			file->read_size += read_len;
+	/* pages of deduplicated backups are saved as the hash of their data */
+	if (current.dedup && !check)
+	{
+		dedup_put(data, data_len, hash);
+		header.flags |= BACKUP_PAGE_DEDUP;
+		header.compressed_size = data_len;
+		data = (char *) hash;
+		data_len = DEDUP_HASH_LEN;
+	}
 
-			/* if the page has not been modified since last backup, skip it */
-			if (lsn && !XLogRecPtrIsInvalid(page_lsn) && page_lsn < *lsn)
-				continue;
+	if (fwrite(&header, 1, header_size, out) != header_size ||
+		fwrite(data, 1, data_len, out) != data_len)
+	{
+		/* out is left to the caller, being maybe a container */
+		elog(ERROR, "cannot write at block %u of \"%s\": %s",
+			 blknum, to_path, strerror(errno));
+	}
 
-			upper_offset = header.hole_offset + header.hole_length;
-			upper_length = BLCKSZ - upper_offset;
+	/* update CRC */
+	COMP_CRC32C(result->crc, &header, header_size);
+	COMP_CRC32C(result->crc, data, data_len);
 
-			/* write data page excluding hole */
-			if (fwrite(&header, 1, sizeof(header), out) != sizeof(header) ||
-				fwrite(page.data, 1, header.hole_offset, out) != header.hole_offset ||
-				fwrite(page.data + upper_offset, 1, upper_length, out) != upper_length)
-			{
-				int errno_tmp = errno;
-				/* oops */
-				fclose(in);
-				fclose(out);
-				elog(ERROR, "cannot write at block %u of \"%s\": %s",
-					 blknum, to_path, strerror(errno_tmp));
-			}
+	result->write_size += header_size + data_len;
 
-			/* update CRC */
-			COMP_CRC32C(crc, &header, sizeof(header));
-			COMP_CRC32C(crc, page.data, header.hole_offset);
-			COMP_CRC32C(crc, page.data + upper_offset, upper_length);
+	return true;
+}
+
+/*
+ * Move to the next range of changed blocks of the page map, clipped to the
+ * blocks read. Return false if there is none left.
+ */
+static bool
+page_reader_next_range(PageReader *reader)
+{
+	while (datapagemap_next_range(reader->iter, &reader->start,
+								  &reader->nblocks))
+	{
+		if (reader->start >= reader->end_block)
+			return false;
+		if (reader->start + reader->nblocks <= reader->first_block)
+			continue;
 
-			file->write_size += sizeof(header) + read_len - header.hole_length;
+		if (reader->start < reader->first_block)
+		{
+			reader->nblocks -= reader->first_block - reader->start;
+			reader->start = reader->first_block;
 		}
+		reader->nblocks = Min(reader->nblocks,
+							  reader->end_block - reader->start);
+		return true;
 	}
-	else
+
+	return false;
+}
+
+/*
+ * Read the next batch of extents of the file into slot. With a page map,
+ * ranges of changed blocks separated by no more than max_read_gap unchanged
+ * blocks are read as one extent, the unchanged blocks being then ignored.
+ * Else the blocks are read in order up to the end of the file.
+ */
+static void
+page_reader_fill(PageReader *reader, ReadSlot *slot)
+{
+	IoBatch    *batch = slot->batch;
+	BlockNumber	used = 0;	/* blocks of buf used by the batch */
+	int			i;
+
+	io_batch_reset(batch);
+	slot->nranges = 0;
+	slot->last = false;
+
+	if (!reader->file->pagemap_valid)
+	{
+		while (used < reader->batch_blocks &&
+			   reader->next_block + used < reader->end_block &&
+			   batch->nrequests < batch->maxrequests)
+		{
+			BlockNumber	n = Min(READ_EXTENT_BLOCKS, reader->batch_blocks - used);
+
+			n = Min(n, reader->end_block - (reader->next_block + used));
+
+			slot->ranges[slot->nranges].start = reader->next_block + used;
+			slot->ranges[slot->nranges].nblocks = n;
+			slot->ranges[slot->nranges].extent = batch->nrequests;
+			slot->nranges++;
+			io_batch_add(batch, slot->buf + (size_t) used * BLCKSZ,
+						 (size_t) n * BLCKSZ,
+						 (off_t) (reader->next_block + used) * BLCKSZ);
+			used += n;
+		}
+		reader->next_block += used;
+
+		io_batch_read(batch, reader->fd, reader->file->path);
+
+		/* a short read is the end of the file */
+		slot->last = (reader->next_block >= reader->end_block);
+		for (i = 0; i < batch->nrequests; i++)
+			if (batch->requests[i].done < batch->requests[i].len)
+				slot->last = true;
+		return;
+	}
+
+	/* gather extents until the batch or its buffer is full */
+	while (reader->pending && used < reader->batch_blocks &&
+		   batch->nrequests < batch->maxrequests)
+	{
+		BlockNumber	ext_start = reader->start;
+		BlockNumber	ext_end;
+		BlockNumber	limit = Min(READ_EXTENT_BLOCKS, reader->batch_blocks - used);
+
+		/* gather the ranges of changed blocks of this extent */
+		for (;;)
+		{
+			BlockNumber	take = Min(reader->nblocks,
+								   ext_start + limit - reader->start);
+
+			slot->ranges[slot->nranges].start = reader->start;
+			slot->ranges[slot->nranges].nblocks = take;
+			slot->ranges[slot->nranges].extent = batch->nrequests;
+			slot->nranges++;
+			ext_end = reader->start + take;
+			reader->start += take;
+			reader->nblocks -= take;
+
+			/* the rest of a range too long stays for the next extent */
+			if (reader->nblocks > 0)
+				break;
+
+			reader->pending = page_reader_next_range(reader);
+			if (!reader->pending ||
+				reader->start - ext_end > (BlockNumber) max_read_gap ||
+				reader->start >= ext_start + limit)
+				break;
+		}
+
+		io_batch_add(batch, slot->buf + (size_t) used * BLCKSZ,
+					 (size_t) (ext_end - ext_start) * BLCKSZ,
+					 (off_t) ext_start * BLCKSZ);
+		used += ext_end - ext_start;
+	}
+
+	io_batch_read(batch, reader->fd, reader->file->path);
+	slot->last = !reader->pending;
+}
+
+/*
+ * Wake up the thread waiting for a slot when the reader thread stops on an
+ * error.
+ */
+static void
+page_reader_failed(void *arg)
+{
+	PageReader *reader = (PageReader *) arg;
+
+	pthread_mutex_lock(&reader->lock);
+	reader->failed = true;
+	pthread_cond_broadcast(&reader->cond);
+	pthread_mutex_unlock(&reader->lock);
+}
+
+/*
+ * Main of the reader thread, filling the slots in turn as soon as their
+ * pages have been backed up.
+ */
+static void *
+page_reader_main(void *arg)
+{
+	PageReader *reader = (PageReader *) arg;
+	int			i;
+
+	pthread_cleanup_push(page_reader_failed, reader);
+	for (i = 0;; i = (i + 1) % reader->nslots)
+	{
+		ReadSlot   *slot = &reader->slots[i];
+		bool		stop;
+
+		pthread_mutex_lock(&reader->lock);
+		while (slot->filled && !reader->stop)
+			pthread_cond_wait(&reader->cond, &reader->lock);
+		stop = reader->stop;
+		pthread_mutex_unlock(&reader->lock);
+		if (stop)
+			break;
+
+		page_reader_fill(reader, slot);
+
+		pthread_mutex_lock(&reader->lock);
+		slot->filled = true;
+		pthread_cond_broadcast(&reader->cond);
+		pthread_mutex_unlock(&reader->lock);
+
+		if (slot->last)
+			break;
+	}
+	pthread_cleanup_pop(0);
+
+	return NULL;
+}
+
+/*
+ * Start reading the pages of file to back up from fd, from block first_block
+ * up to end_block excluded, or up to the end of the file if end_block is
+ * InvalidBlockNumber.
+ */
+static void
+page_reader_start(PageReader *reader, int fd, pgFile *file,
+				  BlockNumber first_block, BlockNumber end_block)
+{
+	BlockNumber	nblocks = (BlockNumber) (file->size / BLCKSZ) + 1;
+	int			i;
+
+	memset(reader, 0, sizeof(PageReader));
+	reader->fd = fd;
+	reader->file = file;
+	reader->first_block = first_block;
+	reader->end_block = end_block;
+	reader->next_block = first_block;
+
+	/* small files do not need the whole buffer */
+	if (end_block != InvalidBlockNumber)
+		nblocks = end_block - first_block;
+	else if (nblocks > first_block)
+		nblocks -= first_block;
+	reader->batch_blocks = Min(READ_BATCH_BLOCKS, nblocks);
+
+	if (file->pagemap_valid)
+	{
+		reader->iter = datapagemap_iterate(&file->pagemap);
+		reader->pending = page_reader_next_range(reader);
+	}
+
+	reader->threaded = (nblocks > READ_BATCH_BLOCKS);
+	reader->nslots = reader->threaded ? READ_AHEAD_SLOTS : 1;
+	for (i = 0; i < reader->nslots; i++)
+	{
+		ReadSlot   *slot = &reader->slots[i];
+
+		slot->buf = io_buffer_alloc((size_t) reader->batch_blocks * BLCKSZ);
+		slot->batch = io_batch_new(READ_BATCH_REQUESTS);
+		/* each range of a batch has at least one block of the buffer */
+		slot->ranges = pgut_newarray(BlockRange, reader->batch_blocks);
+	}
+
+	if (reader->threaded)
+	{
+		int			errnum;
+
+		pthread_mutex_init(&reader->lock, NULL);
+		pthread_cond_init(&reader->cond, NULL);
+		errnum = pthread_create(&reader->thread, NULL, page_reader_main, reader);
+		if (errnum != 0)
+			elog(ERROR, "cannot create reader thread: %s", strerror(errnum));
+	}
+}
+
+/*
+ * Return the i-th slot once it holds the next batch of extents read.
+ */
+static ReadSlot *
+page_reader_next(PageReader *reader, int i)
+{
+	ReadSlot   *slot = &reader->slots[i];
+
+	if (!reader->threaded)
+	{
+		page_reader_fill(reader, slot);
+		return slot;
+	}
+
+	pthread_mutex_lock(&reader->lock);
+	while (!slot->filled && !reader->failed)
+		pthread_cond_wait(&reader->cond, &reader->lock);
+	pthread_mutex_unlock(&reader->lock);
+
+	/* the error has been reported by the reader thread */
+	if (!slot->filled)
+		elog(ERROR, "reader thread of \"%s\" failed", reader->file->path);
+
+	return slot;
+}
+
+/*
+ * Give back a slot whose pages have been backed up, to read the next batch.
+ */
+static void
+page_reader_release(PageReader *reader, ReadSlot *slot)
+{
+	if (!reader->threaded)
+		return;
+
+	pthread_mutex_lock(&reader->lock);
+	slot->filled = false;
+	pthread_cond_broadcast(&reader->cond);
+	pthread_mutex_unlock(&reader->lock);
+}
+
+/*
+ * Stop reading, even if the file has not been read up to its end.
+ */
+static void
+page_reader_end(PageReader *reader)
+{
+	int			i;
+
+	if (reader->threaded)
+	{
+		pthread_mutex_lock(&reader->lock);
+		reader->stop = true;
+		pthread_cond_broadcast(&reader->cond);
+		pthread_mutex_unlock(&reader->lock);
+
+		pthread_join(reader->thread, NULL);
+		pthread_mutex_destroy(&reader->lock);
+		pthread_cond_destroy(&reader->cond);
+	}
+
+	for (i = 0; i < reader->nslots; i++)
+	{
+		io_batch_free(reader->slots[i].batch);
+		free(reader->slots[i].buf);
+		free(reader->slots[i].ranges);
+	}
+	if (reader->iter != NULL)
+		pg_free(reader->iter);
+}
+
+/*
+ * Back up the pages of file read from in, from block first_block up to
+ * end_block excluded, into out. The sizes and CRC of the backup are
+ * accumulated into result. Return false if an invalid page was found.
+ */
+static bool
+backup_data_blocks(pgFile *file, int in, FILE *out, const char *to_path,
+				   const XLogRecPtr *lsn, BlockNumber first_block,
+				   BlockNumber end_block, pgFileChunk *result)
+{
+	PageReader			reader;
+	int					i;
+	BlockNumber			blknum;
+	bool				valid = true;
+
+	/*
+	 * Read each page and write the page excluding hole. If the page map
+	 * has not been built from WAL covering all the changes of the file,
+	 * the relation file needs to be completely scanned. Otherwise only
+	 * scan the blocks of the page map. In each case, pages are copied without
+	 * their hole to ensure some basic level of compression.
+	 *
+	 * The batches of extents are read by a PageReader, ahead of the pages
+	 * being backed up here for the files large enough.
+	 */
+	page_reader_start(&reader, in, file, first_block, end_block);
+	for (i = 0; valid; i = (i + 1) % reader.nslots)
 	{
-		datapagemap_iterator_t *iter;
+		ReadSlot   *slot = page_reader_next(&reader, i);
+		int			r;
 
-		iter = datapagemap_iterate(&file->pagemap);
-		while (datapagemap_next(iter, &blknum))
+		for (r = 0; r < slot->nranges && valid; r++)
 		{
-			XLogRecPtr	page_lsn;
-			int		upper_offset;
-			int		upper_length;
-			int 	ret;
+			IoRequest  *req = &slot->batch->requests[slot->ranges[r].extent];
+			BlockNumber	ext_start = (BlockNumber) (req->offset / BLCKSZ);
+			BlockNumber	nread = req->done / BLCKSZ;
 
-			offset = blknum * BLCKSZ;
-			if (offset > 0)
+			for (blknum = slot->ranges[r].start;
+				 blknum < slot->ranges[r].start + slot->ranges[r].nblocks && valid;
+				 blknum++)
 			{
-				ret = fseek(in, offset, SEEK_SET);
-				if (ret != 0)
-					elog(ERROR,
-						 "Can't seek in file offset: %llu ret:%i\n",
-						 (long long unsigned int) offset, ret);
+				/* end of file, or the file has been truncated since */
+				if (blknum - ext_start >= nread)
+					break;
+
+				valid = backup_data_page(
+							(DataPage *) (req->buf + (size_t) (blknum - ext_start) * BLCKSZ),
+							blknum, lsn, out, to_path, result);
 			}
-			read_len = fread(&page, 1, sizeof(page), in);
+		}
+
+		if (slot->last)
+			break;
+		page_reader_release(&reader, slot);
+	}
+	page_reader_end(&reader);
+
+	return valid;
+}
+
+/*
+ * Backup data file in the from_root directory to the to_root directory with
+ * same relative path.
+ * If lsn is not NULL, pages only which are modified after the lsn will be
+ * copied.
+ */
+bool
+backup_data_file(const char *from_root, const char *to_root,
+				 pgFile *file, const XLogRecPtr *lsn,
+				 pgContainer *container)
+{
+	char				to_path[MAXPGPATH];
+	int					in;
+	FILE			   *out;
+	pgFileChunk			whole;
+	bool				valid;
+
+	memset(&whole, 0, sizeof(whole));
+	INIT_CRC32C(whole.crc);
+
+	/* reset size summary */
+	file->read_size = 0;
+	file->write_size = 0;
+
+	/* open backup mode file for read */
+	in = io_open_data_file(file->path);
+	if (in == -1)
+	{
+		FIN_CRC32C(whole.crc);
+		file->crc = whole.crc;
+
+		/* maybe vanished, it's not error */
+		if (errno == ENOENT)
+			return false;
+
+		elog(ERROR, "cannot open backup mode file \"%s\": %s",
+			 file->path, strerror(errno));
+	}
+
+	/* open backup file for write  */
+	out = open_backup_output(from_root, to_root, file, container, to_path);
+
+	/* confirm server version */
+	check_server_version();
+
+	valid = backup_data_blocks(file, in, out, to_path, lsn, 0,
+							   InvalidBlockNumber, &whole);
+	file->read_size = whole.read_size;
+	file->write_size = whole.write_size;
+
+	/*
+	 * If an invalid data page was found, fallback to simple copy to ensure
+	 * all pages in the file don't have BackupPageHeader.
+	 */
+	if (!valid)
+	{
+		elog(LOG, "%s fall back to simple copy", file->path);
+		close(in);
+		if (container != NULL)
+			discard_backup_output(file, container);
+		else
+			fclose(out);
+		file->is_datafile = false;
+		return copy_file(from_root, to_root, file, container, true);
+	}
+
+	/*
+	 * update file permission, containers being left open for the next files
+	 * FIXME: Should set permission on open?
+	 */
+	if (container == NULL && !check && chmod(to_path, FILE_PERMISSION) == -1)
+	{
+		int errno_tmp = errno;
+		close(in);
+		fclose(out);
+		elog(ERROR, "cannot change mode of \"%s\": %s", file->path,
+			 strerror(errno_tmp));
+	}
+
+	close(in);
+	if (container == NULL)
+		close_backup_output(out, to_path);
+
+	/* finish CRC calculation and store into pgFile */
+	FIN_CRC32C(whole.crc);
+	file->crc = whole.crc;
+
+	/* Treat empty file as not-datafile */
+	if (file->read_size == 0)
+		file->is_datafile = false;
+
+	/* We do not backup if all pages skipped. */
+	if (file->write_size == 0 && file->read_size > 0)
+	{
+		if (container != NULL)
+		{
+			file->container = -1;
+			file->container_offset = 0;
+		}
+		else if (remove(to_path) == -1)
+			elog(ERROR, "cannot remove file \"%s\": %s", to_path,
+				 strerror(errno));
+		return false;
+	}
+
+	/* remove $BACKUP_PATH/tmp created during check */
+	if (check)
+		remove(to_path);
+	else if (container == NULL)
+		sync_file(to_path);
+
+	return true;
+}
+
+/*
+ * Multiply the 32x32 matrix over GF(2) mat by the vector vec.
+ */
+static uint32
+gf2_matrix_times(const uint32 *mat, uint32 vec)
+{
+	uint32		sum = 0;
+
+	for (; vec != 0; vec >>= 1, mat++)
+		if (vec & 1)
+			sum ^= *mat;
+	return sum;
+}
+
+static void
+gf2_matrix_square(uint32 *square, const uint32 *mat)
+{
+	int			n;
+
+	for (n = 0; n < 32; n++)
+		square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+/*
+ * Return the CRC-32C of the concatenation of two blocks of data, given crc1
+ * of the first one and crc2 of the second one of len2 bytes. The CRC of the
+ * first one is shifted by len2 zero bytes by applying the squares of the
+ * operator shifting a CRC by one zero bit, as done by crc32_combine() of
+ * zlib.
+ */
+static pg_crc32
+crc32c_combine(pg_crc32 crc1, pg_crc32 crc2, int64 len2)
+{
+	uint32		even[32];	/* operator for 2^n zero bits, n even */
+	uint32		odd[32];	/* operator for 2^n zero bits, n odd */
+	uint32		row;
+	int			n;
+
+	if (len2 <= 0)
+		return crc1;
+
+	/* operator for one zero bit, of the reflected Castagnoli polynomial */
+	odd[0] = 0x82F63B78;
+	row = 1;
+	for (n = 1; n < 32; n++)
+	{
+		odd[n] = row;
+		row <<= 1;
+	}
+	gf2_matrix_square(even, odd);	/* two zero bits */
+	gf2_matrix_square(odd, even);	/* four zero bits */
+
+	/* apply len2 zero bytes, the first square being for one zero byte */
+	do
+	{
+		gf2_matrix_square(even, odd);
+		if (len2 & 1)
+			crc1 = gf2_matrix_times(even, crc1);
+		len2 >>= 1;
+		if (len2 == 0)
+			break;
+
+		gf2_matrix_square(odd, even);
+		if (len2 & 1)
+			crc1 = gf2_matrix_times(odd, crc1);
+		len2 >>= 1;
+	} while (len2 != 0);
+
+	return crc1 ^ crc2;
+}
+
+/*
+ * Path of the backup of the chunkno-th chunk of file, the first chunk being
+ * written to the backup of the file itself.
+ */
+static void
+get_chunk_path(const char *from_root, const char *to_root, pgFile *file,
+			   int chunkno, char *to_path)
+{
+	join_path_components(to_path, to_root, file->path + strlen(from_root) + 1);
+	if (chunkno > 0)
+		snprintf(to_path + strlen(to_path), MAXPGPATH - strlen(to_path),
+				 ".chunk%d", chunkno);
+}
+
+/*
+ * Back up the chunkno-th chunk of a data file split by backup_files(), into
+ * a file of its own next to the backup of the file. The chunks of a file are
+ * backed up by any worker, in any order, and backup_data_chunks_end() then
+ * puts them together. The results are saved in file->chunks[chunkno].
+ */
+void
+backup_data_chunk(const char *from_root, const char *to_root, pgFile *file,
+				  const XLogRecPtr *lsn, int chunkno)
+{
+	pgFileChunk *chunk = &file->chunks[chunkno];
+	BlockNumber	first_block = (BlockNumber) chunkno * file->chunk_blocks;
+	BlockNumber	end_block = InvalidBlockNumber;
+	char		to_path[MAXPGPATH];
+	int			in;
+	FILE	   *out;
+
+	/* the last chunk goes up to the end of the file, even if it grew */
+	if (chunkno < file->nchunks - 1)
+		end_block = first_block + file->chunk_blocks;
+
+	chunk->read_size = 0;
+	chunk->write_size = 0;
+	chunk->valid = true;
+	INIT_CRC32C(chunk->crc);
+
+	get_chunk_path(from_root, to_root, file, chunkno, to_path);
+	out = fopen(to_path, "w");
+	if (out == NULL)
+		elog(ERROR, "cannot open backup file \"%s\": %s",
+			 to_path, strerror(errno));
+
+	/* a file vanished leaves its chunks empty */
+	in = io_open_data_file(file->path);
+	if (in == -1 && errno != ENOENT)
+		elog(ERROR, "cannot open backup mode file \"%s\": %s",
+			 file->path, strerror(errno));
+
+	if (in != -1)
+	{
+		check_server_version();
+		chunk->valid = backup_data_blocks(file, in, out, to_path, lsn,
+										  first_block, end_block, chunk);
+		close(in);
+	}
+
+	/* chunks are read again just after, so they are kept in cache */
+	if (fclose(out) != 0)
+		elog(ERROR, "cannot write backup file \"%s\": %s",
+			 to_path, strerror(errno));
+
+	FIN_CRC32C(chunk->crc);
+}
+
+/*
+ * Append the len bytes of the backup of a chunk at part_path to the backup
+ * out of its file, at offset.
+ */
+static void
+append_chunk(int out, const char *to_path, const char *part_path,
+			 off_t offset, size_t len)
+{
+	char		buf[8 * BLCKSZ];
+	size_t		done = 0;
+	int			in;
+
+	in = open(part_path, O_RDONLY | PG_BINARY, 0);
+	if (in == -1)
+		elog(ERROR, "cannot open backup file \"%s\": %s",
+			 part_path, strerror(errno));
+
+#ifdef HAVE_COPY_FILE_RANGE
+	/* file systems with reflinks share the extents instead of copying */
+	while (done < len)
+	{
+		off_t		out_offset = offset + (off_t) done;
+		ssize_t		rc;
+
+		rc = copy_file_range(in, NULL, out, &out_offset, len - done, 0);
+		if (rc <= 0)
+			break;			/* copied by hand from here */
+		done += rc;
+	}
+#endif
+
+	while (done < len)
+	{
+		ssize_t		rc;
+
+		rc = pread(in, buf, Min(sizeof(buf), len - done), (off_t) done);
+		if (rc <= 0)
+			elog(ERROR, "cannot read backup file \"%s\": %s", part_path,
+				 rc == 0 ? "unexpected end of file" : strerror(errno));
+		if (pwrite(out, buf, rc, offset + (off_t) done) != rc)
+			elog(ERROR, "cannot write backup file \"%s\": %s", to_path,
+				 strerror(errno));
+		done += rc;
+	}
+
+	close(in);
+}
+
+/*
+ * Put together the backups of the chunks of file once all of them are done.
+ * They are appended in order to the backup of the first one, so as the
+ * backup of the file is the same as if it had been backed up at once, and
+ * their CRCs are combined into the CRC of the file. Return false if the file
+ * has not been backed up, like backup_data_file().
+ */
+bool
+backup_data_chunks_end(const char *from_root, const char *to_root,
+					   pgFile *file)
+{
+	char		to_path[MAXPGPATH];
+	char		part_path[MAXPGPATH];
+	struct stat	st;
+	bool		valid = true;
+	int			out;
+	int			i;
+
+	for (i = 0; i < file->nchunks; i++)
+		valid = valid && file->chunks[i].valid;
+
+	/*
+	 * If an invalid data page was found, fallback to simple copy as for a
+	 * file backed up at once. A file vanished is not backed up either.
+	 */
+	if (!valid || (stat(file->path, &st) == -1 && errno == ENOENT))
+	{
+		for (i = 0; i < file->nchunks; i++)
+		{
+			get_chunk_path(from_root, to_root, file, i, part_path);
+			if (remove(part_path) == -1)
+				elog(ERROR, "cannot remove file \"%s\": %s", part_path,
+					 strerror(errno));
+		}
+		file->nchunks = 0;
+
+		if (valid)
+			return false;
+
+		elog(LOG, "%s fall back to simple copy", file->path);
+		file->is_datafile = false;
+		return copy_file(from_root, to_root, file, NULL, true);
+	}
+
+	get_chunk_path(from_root, to_root, file, 0, to_path);
+	out = open(to_path, O_WRONLY | PG_BINARY, 0);
+	if (out == -1)
+		elog(ERROR, "cannot open backup file \"%s\": %s",
+			 to_path, strerror(errno));
+
+	file->read_size = file->chunks[0].read_size;
+	file->write_size = file->chunks[0].write_size;
+	file->crc = file->chunks[0].crc;
+	for (i = 1; i < file->nchunks; i++)
+	{
+		pgFileChunk *chunk = &file->chunks[i];
+
+		get_chunk_path(from_root, to_root, file, i, part_path);
+		chunk->offset = (int64) file->write_size;
+		append_chunk(out, to_path, part_path, (off_t) file->write_size,
+					 chunk->write_size);
+		if (remove(part_path) == -1)
+			elog(ERROR, "cannot remove file \"%s\": %s", part_path,
+				 strerror(errno));
+
+		file->read_size += chunk->read_size;
+		file->write_size += chunk->write_size;
+		file->crc = crc32c_combine(file->crc, chunk->crc, chunk->write_size);
+	}
+
+	/* FIXME: Should set permission on open? */
+	if (fchmod(out, FILE_PERMISSION) == -1)
+		elog(ERROR, "cannot change mode of \"%s\": %s", to_path,
+			 strerror(errno));
+	io_drop_cache(out, to_path, 0, 0, true);
+	if (close(out) != 0)
+		elog(ERROR, "cannot write backup file \"%s\": %s",
+			 to_path, strerror(errno));
+
+	/* Treat empty file as not-datafile */
+	if (file->read_size == 0)
+	{
+		file->is_datafile = false;
+		file->nchunks = 0;
+	}
+
+	/* We do not backup if all pages skipped. */
+	if (file->write_size == 0 && file->read_size > 0)
+	{
+		if (remove(to_path) == -1)
+			elog(ERROR, "cannot remove file \"%s\": %s", to_path,
+				 strerror(errno));
+		file->nchunks = 0;
+		return false;
+	}
+
+	sync_file(to_path);
+
+	return true;
+}
+
+/*
+ * Return true if the block blknum of the file opened as fd holds already
+ * the page data, which has then not to be written again by a delta restore.
+ */
+static bool
+page_is_restored(int fd, const char *data, BlockNumber blknum)
+{
+	char		page[BLCKSZ];
+
+	throttle_io(BLCKSZ, 1);
+	return pread(fd, page, BLCKSZ, (off_t) blknum * BLCKSZ) == BLCKSZ &&
+		memcmp(page, data, BLCKSZ) == 0;
+}
+
+/*
+ * Restore the pages of the backup of a data file found from offset and for
+ * len bytes, or up to its end if len is -1, into the file of the same
+ * relative path under to_root. The pages are those of the blocks from
+ * first_block. If written is not NULL, the blocks it holds are skipped and
+ * those restored are added to it. If wanted is not NULL, only the blocks it
+ * holds are restored.
+ */
+static void
+restore_data_range(const char *from_root, const char *to_root, pgFile *file,
+				   pgBackup *backup, int64 offset, int64 len,
+				   BlockNumber first_block, datapagemap_t *written,
+				   datapagemap_t *wanted)
+{
+	char				to_path[MAXPGPATH];
+	FILE			   *in;
+	int					out;
+	BackupPageHeader	header;
+	size_t				header_size = BACKUP_PAGE_HEADER_SIZE(backup);
+	BlockNumber			blknum;
+	char			   *buf;		/* restored pages waiting to be written */
+	int					nbuffered = 0;
+	IoBatch			   *batch;
+	bool				bounded = (len >= 0);
+	BlockNumber			nunchanged = 0;	/* pages found as is by --delta */
+	int64				left = len;	/* bytes to read from it */
+
+	/* open backup mode file for read */
+	in = open_backup_input(from_root, file);
+	if (in == NULL)
+	{
+		elog(ERROR, "cannot open backup file \"%s\": %s", file->path,
+			 strerror(errno));
+	}
+	if (offset > 0 && fseeko(in, (off_t) offset, SEEK_CUR) != 0)
+		elog(ERROR, "cannot seek in backup file \"%s\": %s", file->path,
+			 strerror(errno));
+
+	/*
+	 * Open backup file for write. An existing file is not truncated, so as
+	 * only modified pages are overwritten for differential restore. If the
+	 * file does not exist, an empty file is created.
+	 */
+	join_path_components(to_path, to_root, file->path + strlen(from_root) + 1);
+	out = open(to_path, O_RDWR | O_CREAT | PG_BINARY, FILE_PERMISSION);
+	if (out == -1)
+	{
+		int errno_tmp = errno;
+		fclose(in);
+		elog(ERROR, "cannot open restore target file \"%s\": %s",
+			 to_path, strerror(errno_tmp));
+	}
+
+	buf = pgut_malloc(WRITE_BATCH_BLOCKS * BLCKSZ);
+	batch = io_batch_new(WRITE_BATCH_BLOCKS);
+
+	for (blknum = first_block; ; blknum++)
+	{
+		size_t		read_len;
+		DataPage   *page;
+		int			upper_offset;
+		int			upper_length;
+		IoRequest  *last;
+
+		/* the range ends before its container or the backup does */
+		if (bounded && left <= 0)
+		{
+			if (left < 0)
+				elog(ERROR, "backup is broken at block %u", blknum);
+			break;
+		}
+
+		/* read BackupPageHeader */
+		memset(&header, 0, sizeof(header));
+		read_len = fread(&header, 1, header_size, in);
+		if (read_len != header_size)
+		{
+			int errno_tmp = errno;
+			if (read_len == 0 && feof(in))
+				break;		/* EOF found */
+			else if (read_len != 0 && feof(in))
+			{
+				elog(ERROR,
+					 "odd size page found at block %u of \"%s\"",
+					 blknum, file->path);
+			}
+			else
+			{
+				elog(ERROR, "cannot read block %u of \"%s\": %s",
+					 blknum, file->path, strerror(errno_tmp));
+			}
+		}
+		left -= header_size;
+
+		elog(LOG, "header block: %i, blknum: %i, hole_offset: %i, BLCKSZ:%i",
+				header.block,
+				blknum,
+				header.hole_offset,
+				BLCKSZ);
+		if (header.block < blknum || header.hole_offset > BLCKSZ ||
+			(int) header.hole_offset + (int) header.hole_length > BLCKSZ)
+		{
+			elog(ERROR, "backup is broken at block %u",
+				 blknum);
+		}
+
+		/* a newer version of the block has been restored already */
+		if ((written != NULL && datapagemap_contains(written, header.block)) ||
+			(wanted != NULL && !datapagemap_contains(wanted, header.block)))
+		{
+			size_t		skip;
+
+			if (backup->compress_alg == COMPRESS_NONE && !backup->dedup)
+				skip = BLCKSZ - header.hole_length;
+			else if (header.flags & BACKUP_PAGE_DEDUP)
+				skip = DEDUP_HASH_LEN;
+			else
+				skip = header.compressed_size;
+			if (fseeko(in, (off_t) skip, SEEK_CUR) != 0)
+				elog(ERROR, "cannot read block %u of \"%s\": %s",
+					 blknum, file->path, strerror(errno));
+			left -= skip;
+			blknum = header.block;
+			continue;
+		}
+
+		/* write the pages restored so far once the buffer is full */
+		if (nbuffered == WRITE_BATCH_BLOCKS)
+		{
+			io_batch_write(batch, out, to_path);
+			io_batch_reset(batch);
+			nbuffered = 0;
+		}
+		page = (DataPage *) (buf + nbuffered * BLCKSZ);
+
+		upper_offset = header.hole_offset + header.hole_length;
+		upper_length = BLCKSZ - upper_offset;
+
+		/* read lower/upper into page.data and restore hole */
+		memset(page->data + header.hole_offset, 0, header.hole_length);
+
+		if (backup->compress_alg == COMPRESS_NONE && !backup->dedup)
+		{
+			if (fread(page->data, 1, header.hole_offset, in) != header.hole_offset ||
+				fread(page->data + upper_offset, 1, upper_length, in) != upper_length)
+			{
+				elog(ERROR, "cannot read block %u of \"%s\": %s",
+					 blknum, file->path, strerror(errno));
+			}
+			left -= header.hole_offset + upper_length;
+		}
+		else
+		{
+			char		data[COMPRESS_BUFSIZE];
+			char		raw[BLCKSZ];
+			int			raw_len = header.hole_offset + upper_length;
+
+			if (header.compressed_size > sizeof(data) ||
+				(!(header.flags & BACKUP_PAGE_COMPRESSED) &&
+				 header.compressed_size != raw_len))
+				elog(ERROR, "backup is broken at block %u", blknum);
+
+			if (header.flags & BACKUP_PAGE_DEDUP)
+			{
+				uint8		hash[DEDUP_HASH_LEN];
+
+				if (fread(hash, 1, DEDUP_HASH_LEN, in) != DEDUP_HASH_LEN)
+					elog(ERROR, "cannot read block %u of \"%s\": %s",
+						 blknum, file->path, strerror(errno));
+				left -= DEDUP_HASH_LEN;
+				dedup_get(hash, data, header.compressed_size);
+			}
+			else
+			{
+				if (fread(data, 1, header.compressed_size, in) != header.compressed_size)
+					elog(ERROR, "cannot read block %u of \"%s\": %s",
+						 blknum, file->path, strerror(errno));
+				left -= header.compressed_size;
+			}
+
+			if (header.flags & BACKUP_PAGE_COMPRESSED)
+			{
+				if (!decompress_page_data(raw, raw_len, data,
+										  header.compressed_size,
+										  backup->compress_alg))
+					elog(ERROR, "cannot decompress block %u of \"%s\"",
+						 blknum, file->path);
+			}
+			else
+				memcpy(raw, data, raw_len);
+
+			memcpy(page->data, raw, header.hole_offset);
+			memcpy(page->data + upper_offset, raw + header.hole_offset,
+				   upper_length);
+		}
+
+		/*
+		 * Queue the restored page for writing at its location. Backup might
+		 * have holes in differential backups. Pages following each other in
+		 * the file are written by the same request.
+		 */
+		blknum = header.block;
+		if (written != NULL)
+			datapagemap_add(written, blknum);
+		if (restore_delta && page_is_restored(out, page->data, blknum))
+		{
+			nunchanged++;
+			continue;
+		}
+		last = batch->nrequests > 0 ?
+			&batch->requests[batch->nrequests - 1] : NULL;
+		if (last != NULL &&
+			last->offset + (off_t) last->len == (off_t) blknum * BLCKSZ)
+			last->len += BLCKSZ;
+		else
+			io_batch_add(batch, page->data, BLCKSZ, (off_t) blknum * BLCKSZ);
+		nbuffered++;
+	}
+
+	io_batch_write(batch, out, to_path);
+	io_batch_free(batch);
+	free(buf);
+	io_drop_cache(out, to_path, (off_t) first_block * BLCKSZ,
+				  (off_t) (blknum - first_block) * BLCKSZ, true);
+	if (nunchanged > 0)
+		elog(LOG, "%u pages unchanged, skip", nunchanged);
+
+	fclose(in);
+	close(out);
+}
+
+/*
+ * Restore files in the from_root directory to the to_root directory with
+ * same relative path.
+ */
+void
+restore_data_file(const char *from_root,
+				  const char *to_root,
+				  pgFile *file,
+				  pgBackup *backup)
+{
+	/* If the file is not a datafile, just copy it. */
+	if (!file->is_datafile)
+	{
+		copy_file(from_root, to_root, file, NULL, false);
+		return;
+	}
+
+	/* the backup of a file ends before its container does */
+	restore_data_range(from_root, to_root, file, backup, 0,
+					   file->container >= 0 ? file->write_size : -1, 0, NULL,
+					   NULL);
+	restore_data_chunks_end(from_root, to_root, file);
+}
+
+/*
+ * Restore the chunkno-th chunk of a data file backed up by chunks. The
+ * chunks of a file can be restored by separate workers in any order, and
+ * restore_data_chunks_end() is then called once all of them are done.
+ */
+void
+restore_data_chunk(const char *from_root, const char *to_root, pgFile *file,
+				   pgBackup *backup, int chunkno)
+{
+	int64		offset = file->chunks[chunkno].offset;
+	int64		end = (int64) file->write_size;
+
+	if (chunkno < file->nchunks - 1)
+		end = file->chunks[chunkno + 1].offset;
+
+	restore_data_range(from_root, to_root, file, backup, offset,
+					   end - offset,
+					   (BlockNumber) chunkno * file->chunk_blocks, NULL, NULL);
+}
 
-			header.block = blknum;
+/*
+ * Finish the restore of a data file, once its pages are all written.
+ */
+void
+restore_data_chunks_end(const char *from_root, const char *to_root,
+						pgFile *file)
+{
+	char		to_path[MAXPGPATH];
 
-			/*
-			 * If an invalid data page was found, fallback to simple copy to ensure
-			 * all pages in the file don't have BackupPageHeader.
-			 */
-			if (!parse_page(&page, &page_lsn,
-							&header.hole_offset, &header.hole_length))
-			{
-				elog(LOG, "%s fall back to simple copy", file->path);
-				fclose(in);
-				fclose(out);
-				file->is_datafile = false;
-				return copy_file(from_root, to_root, file);
-			}
+	join_path_components(to_path, to_root, file->path + strlen(from_root) + 1);
 
-			file->read_size += read_len;
+	/* update file permission */
+	if (chmod(to_path, file->mode) == -1)
+		elog(ERROR, "cannot change mode of \"%s\": %s", to_path,
+			 strerror(errno));
 
-			/* if the page has not been modified since last backup, skip it */
-			if (lsn && !XLogRecPtrIsInvalid(page_lsn) && page_lsn < *lsn)
-				continue;
+	sync_file(to_path);
+}
 
-			upper_offset = header.hole_offset + header.hole_length;
-			upper_length = BLCKSZ - upper_offset;
+/*
+ * Write the blocks of a data file saved by a simple copy which are not in
+ * written yet, and in wanted if not NULL. The blocks are read from the copy
+ * one after the other.
+ */
+static void
+restore_copied_blocks(const char *from_root, const char *to_root,
+					  pgFile *file, datapagemap_t *written,
+					  datapagemap_t *wanted)
+{
+	char		to_path[MAXPGPATH];
+	char		buf[BLCKSZ];
+	FILE	   *in;
+	int			out;
+	BlockNumber	blknum;
+	BlockNumber	nunchanged = 0;	/* pages found as is by --delta */
+	bool		in_container = (file->container >= 0);
+	int64		left = file->write_size;	/* bytes to read from it */
 
-			/* write data page excluding hole */
-			if (fwrite(&header, 1, sizeof(header), out) != sizeof(header) ||
-				fwrite(page.data, 1, header.hole_offset, out) != header.hole_offset ||
-				fwrite(page.data + upper_offset, 1, upper_length, out) != upper_length)
-			{
-				int errno_tmp = errno;
-				/* oops */
-				fclose(in);
-				fclose(out);
-				elog(ERROR, "cannot write at block %u of \"%s\": %s",
-					 blknum, to_path, strerror(errno_tmp));
-			}
+	in = open_backup_input(from_root, file);
+	if (in == NULL)
+		elog(ERROR, "cannot open backup file \"%s\": %s", file->path,
+			 strerror(errno));
 
-			/* update CRC */
-			COMP_CRC32C(crc, &header, sizeof(header));
-			COMP_CRC32C(crc, page.data, header.hole_offset);
-			COMP_CRC32C(crc, page.data + upper_offset, upper_length);
+	join_path_components(to_path, to_root, file->path + strlen(from_root) + 1);
+	out = open(to_path, O_RDWR | O_CREAT | PG_BINARY, FILE_PERMISSION);
+	if (out == -1)
+		elog(ERROR, "cannot open restore target file \"%s\": %s",
+			 to_path, strerror(errno));
 
-			file->write_size += sizeof(header) + read_len - header.hole_length;
+	for (blknum = 0; !in_container || left > 0; blknum++)
+	{
+		size_t		want = in_container ? Min(BLCKSZ, left) : BLCKSZ;
+		size_t		read_len = fread(buf, 1, want, in);
+
+		if (read_len == 0)
+		{
+			if (ferror(in))
+				elog(ERROR, "cannot read block %u of \"%s\": %s",
+					 blknum, file->path, strerror(errno));
+			break;
+		}
+		left -= read_len;
+		throttle_io(read_len, 1);
+
+		/* restored from a newer version, or found as is by a delta restore */
+		if (datapagemap_contains(written, blknum) ||
+			(wanted != NULL && !datapagemap_contains(wanted, blknum)))
+			continue;
+		if (restore_delta && read_len == BLCKSZ &&
+			page_is_restored(out, buf, blknum))
+		{
+			nunchanged++;
+			continue;
 		}
-		pg_free(iter);
+
+		if (pwrite(out, buf, read_len, (off_t) blknum * BLCKSZ) != (ssize_t) read_len)
+			elog(ERROR, "cannot write block %u of \"%s\": %s",
+				 blknum, to_path, strerror(errno));
 	}
 
-	/*
-	 * update file permission
-	 * FIXME: Should set permission on open?
-	 */
-	if (!check && chmod(to_path, FILE_PERMISSION) == -1)
+	io_drop_cache(out, to_path, 0, 0, true);
+	fclose(in);
+	if (close(out) != 0)
+		elog(ERROR, "cannot write \"%s\": %s", to_path, strerror(errno));
+	if (nunchanged > 0)
+		elog(LOG, "%u pages unchanged, skip", nunchanged);
+}
+
+/*
+ * Restore the version of a data file saved by backup as part of a chain of
+ * backups restored newest first: only the blocks which are not in written
+ * yet are restored, and added to it, so as each block is written once with
+ * its newest version. If wanted is not NULL, only the blocks it holds are
+ * restored.
+ */
+void
+restore_data_file_merge(const char *from_root, const char *to_root,
+						pgFile *file, pgBackup *backup,
+						datapagemap_t *written, datapagemap_t *wanted)
+{
+	/* a simple copy of the file, with all its blocks */
+	if (!file->is_datafile)
 	{
-		int errno_tmp = errno;
-		fclose(in);
-		fclose(out);
-		elog(ERROR, "cannot change mode of \"%s\": %s", file->path,
-			 strerror(errno_tmp));
+		if (datapagemap_is_empty(written) && wanted == NULL)
+			copy_file(from_root, to_root, file, NULL, false);
+		else
+			restore_copied_blocks(from_root, to_root, file, written, wanted);
+		return;
 	}
 
-	fclose(in);
-	fclose(out);
+	restore_data_range(from_root, to_root, file, backup, 0,
+					   file->container >= 0 ? file->write_size : -1, 0,
+					   written, wanted);
+}
 
-	/* finish CRC calculation and store into pgFile */
-	FIN_CRC32C(crc);
-	file->crc = crc;
+/*
+ * Return true if the file of the same relative path under to_root holds
+ * already the content of file saved by a simple copy, as found by its size
+ * and CRC. A delta restore leaves such a file as it is, but for its mode.
+ */
+bool
+restore_file_is_restored(const char *from_root, const char *to_root,
+						 pgFile *file)
+{
+	char		to_path[MAXPGPATH];
+	struct stat	st;
+	pgFile		local;
 
-	/* Treat empty file as not-datafile */
-	if (file->read_size == 0)
-		file->is_datafile = false;
+	join_path_components(to_path, to_root, file->path + strlen(from_root) + 1);
+	if (stat(to_path, &st) == -1 || !S_ISREG(st.st_mode) ||
+		st.st_size != (off_t) file->write_size)
+		return false;
 
-	/* We do not backup if all pages skipped. */
-	if (file->write_size == 0 && file->read_size > 0)
-	{
-		if (remove(to_path) == -1)
-			elog(ERROR, "cannot remove file \"%s\": %s", to_path,
-				 strerror(errno));
+	local.path = to_path;
+	if (pgFileGetCRC(&local) != file->crc)
 		return false;
-	}
 
-	/* remove $BACKUP_PATH/tmp created during check */
-	if (check)
-		remove(to_path);
+	if (chmod(to_path, file->mode) == -1)
+		elog(ERROR, "cannot change mode of \"%s\": %s", to_path,
+			 strerror(errno));
 
 	return true;
 }
 
 /*
- * Restore files in the from_root directory to the to_root directory with
- * same relative path.
+ * Cut the file of the same relative path under to_root to the size of the
+ * data file backed up, before a delta restore writes its pages: the blocks
+ * beyond were not in the database backed up. The file lists of older
+ * backups record no size, nor ctime: their files are then not cut, instead
+ * of being cut to nothing and rewritten in full.
  */
 void
-restore_data_file(const char *from_root,
-				  const char *to_root,
-				  pgFile *file)
+restore_data_truncate(const char *from_root, const char *to_root,
+					  pgFile *file)
+{
+	char		to_path[MAXPGPATH];
+	struct stat	st;
+
+	/* size unknown, see dir_read_file_list() */
+	if (file->ctime == 0)
+		return;
+
+	join_path_components(to_path, to_root, file->path + strlen(from_root) + 1);
+	if (stat(to_path, &st) == -1 || st.st_size <= (off_t) file->size)
+		return;
+
+	if (truncate(to_path, (off_t) file->size) == -1)
+		elog(ERROR, "cannot truncate \"%s\": %s", to_path, strerror(errno));
+	elog(LOG, "truncated \"%s\" to %lu bytes",
+		 file->path + strlen(from_root) + 1, (unsigned long) file->size);
+
+	/* the file may have no page to restore */
+	sync_file(to_path);
+}
+
+/*
+ * Release the references to the dedup store held by the pages of a data
+ * file of a deduplicated backup about to be deleted. A backup file which
+ * cannot be read only leaves blocks in the store.
+ */
+void
+release_data_file(const char *from_root, pgFile *file, pgBackup *backup)
 {
-	char				to_path[MAXPGPATH];
 	FILE			   *in;
-	FILE			   *out;
 	BackupPageHeader	header;
-	BlockNumber			blknum;
+	size_t				header_size = BACKUP_PAGE_HEADER_SIZE(backup);
+	bool				in_container = (file->container >= 0);
+	int64				left = file->write_size;	/* bytes to read from it */
 
-	/* If the file is not a datafile, just copy it. */
-	if (!file->is_datafile)
-	{
-		copy_file(from_root, to_root, file);
+	if (!file->is_datafile || file->write_size == BYTES_INVALID)
 		return;
-	}
 
-	/* open backup mode file for read */
-	in = fopen(file->path, "r");
+	in = open_backup_input(from_root, file);
 	if (in == NULL)
 	{
-		elog(ERROR, "cannot open backup file \"%s\": %s", file->path,
+		elog(WARNING, "cannot open backup file \"%s\": %s", file->path,
 			 strerror(errno));
+		return;
 	}
 
-	/*
-	 * Open backup file for write. 	We use "r+" at first to overwrite only
-	 * modified pages for differential restore. If the file is not exists,
-	 * re-open it with "w" to create an empty file.
-	 */
-	join_path_components(to_path, to_root, file->path + strlen(from_root) + 1);
-	out = fopen(to_path, "r+");
-	if (out == NULL && errno == ENOENT)
-		out = fopen(to_path, "w");
-	if (out == NULL)
-	{
-		int errno_tmp = errno;
-		fclose(in);
-		elog(ERROR, "cannot open restore target file \"%s\": %s",
-			 to_path, strerror(errno_tmp));
-	}
-
-	for (blknum = 0; ; blknum++)
+	while (!in_container || left > 0)
 	{
 		size_t		read_len;
-		DataPage	page;		/* used as read buffer */
-		int			upper_offset;
-		int			upper_length;
 
-		/* read BackupPageHeader */
-		read_len = fread(&header, 1, sizeof(header), in);
-		if (read_len != sizeof(header))
+		read_len = fread(&header, 1, header_size, in);
+		if (read_len != header_size)
 		{
-			int errno_tmp = errno;
-			if (read_len == 0 && feof(in))
-				break;		/* EOF found */
-			else if (read_len != 0 && feof(in))
+			if (read_len != 0 || !feof(in))
+				elog(WARNING, "cannot read \"%s\"", file->path);
+			break;
+		}
+		left -= header_size;
+
+		if (header.flags & BACKUP_PAGE_DEDUP)
+		{
+			uint8		hash[DEDUP_HASH_LEN];
+
+			if (fread(hash, 1, DEDUP_HASH_LEN, in) != DEDUP_HASH_LEN)
 			{
-				elog(ERROR,
-					 "odd size page found at block %u of \"%s\"",
-					 blknum, file->path);
+				elog(WARNING, "cannot read \"%s\"", file->path);
+				break;
 			}
-			else
+			dedup_release(hash);
+			left -= DEDUP_HASH_LEN;
+		}
+		else
+		{
+			if (fseeko(in, (off_t) header.compressed_size, SEEK_CUR) != 0)
 			{
-				elog(ERROR, "cannot read block %u of \"%s\": %s",
-					 blknum, file->path, strerror(errno_tmp));
+				elog(WARNING, "cannot read \"%s\"", file->path);
+				break;
 			}
+			left -= header.compressed_size;
 		}
+	}
 
-		elog(LOG, "header block: %i, blknum: %i, hole_offset: %i, BLCKSZ:%i",
-				header.block,
-				blknum,
-				header.hole_offset,
-				BLCKSZ);
-		if (header.block < blknum || header.hole_offset > BLCKSZ ||
-			(int) header.hole_offset + (int) header.hole_length > BLCKSZ)
-		{
-			elog(ERROR, "backup is broken at block %u",
-				 blknum);
-		}
+	fclose(in);
+}
 
-		upper_offset = header.hole_offset + header.hole_length;
-		upper_length = BLCKSZ - upper_offset;
+/*
+ * Copy a file from in to out, both at their start but for the backup of file
+ * held in a container, without the data going through user space. The file
+ * is cloned if the file system can share extents between files, else it is
+ * copied by copy_file_range(). len is the number of bytes to copy, or -1 to
+ * copy up to the end of in. Return the number of bytes copied, or -1 if
+ * the kernel cannot copy these files, nothing having been written then.
+ */
+static int64
+copy_file_in_kernel(int in, int out, pgFile *file, int64 len,
+					const char *to_path)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+	off_t		in_offset = (file->container >= 0) ?
+		(off_t) file->container_offset : 0;
+	int64		copied = 0;
+#endif
+
+#ifdef FICLONE
+	/* a clone shares the extents of the whole source file */
+	if (file->container < 0 && ioctl(out, FICLONE, in) == 0)
+	{
+		struct stat	st;
 
-		/* read lower/upper into page.data and restore hole */
-		memset(page.data + header.hole_offset, 0, header.hole_length);
+		throttle_io(0, 1);
+
+		if (fstat(out, &st) == -1)
+			elog(ERROR, "cannot stat \"%s\": %s", to_path, strerror(errno));
+		return (int64) st.st_size;
+	}
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+	while (len < 0 || copied < len)
+	{
+		size_t		chunk = COPY_RANGE_SIZE;
+		ssize_t		rc;
+
+		/* a throttled copy is charged by small steps */
+		if (max_rate > 0 || max_iops > 0)
+			chunk = COPY_THROTTLED_SIZE;
+		if (len >= 0 && len - copied < (int64) chunk)
+			chunk = (size_t) (len - copied);
 
-		if (fread(page.data, 1, header.hole_offset, in) != header.hole_offset ||
-			fread(page.data + upper_offset, 1, upper_length, in) != upper_length)
+		rc = copy_file_range(in, &in_offset, out, NULL, chunk, 0);
+		if (rc < 0)
 		{
-			elog(ERROR, "cannot read block %u of \"%s\": %s",
-				 blknum, file->path, strerror(errno));
+			/* not supported for these files, copy them by hand */
+			if (copied == 0 &&
+				(errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP ||
+				 errno == EINVAL))
+				return -1;
+			elog(ERROR, "cannot copy \"%s\" to \"%s\": %s",
+				 file->path, to_path, strerror(errno));
 		}
-
-		/*
-		 * Seek and write the restored page. Backup might have holes in
-		 * differential backups.
-		 */
-		blknum = header.block;
-		if (fseek(out, blknum * BLCKSZ, SEEK_SET) < 0)
-			elog(ERROR, "cannot seek block %u of \"%s\": %s",
-				 blknum, to_path, strerror(errno));
-		if (fwrite(page.data, 1, sizeof(page), out) != sizeof(page))
-			elog(ERROR, "cannot write block %u of \"%s\": %s",
-				 blknum, file->path, strerror(errno));
+		if (rc == 0)
+		{
+			if (len >= 0)
+				elog(ERROR, "cannot read backup mode file \"%s\": unexpected end of file",
+					 file->path);
+			break;
+		}
+		copied += rc;
+		throttle_io(rc, 1);
 	}
 
-	/* update file permission */
-	if (chmod(to_path, file->mode) == -1)
+	return copied;
+#else
+	return -1;
+#endif
+}
+
+/*
+ * Update crc with the first len bytes of the file at path, mapped in memory
+ * if possible.
+ */
+static void
+comp_crc_of_file(const char *path, int64 len, pg_crc32 *crc)
+{
+	int			fd;
+	char	   *map;
+
+	if (len == 0)
+		return;
+
+	fd = open(path, O_RDONLY | PG_BINARY, 0);
+	if (fd == -1)
+		elog(ERROR, "cannot open \"%s\": %s", path, strerror(errno));
+
+	map = mmap(NULL, (size_t) len, PROT_READ, MAP_SHARED, fd, 0);
+	if (map != MAP_FAILED)
 	{
-		int errno_tmp = errno;
+		(void) posix_madvise(map, (size_t) len, POSIX_MADV_SEQUENTIAL);
+		COMP_CRC32C(*crc, map, (size_t) len);
+		munmap(map, (size_t) len);
+	}
+	else
+	{
+		char		buf[8192];
+		int64		done = 0;
 
-		fclose(in);
-		fclose(out);
-		elog(ERROR, "cannot change mode of \"%s\": %s", to_path,
-			 strerror(errno_tmp));
+		while (done < len)
+		{
+			ssize_t		rc = read(fd, buf, Min((int64) sizeof(buf), len - done));
+
+			if (rc <= 0)
+				elog(ERROR, "cannot read \"%s\": %s", path,
+					 rc == 0 ? "unexpected end of file" : strerror(errno));
+			COMP_CRC32C(*crc, buf, rc);
+			done += rc;
+		}
 	}
 
-	fclose(in);
-	fclose(out);
+	close(fd);
 }
 
 bool
-copy_file(const char *from_root, const char *to_root, pgFile *file)
+copy_file(const char *from_root, const char *to_root, pgFile *file,
+		  pgContainer *container, bool calc_crc)
 {
 	char		to_path[MAXPGPATH];
 	FILE	   *in;
 	FILE	   *out;
+	size_t		want = 0;
 	size_t		read_len = 0;
 	int			errno_tmp;
 	char		buf[8192];
 	struct stat	st;
 	pg_crc32	crc;
+	bool		in_container = (file->container >= 0);
+	int64		left = file->write_size;	/* bytes to read from it */
+	int64		copied = -1;
 
 	INIT_CRC32C(crc);
 
@@ -438,7 +1826,7 @@ copy_file(const char *from_root, const char *to_root, pgFile *file)
 	file->write_size = 0;
 
 	/* open backup mode file for read */
-	in = fopen(file->path, "r");
+	in = open_backup_input(from_root, file);
 	if (in == NULL)
 	{
 		FIN_CRC32C(crc);
@@ -453,11 +1841,13 @@ copy_file(const char *from_root, const char *to_root, pgFile *file)
 	}
 
 	/* open backup file for write  */
-	if (check)
-		snprintf(to_path, lengthof(to_path), "%s/tmp", backup_path);
+	if (container != NULL || check)
+		out = open_backup_output(from_root, to_root, file, container, to_path);
 	else
+	{
 		join_path_components(to_path, to_root, file->path + strlen(from_root) + 1);
-	out = fopen(to_path, "w");
+		out = fopen(to_path, "w");
+	}
 	if (out == NULL)
 	{
 		int errno_tmp = errno;
@@ -470,67 +1860,100 @@ copy_file(const char *from_root, const char *to_root, pgFile *file)
 	if (fstat(fileno(in), &st) == -1)
 	{
 		fclose(in);
-		fclose(out);
+		if (container == NULL)
+			fclose(out);
 		elog(ERROR, "cannot stat \"%s\": %s", file->path,
 			 strerror(errno));
 	}
 
-	/* copy content and calc CRC */
-	for (;;)
-	{
-		if ((read_len = fread(buf, 1, sizeof(buf), in)) != sizeof(buf))
-			break;
+	/* a file restored from a container takes the mode of the list */
+	if (in_container)
+		st.st_mode = file->mode;
 
-		if (fwrite(buf, 1, read_len, out) != read_len)
+	/*
+	 * Let the kernel copy the file without the data going through user
+	 * space if it can, the copy being read back for its CRC only when it is
+	 * needed. Else copy content and calc CRC.
+	 */
+	if (container == NULL && !check)
+		copied = copy_file_in_kernel(fileno(in), fileno(out), file,
+									 in_container ? left : -1, to_path);
+	if (copied >= 0)
+	{
+		file->read_size = copied;
+		file->write_size = copied;
+		if (calc_crc)
+			comp_crc_of_file(to_path, copied, &crc);
+	}
+	else
+	{
+		for (;;)
 		{
-			errno_tmp = errno;
-			/* oops */
-			fclose(in);
-			fclose(out);
-			elog(ERROR, "cannot write to \"%s\": %s", to_path,
-				 strerror(errno_tmp));
-		}
-		/* update CRC */
-		COMP_CRC32C(crc, buf, read_len);
+			/* the backup of a file ends before its container does */
+			want = sizeof(buf);
+			if (in_container && left < (int64) want)
+				want = (size_t) left;
 
-		file->write_size += sizeof(buf);
-		file->read_size += sizeof(buf);
-	}
+			read_len = fread(buf, 1, want, in);
+			throttle_io(read_len, 1);
+			if (read_len != sizeof(buf))
+				break;
 
-	errno_tmp = errno;
-	if (!feof(in))
-	{
-		fclose(in);
-		fclose(out);
-		elog(ERROR, "cannot read backup mode file \"%s\": %s",
-			 file->path, strerror(errno_tmp));
-	}
+			if (fwrite(buf, 1, read_len, out) != read_len)
+			{
+				errno_tmp = errno;
+				/* oops */
+				fclose(in);
+				if (container == NULL)
+					fclose(out);
+				elog(ERROR, "cannot write to \"%s\": %s", to_path,
+					 strerror(errno_tmp));
+			}
+			/* update CRC */
+			COMP_CRC32C(crc, buf, read_len);
 
-	/* copy odd part. */
-	if (read_len > 0)
-	{
-		if (fwrite(buf, 1, read_len, out) != read_len)
+			file->write_size += sizeof(buf);
+			file->read_size += sizeof(buf);
+			left -= sizeof(buf);
+		}
+
+		errno_tmp = errno;
+		if (in_container ? read_len != want : !feof(in))
 		{
-			errno_tmp = errno;
-			/* oops */
 			fclose(in);
-			fclose(out);
-			elog(ERROR, "cannot write to \"%s\": %s", to_path,
-				 strerror(errno_tmp));
+			if (container == NULL)
+				fclose(out);
+			elog(ERROR, "cannot read backup mode file \"%s\": %s",
+				 file->path, strerror(errno_tmp));
 		}
-		/* update CRC */
-		COMP_CRC32C(crc, buf, read_len);
 
-		file->write_size += read_len;
-		file->read_size += read_len;
+		/* copy odd part. */
+		if (read_len > 0)
+		{
+			if (fwrite(buf, 1, read_len, out) != read_len)
+			{
+				errno_tmp = errno;
+				/* oops */
+				fclose(in);
+				if (container == NULL)
+					fclose(out);
+				elog(ERROR, "cannot write to \"%s\": %s", to_path,
+					 strerror(errno_tmp));
+			}
+			/* update CRC */
+			COMP_CRC32C(crc, buf, read_len);
+
+			file->write_size += read_len;
+			file->read_size += read_len;
+		}
 	}
 
 	/* finish CRC calculation and store into pgFile */
 	FIN_CRC32C(crc);
 	file->crc = crc;
 
-	/* update file permission */
-	if (chmod(to_path, st.st_mode) == -1)
+	/* update file permission, containers being left open for the next files */
+	if (container == NULL && chmod(to_path, st.st_mode) == -1)
 	{
 		errno_tmp = errno;
 		fclose(in);
@@ -539,11 +1962,17 @@ copy_file(const char *from_root, const char *to_root, pgFile *file)
 			 strerror(errno_tmp));
 	}
 
+	io_drop_cache(fileno(in), file->path,
+				  in_container ? (off_t) file->container_offset : 0,
+				  in_container ? (off_t) file->read_size : 0, false);
 	fclose(in);
-	fclose(out);
+	if (container == NULL)
+		close_backup_output(out, to_path);
 
 	if (check)
 		remove(to_path);
+	else if (container == NULL)
+		sync_file(to_path);
 
 	return true;
 }
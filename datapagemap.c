@@ -3,7 +3,12 @@
  * datapagemap.c
  *	  A data structure for keeping track of data pages that have changed.
  *
- * This is a fairly simple bitmap.
+ * This is a compressed bitmap made of containers of 65536 blocks each,
+ * created only for the ranges of the relation where blocks have changed.
+ * A container is a sorted array while it holds few blocks, and becomes a
+ * plain bitset once the array would be larger than that. Memory and
+ * iteration costs therefore depend on the number of changed blocks, not
+ * on the size of the relation.
  *
  * Copyright (c) 2013-2017, PostgreSQL Global Development Group
  *
@@ -14,61 +19,149 @@
 
 #include "datapagemap.h"
 
+/* blocks covered by a container, and the size of a bitset in words */
+#define CONTAINER_BLOCKS		65536
+#define BITSET_WORDS			(CONTAINER_BLOCKS / 64)
+
+/* an array larger than this would use more memory than a bitset */
+#define ARRAY_MAX_CARDINALITY	4096
+
+#define BLOCK_KEY(blkno)		((uint16) ((blkno) >> 16))
+#define BLOCK_LOW(blkno)		((uint16) ((blkno) & 0xFFFF))
+
 struct datapagemap_iterator
 {
 	datapagemap_t *map;
-	BlockNumber nextblkno;
+	int			container;		/* current container */
+	int			pos;			/* next array entry, or current bitset word */
+	uint64		word;			/* bits of the bitset word not returned yet */
 };
 
+static datapagemap_container *find_container(datapagemap_t *map, uint16 key);
+static datapagemap_container *get_container(datapagemap_t *map, uint16 key);
+static void array_add(datapagemap_container *c, uint16 low);
+static void array_to_bitset(datapagemap_container *c);
+static void iter_enter_container(datapagemap_iterator_t *iter);
+static bool iter_peek(datapagemap_iterator_t *iter, BlockNumber *blkno);
+static void iter_consume(datapagemap_iterator_t *iter);
+
+/*
+ * Number of trailing zero bits of a non-zero word.
+ */
+static inline int
+word_ctz(uint64 word)
+{
+#if defined(__GNUC__)
+	return __builtin_ctzll(word);
+#else
+	int			n = 0;
+
+	while ((word & 1) == 0)
+	{
+		word >>= 1;
+		n++;
+	}
+	return n;
+#endif
+}
+
 /*****
  * Public functions
  */
 
+void
+datapagemap_init(datapagemap_t *map)
+{
+	map->containers = NULL;
+	map->ncontainers = 0;
+	map->maxcontainers = 0;
+}
+
+/*
+ * Release the memory used by the page map, which can then be reused.
+ */
+void
+datapagemap_free(datapagemap_t *map)
+{
+	int			i;
+
+	for (i = 0; i < map->ncontainers; i++)
+	{
+		pg_free(map->containers[i].array);
+		pg_free(map->containers[i].bitset);
+	}
+	pg_free(map->containers);
+	datapagemap_init(map);
+}
+
+bool
+datapagemap_is_empty(datapagemap_t *map)
+{
+	return map->ncontainers == 0;
+}
+
 /*
  * Add a block to the bitmap.
  */
 void
 datapagemap_add(datapagemap_t *map, BlockNumber blkno)
 {
-	int			offset;
-	int			bitno;
+	datapagemap_container *c = get_container(map, BLOCK_KEY(blkno));
+	uint16		low = BLOCK_LOW(blkno);
 
-	offset = blkno / 8;
-	bitno = blkno % 8;
+	if (c->is_bitset)
+	{
+		uint64		bit = UINT64CONST(1) << (low % 64);
 
-	/* enlarge or create bitmap if needed */
-	if (map->bitmapsize <= offset)
+		if ((c->bitset[low / 64] & bit) == 0)
+		{
+			c->bitset[low / 64] |= bit;
+			c->cardinality++;
+		}
+	}
+	else
 	{
-		int			oldsize = map->bitmapsize;
-		int			newsize;
+		array_add(c, low);
+		if (c->cardinality > ARRAY_MAX_CARDINALITY)
+			array_to_bitset(c);
+	}
+}
 
-		/*
-		 * The minimum to hold the new bit is offset + 1. But add some
-		 * headroom, so that we don't need to repeatedly enlarge the bitmap in
-		 * the common case that blocks are modified in order, from beginning
-		 * of a relation to the end.
-		 */
-		newsize = offset + 1;
-		newsize += 10;
+/*
+ * Return true if the block is in the bitmap.
+ */
+bool
+datapagemap_contains(datapagemap_t *map, BlockNumber blkno)
+{
+	datapagemap_container *c = find_container(map, BLOCK_KEY(blkno));
+	uint16		low = BLOCK_LOW(blkno);
+	int			lo = 0;
+	int			hi;
 
-		map->bitmap = pg_realloc(map->bitmap, newsize);
+	if (c == NULL)
+		return false;
+	if (c->is_bitset)
+		return (c->bitset[low / 64] & (UINT64CONST(1) << (low % 64))) != 0;
 
-		/* zero out the newly allocated region */
-		memset(&map->bitmap[oldsize], 0, newsize - oldsize);
+	hi = c->cardinality;
+	while (lo < hi)
+	{
+		int			mid = (lo + hi) / 2;
 
-		map->bitmapsize = newsize;
+		if (c->array[mid] < low)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-
-	/* Set the bit */
-	map->bitmap[offset] |= (1 << bitno);
+	return lo < c->cardinality && c->array[lo] == low;
 }
 
 /*
  * Start iterating through all entries in the page map.
  *
- * After datapagemap_iterate, call datapagemap_next to return the entries,
- * until it returns false. After you're done, use pg_free() to destroy the
- * iterator.
+ * After datapagemap_iterate, call datapagemap_next or datapagemap_next_range
+ * to return the entries, until it returns false. After you're done, use
+ * pg_free() to destroy the iterator.
  */
 datapagemap_iterator_t *
 datapagemap_iterate(datapagemap_t *map)
@@ -77,7 +170,8 @@ datapagemap_iterate(datapagemap_t *map)
 
 	iter = pg_malloc(sizeof(datapagemap_iterator_t));
 	iter->map = map;
-	iter->nextblkno = 0;
+	iter->container = 0;
+	iter_enter_container(iter);
 
 	return iter;
 }
@@ -85,28 +179,32 @@ datapagemap_iterate(datapagemap_t *map)
 bool
 datapagemap_next(datapagemap_iterator_t *iter, BlockNumber *blkno)
 {
-	datapagemap_t *map = iter->map;
-
-	for (;;)
-	{
-		BlockNumber blk = iter->nextblkno;
-		int			nextoff = blk / 8;
-		int			bitno = blk % 8;
+	if (!iter_peek(iter, blkno))
+		return false;
+	iter_consume(iter);
+	return true;
+}
 
-		if (nextoff >= map->bitmapsize)
-			break;
+/*
+ * Return the next range of consecutive blocks of the page map.
+ */
+bool
+datapagemap_next_range(datapagemap_iterator_t *iter, BlockNumber *start,
+					   BlockNumber *nblocks)
+{
+	BlockNumber	blkno;
 
-		iter->nextblkno++;
+	if (!datapagemap_next(iter, start))
+		return false;
 
-		if (map->bitmap[nextoff] & (1 << bitno))
-		{
-			*blkno = blk;
-			return true;
-		}
+	*nblocks = 1;
+	while (iter_peek(iter, &blkno) && blkno == *start + *nblocks)
+	{
+		iter_consume(iter);
+		(*nblocks)++;
 	}
 
-	/* no more set bits in this bitmap. */
-	return false;
+	return true;
 }
 
 /*
@@ -124,3 +222,201 @@ datapagemap_print(datapagemap_t *map)
 
 	pg_free(iter);
 }
+
+/*****
+ * Internal functions
+ */
+
+/*
+ * Find the container of the given key, or return NULL if there is none.
+ */
+static datapagemap_container *
+find_container(datapagemap_t *map, uint16 key)
+{
+	int			low = 0;
+	int			high = map->ncontainers;
+
+	while (low < high)
+	{
+		int			mid = (low + high) / 2;
+
+		if (map->containers[mid].key < key)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	if (low < map->ncontainers && map->containers[low].key == key)
+		return &map->containers[low];
+	return NULL;
+}
+
+/*
+ * Find the container of the given key, creating it if needed. Blocks are
+ * mostly added in order, so the last container is checked first.
+ */
+static datapagemap_container *
+get_container(datapagemap_t *map, uint16 key)
+{
+	int			low = 0;
+	int			high = map->ncontainers;
+	datapagemap_container *c;
+
+	if (map->ncontainers > 0 &&
+		map->containers[map->ncontainers - 1].key <= key)
+	{
+		if (map->containers[map->ncontainers - 1].key == key)
+			return &map->containers[map->ncontainers - 1];
+		low = map->ncontainers;
+	}
+	else
+	{
+		while (low < high)
+		{
+			int			mid = (low + high) / 2;
+
+			if (map->containers[mid].key < key)
+				low = mid + 1;
+			else
+				high = mid;
+		}
+		if (low < map->ncontainers && map->containers[low].key == key)
+			return &map->containers[low];
+	}
+
+	/* insert a new array container at position low */
+	if (map->ncontainers >= map->maxcontainers)
+	{
+		map->maxcontainers = map->maxcontainers > 0 ? map->maxcontainers * 2 : 4;
+		map->containers = pg_realloc(map->containers,
+					sizeof(datapagemap_container) * map->maxcontainers);
+	}
+	memmove(&map->containers[low + 1], &map->containers[low],
+			sizeof(datapagemap_container) * (map->ncontainers - low));
+	map->ncontainers++;
+
+	c = &map->containers[low];
+	c->key = key;
+	c->is_bitset = false;
+	c->cardinality = 0;
+	c->capacity = 0;
+	c->array = NULL;
+	c->bitset = NULL;
+
+	return c;
+}
+
+static void
+array_add(datapagemap_container *c, uint16 low)
+{
+	int			lo = 0;
+	int			hi = c->cardinality;
+
+	/* fast path for blocks added in order */
+	if (c->cardinality > 0 && c->array[c->cardinality - 1] < low)
+		lo = c->cardinality;
+	else
+	{
+		while (lo < hi)
+		{
+			int			mid = (lo + hi) / 2;
+
+			if (c->array[mid] < low)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo < c->cardinality && c->array[lo] == low)
+			return;
+	}
+
+	if (c->cardinality >= c->capacity)
+	{
+		c->capacity = c->capacity > 0 ? c->capacity * 2 : 16;
+		c->array = pg_realloc(c->array, sizeof(uint16) * c->capacity);
+	}
+	memmove(&c->array[lo + 1], &c->array[lo],
+			sizeof(uint16) * (c->cardinality - lo));
+	c->array[lo] = low;
+	c->cardinality++;
+}
+
+static void
+array_to_bitset(datapagemap_container *c)
+{
+	int			i;
+
+	c->bitset = pg_malloc0(sizeof(uint64) * BITSET_WORDS);
+	for (i = 0; i < c->cardinality; i++)
+		c->bitset[c->array[i] / 64] |= UINT64CONST(1) << (c->array[i] % 64);
+
+	pg_free(c->array);
+	c->array = NULL;
+	c->capacity = 0;
+	c->is_bitset = true;
+}
+
+static void
+iter_enter_container(datapagemap_iterator_t *iter)
+{
+	datapagemap_t *map = iter->map;
+
+	iter->pos = 0;
+	iter->word = 0;
+	if (iter->container < map->ncontainers &&
+		map->containers[iter->container].is_bitset)
+		iter->word = map->containers[iter->container].bitset[0];
+}
+
+/*
+ * Return the next block of the iteration without consuming it. Empty
+ * bitset words are skipped a whole word at a time.
+ */
+static bool
+iter_peek(datapagemap_iterator_t *iter, BlockNumber *blkno)
+{
+	datapagemap_t *map = iter->map;
+
+	while (iter->container < map->ncontainers)
+	{
+		datapagemap_container *c = &map->containers[iter->container];
+
+		if (!c->is_bitset)
+		{
+			if (iter->pos < c->cardinality)
+			{
+				*blkno = ((BlockNumber) c->key << 16) | c->array[iter->pos];
+				return true;
+			}
+		}
+		else
+		{
+			while (iter->word == 0 && iter->pos < BITSET_WORDS - 1)
+				iter->word = c->bitset[++iter->pos];
+
+			if (iter->word != 0)
+			{
+				*blkno = ((BlockNumber) c->key << 16) |
+					(iter->pos * 64 + word_ctz(iter->word));
+				return true;
+			}
+		}
+
+		iter->container++;
+		iter_enter_container(iter);
+	}
+
+	/* no more set bits in this bitmap. */
+	return false;
+}
+
+/* Consume the block returned by the last iter_peek() */
+static void
+iter_consume(datapagemap_iterator_t *iter)
+{
+	datapagemap_container *c = &iter->map->containers[iter->container];
+
+	if (c->is_bitset)
+		iter->word &= iter->word - 1;
+	else
+		iter->pos++;
+}
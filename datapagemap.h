@@ -13,18 +13,40 @@
 #include "storage/block.h"
 
 
+/*
+ * Blocks sharing the same high 16 bits of their number are kept in one
+ * container, either a sorted array of the low 16 bits when there are few
+ * of them, or a bitset of all the 65536 possible blocks.
+ */
+typedef struct datapagemap_container
+{
+	uint16		key;			/* high 16 bits of the block numbers */
+	bool		is_bitset;
+	int			cardinality;	/* number of blocks in the container */
+	int			capacity;		/* allocated entries of array */
+	uint16	   *array;			/* sorted, if !is_bitset */
+	uint64	   *bitset;			/* if is_bitset */
+} datapagemap_container;
+
 struct datapagemap
 {
-	char	   *bitmap;
-	int			bitmapsize;
+	datapagemap_container *containers;	/* sorted by key */
+	int			ncontainers;
+	int			maxcontainers;
 };
 
 typedef struct datapagemap datapagemap_t;
 typedef struct datapagemap_iterator datapagemap_iterator_t;
 
+extern void datapagemap_init(datapagemap_t *map);
+extern void datapagemap_free(datapagemap_t *map);
+extern bool datapagemap_is_empty(datapagemap_t *map);
 extern void datapagemap_add(datapagemap_t *map, BlockNumber blkno);
+extern bool datapagemap_contains(datapagemap_t *map, BlockNumber blkno);
 extern datapagemap_iterator_t *datapagemap_iterate(datapagemap_t *map);
 extern bool datapagemap_next(datapagemap_iterator_t *iter, BlockNumber *blkno);
+extern bool datapagemap_next_range(datapagemap_iterator_t *iter,
+								   BlockNumber *start, BlockNumber *nblocks);
 extern void datapagemap_print(datapagemap_t *map);
 
 #endif   /* DATAPAGEMAP_H */
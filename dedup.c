@@ -0,0 +1,1346 @@
+/*-------------------------------------------------------------------------
+ *
+ * dedup.c: content-addressed store of the pages of deduplicated backups
+ *
+ * Most pages of consecutive full backups are the same. In a deduplicated
+ * backup, the pages of data files are saved once in the store shared by
+ * all the backups of $BACKUP_PATH/dedup, and the backup files only hold
+ * the SHA-256 of each page. Blocks are appended to pack files, and an
+ * index gives for each block its location and the number of references
+ * to it from the backups of the catalog. Deleting a backup releases its
+ * references, and blocks not referenced anymore are then collected.
+ *
+ * The index holds an entry for each block of the store, so it is neither
+ * loaded nor rewritten as a whole by each run:
+ *
+ * - the index is a file of entries sorted by hash, mapped in memory and
+ *   searched in place;
+ * - each run saving changes writes a journal of its own, made of the
+ *   changes of the references to the blocks already stored, followed by
+ *   the blocks it added sorted by hash. The journals are also mapped and
+ *   searched in place;
+ * - once the journals hold as many records as the index, they are folded
+ *   into a new index, one bucket of hashes after the other so as only the
+ *   changes of a bucket are in memory at once. The blocks not referenced
+ *   anymore are collected at that time.
+ *
+ * The store is opened by dedup_store_open() and closed by
+ * dedup_store_close(), both called with the catalog locked.
+ *
+ * Copyright (c) 2009-2013, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_arman.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common/sha2.h"
+
+#define DEDUP_INDEX_MAGIC		0x44445550	/* "DDUP" */
+#define DEDUP_JOURNAL_MAGIC		0x44444a4e	/* "DDJN" */
+#define DEDUP_INDEX_VERSION		2
+#define DEDUP_INDEX_FILE		"index"
+#define DEDUP_JOURNAL_PREFIX	"journal."
+#define DEDUP_PACK_PREFIX		"pack."
+#define DEDUP_FOLD_PREFIX		"fold."
+
+/* a new pack is started once the current one is that large */
+#define DEDUP_PACK_SIZE			((uint64) 1024 * 1024 * 1024)
+
+/* the journals are folded at the latest once there are that many of them */
+#define DEDUP_MAX_JOURNALS		16
+
+/* changes folded at once are those of hashes with the same first byte */
+#define DEDUP_FOLD_BUCKETS		256
+
+/* entries of the new index read at once to move blocks of packs */
+#define DEDUP_FOLD_CHUNK		1024
+
+/* error met with the store locked, raised once it is unlocked */
+#define DEDUP_ERRBUF_LEN		(MAXPGPATH + 256)
+
+/* header of the index file, followed by the entries and their CRC */
+typedef struct DedupIndexHeader
+{
+	uint64		nentries;
+	uint32		magic;
+	uint32		version;
+	uint32		next_journal;	/* journals numbered lower are folded */
+	uint32		npacks;			/* packs have smaller identifiers */
+} DedupIndexHeader;
+
+/* block of the store, as saved in the index and the journals */
+typedef struct DedupEntry
+{
+	uint8		hash[DEDUP_HASH_LEN];
+	uint32		pack;			/* pack file holding the block */
+	uint32		length;
+	uint64		offset;			/* location of the block in its pack */
+	uint32		refcount;		/* number of references from backups */
+	uint32		padding;
+} DedupEntry;
+
+/* change of the references to a block, as saved in a journal */
+typedef struct DedupRef
+{
+	uint8		hash[DEDUP_HASH_LEN];
+	int32		delta;
+	uint32		padding;
+} DedupRef;
+
+/*
+ * End of a journal file, which starts with nrefs DedupRef followed by
+ * nentries DedupEntry sorted by hash.
+ */
+typedef struct DedupJournalTrailer
+{
+	uint64		nrefs;
+	uint64		nentries;
+	uint32		magic;
+	uint32		version;
+	pg_crc32	crc;			/* of the references and the entries */
+	uint32		padding;
+} DedupJournalTrailer;
+
+/* change of a block while folding, with its location if it was added */
+typedef struct DedupChange
+{
+	uint8		hash[DEDUP_HASH_LEN];
+	uint32		pack;
+	uint32		length;			/* 0 if the block is only referenced */
+	uint64		offset;
+	int32		delta;
+	uint32		padding;
+} DedupChange;
+
+/* the index or a journal, mapped in memory */
+typedef struct DedupRun
+{
+	uint32		number;			/* of the journal */
+	char	   *map;
+	size_t		maplen;
+	const DedupRef *refs;
+	uint64		nrefs;
+	const DedupEntry *entries;	/* sorted by hash */
+	uint64		nentries;
+	pg_crc32	crc;
+} DedupRun;
+
+typedef struct DedupStore
+{
+	char		dir[MAXPGPATH];
+
+	DedupRun	index;
+	DedupRun   *journals;		/* not folded yet, oldest first */
+	int			njournals;
+	uint64		nrecords;		/* references and entries of the journals */
+	uint32		next_journal;	/* number of the journal of this run */
+
+	/* blocks added by this run, with an open addressing hash table */
+	DedupEntry *entries;
+	uint64		nentries;
+	uint64		maxentries;
+	int64	   *slots;			/* -1 if free */
+	uint64		mask;
+
+	/* journal of this run, created on its first reference */
+	FILE	   *journal;
+	uint64		journal_nrefs;
+	pg_crc32	journal_crc;
+
+	uint32		npacks;			/* packs have smaller identifiers */
+	int		   *pack_fds;		/* descriptors to read packs, -1 if closed */
+
+	FILE	   *out;			/* pack blocks are appended to, if any */
+	uint32		out_pack;
+	uint64		out_size;
+
+	pthread_mutex_t lock;
+} DedupStore;
+
+static DedupStore *store = NULL;
+
+static void dedup_map_index(void);
+static void dedup_map_journal(int i);
+static void dedup_map_file(const char *path, char **map, size_t *maplen);
+static const DedupEntry *dedup_find(const uint8 *hash);
+static int dedup_hash_cmp(const void *a, const void *b);
+static bool dedup_add_ref(const uint8 *hash, int32 delta, char *errbuf);
+static bool dedup_journal_write(const void *data, size_t len, char *errbuf);
+static void dedup_commit_journal(void);
+static void dedup_fold(void);
+static void dedup_fold_add(FILE **buckets, uint64 *counts,
+						   const DedupChange *change);
+static DedupChange *dedup_fold_load(FILE **buckets, uint64 *counts, int b);
+static void dedup_fold_move(FILE *fp, const char *path, const bool *rewrite,
+							uint64 nentries, pg_crc32 *crc);
+static bool dedup_rebuild_slots(char *errbuf);
+static int64 dedup_lookup(const uint8 *hash);
+static bool dedup_append(const uint8 *hash, const char *data, size_t len,
+						 char *errbuf);
+static bool dedup_write_block(const char *data, size_t len, uint32 *pack,
+							  uint64 *offset, char *errbuf);
+static int dedup_pack_fd(uint32 pack, char *errbuf);
+static void dedup_read_block(const DedupEntry *entry, char *buf);
+static void dedup_close_out(void);
+static void dedup_pack_path(uint32 pack, char *path);
+static void dedup_journal_path(uint32 number, bool tmp, char *path);
+static void dedup_bucket_path(int b, char *path);
+static void hash_to_hex(const uint8 *hash, char *hex);
+static void sha256(const char *data, size_t len, uint8 *hash);
+
+/*
+ * Open the store of $BACKUP_PATH, creating it if needed. Nothing is done if
+ * the store is already open.
+ */
+void
+dedup_store_open(void)
+{
+	DIR		   *dir;
+	struct dirent *ent;
+	parray	   *numbers;
+	size_t		i;
+	int			j;
+	char		errbuf[DEDUP_ERRBUF_LEN];
+
+	if (store != NULL)
+		return;
+
+	store = pgut_new(DedupStore);
+	memset(store, 0, sizeof(DedupStore));
+	join_path_components(store->dir, backup_path, DEDUP_DIR);
+	dir_create_dir(store->dir, DIR_PERMISSION);
+	pthread_mutex_init(&store->lock, NULL);
+
+	dedup_map_index();
+
+	/*
+	 * Look for the packs and the journals not folded yet. Journals folded
+	 * already and temporary files are left behind by an interrupted run.
+	 */
+	numbers = parray_new();
+	if ((dir = opendir(store->dir)) == NULL)
+		elog(ERROR, "cannot open directory \"%s\": %s",
+			 store->dir, strerror(errno));
+	while ((ent = readdir(dir)) != NULL)
+	{
+		char		path[MAXPGPATH];
+		size_t		namelen = strlen(ent->d_name);
+		uint32		number;
+		int			len = 0;
+
+		join_path_components(path, store->dir, ent->d_name);
+
+		if (namelen > 4 && strcmp(ent->d_name + namelen - 4, ".tmp") == 0)
+		{
+			if (unlink(path) == -1 && errno != ENOENT)
+				elog(ERROR, "cannot remove \"%s\": %s", path, strerror(errno));
+		}
+		else if (sscanf(ent->d_name, DEDUP_PACK_PREFIX "%u%n",
+						&number, &len) == 1 && len == namelen)
+		{
+			if (number >= store->npacks)
+				store->npacks = number + 1;
+		}
+		else if (sscanf(ent->d_name, DEDUP_JOURNAL_PREFIX "%u%n",
+						&number, &len) == 1 && len == namelen)
+		{
+			if (number >= store->next_journal)
+				parray_append(numbers, (void *) (uintptr_t) number);
+			else if (unlink(path) == -1 && errno != ENOENT)
+				elog(ERROR, "cannot remove \"%s\": %s", path, strerror(errno));
+		}
+	}
+	closedir(dir);
+
+	/* one more for the journal of this run */
+	store->journals = pgut_newarray(DedupRun, parray_num(numbers) + 1);
+	memset(store->journals, 0, sizeof(DedupRun) * (parray_num(numbers) + 1));
+	for (i = 0; i < parray_num(numbers); i++)
+	{
+		uint32		number = (uint32) (uintptr_t) parray_get(numbers, i);
+
+		/* insertion sort, as there are a few journals */
+		for (j = store->njournals; j > 0; j--)
+		{
+			if (store->journals[j - 1].number < number)
+				break;
+			store->journals[j] = store->journals[j - 1];
+		}
+		store->journals[j].number = number;
+		store->njournals++;
+	}
+	parray_free(numbers);
+	for (j = 0; j < store->njournals; j++)
+		dedup_map_journal(j);
+	if (store->njournals > 0)
+		store->next_journal = store->journals[store->njournals - 1].number + 1;
+
+	store->maxentries = 1024;
+	store->entries = pgut_newarray(DedupEntry, store->maxentries);
+	if (!dedup_rebuild_slots(errbuf))
+		elog(ERROR, "%s", errbuf);
+
+	store->pack_fds = pgut_newarray(int, store->npacks + 1);
+	for (i = 0; i <= store->npacks; i++)
+		store->pack_fds[i] = -1;
+
+	elog(LOG, "dedup store: %lu blocks in %u packs, %d journals of %lu records",
+		 (unsigned long) store->index.nentries, store->npacks,
+		 store->njournals, (unsigned long) store->nrecords);
+}
+
+/*
+ * Close the store. If save is true, the changes of this run are saved into
+ * its journal, and the journals are folded into the index if they are large
+ * enough. Otherwise the changes are forgotten.
+ */
+void
+dedup_store_close(bool save)
+{
+	uint32		i;
+	int			j;
+
+	if (store == NULL)
+		return;
+
+	dedup_close_out();
+
+	if (save)
+	{
+		dedup_commit_journal();
+
+		/*
+		 * Folding rewrites the whole index, so it is done once the journals
+		 * have as many records for its cost to be spread over the runs.
+		 */
+		if (store->njournals > 0 &&
+			(store->nrecords >= store->index.nentries ||
+			 store->njournals >= DEDUP_MAX_JOURNALS))
+			dedup_fold();
+	}
+	else if (store->journal != NULL)
+	{
+		char		path[MAXPGPATH];
+
+		fclose(store->journal);
+		dedup_journal_path(store->next_journal, true, path);
+		if (unlink(path) == -1)
+			elog(WARNING, "could not remove file \"%s\": %s",
+				 path, strerror(errno));
+	}
+
+	for (i = 0; i < store->npacks; i++)
+		if (store->pack_fds[i] != -1)
+			close(store->pack_fds[i]);
+	if (store->index.map != NULL)
+		munmap(store->index.map, store->index.maplen);
+	for (j = 0; j < store->njournals; j++)
+		if (store->journals[j].map != NULL)
+			munmap(store->journals[j].map, store->journals[j].maplen);
+	pthread_mutex_destroy(&store->lock);
+	free(store->journals);
+	free(store->pack_fds);
+	free(store->slots);
+	free(store->entries);
+	free(store);
+	store = NULL;
+}
+
+bool
+dedup_store_is_open(void)
+{
+	return store != NULL;
+}
+
+/*
+ * Add a reference to the block data, saving it into the store if it is not
+ * there yet. hash receives the SHA-256 of the block identifying it.
+ */
+void
+dedup_put(const char *data, size_t len, uint8 *hash)
+{
+	char		errbuf[DEDUP_ERRBUF_LEN];
+	bool		ok = true;
+
+	sha256(data, len, hash);
+
+	/* the index and the journals do not change while the store is open */
+	if (dedup_find(hash) != NULL)
+		ok = dedup_add_ref(hash, 1, errbuf);
+	else
+	{
+		int64		idx;
+
+		pthread_mutex_lock(&store->lock);
+		idx = dedup_lookup(hash);
+		if (idx >= 0)
+			store->entries[idx].refcount++;
+		else
+			ok = dedup_append(hash, data, len, errbuf);
+		pthread_mutex_unlock(&store->lock);
+	}
+
+	if (!ok)
+		elog(ERROR, "%s", errbuf);
+}
+
+/*
+ * Read the block identified by hash, which must be len bytes long, into
+ * buf. The content of the block is checked against its hash.
+ */
+void
+dedup_get(const uint8 *hash, char *buf, size_t len)
+{
+	const DedupEntry *found;
+	DedupEntry	entry;
+	uint8		check_hash[DEDUP_HASH_LEN];
+	char		hex[DEDUP_HASH_LEN * 2 + 1];
+
+	memset(&entry, 0, sizeof(entry));
+	found = dedup_find(hash);
+	if (found != NULL)
+		entry = *found;
+	else
+	{
+		int64		idx;
+
+		pthread_mutex_lock(&store->lock);
+		idx = dedup_lookup(hash);
+		if (idx >= 0)
+		{
+			entry = store->entries[idx];
+			found = &entry;
+		}
+		pthread_mutex_unlock(&store->lock);
+	}
+
+	hash_to_hex(hash, hex);
+	if (found == NULL)
+		elog(ERROR, "block %s not found in dedup store", hex);
+	if (entry.length != len)
+		elog(ERROR, "block %s of dedup store is %u bytes long, %lu expected",
+			 hex, entry.length, (unsigned long) len);
+
+	dedup_read_block(&entry, buf);
+
+	sha256(buf, len, check_hash);
+	if (memcmp(check_hash, hash, DEDUP_HASH_LEN) != 0)
+		elog(ERROR, "block %s of dedup store is corrupted", hex);
+}
+
+/*
+ * Release a reference to the block identified by hash. The block is removed
+ * from the store when the journals are folded if it is not referenced
+ * anymore.
+ */
+void
+dedup_release(const uint8 *hash)
+{
+	char		errbuf[DEDUP_ERRBUF_LEN];
+
+	if (dedup_find(hash) == NULL)
+	{
+		char		hex[DEDUP_HASH_LEN * 2 + 1];
+
+		hash_to_hex(hash, hex);
+		elog(WARNING, "block %s not found in dedup store", hex);
+		return;
+	}
+
+	if (!dedup_add_ref(hash, -1, errbuf))
+		elog(ERROR, "%s", errbuf);
+}
+
+/*
+ * Map the index. A missing index means an empty store, but an invalid one
+ * cannot be ignored as the blocks of the store would then be lost. Its CRC
+ * is checked when it is folded.
+ */
+static void
+dedup_map_index(void)
+{
+	char		path[MAXPGPATH];
+	DedupIndexHeader header;
+	DedupRun   *index = &store->index;
+
+	join_path_components(path, store->dir, DEDUP_INDEX_FILE);
+	if (access(path, F_OK) == -1)
+	{
+		if (errno != ENOENT)
+			elog(ERROR, "cannot access dedup index \"%s\": %s",
+				 path, strerror(errno));
+		return;
+	}
+
+	dedup_map_file(path, &index->map, &index->maplen);
+	if (index->maplen < sizeof(header))
+		elog(ERROR, "dedup index \"%s\" is invalid", path);
+	memcpy(&header, index->map, sizeof(header));
+	if (header.magic != DEDUP_INDEX_MAGIC ||
+		header.version != DEDUP_INDEX_VERSION)
+		elog(ERROR, "dedup index \"%s\" is invalid", path);
+	if (index->maplen != sizeof(header) +
+		header.nentries * sizeof(DedupEntry) + sizeof(pg_crc32))
+		elog(ERROR, "dedup index \"%s\" is truncated", path);
+
+	index->entries = (const DedupEntry *) (index->map + sizeof(header));
+	index->nentries = header.nentries;
+	memcpy(&index->crc, index->map + index->maplen - sizeof(pg_crc32),
+		   sizeof(pg_crc32));
+	store->next_journal = header.next_journal;
+	store->npacks = header.npacks;
+}
+
+/*
+ * Map the i-th journal, whose number is set.
+ */
+static void
+dedup_map_journal(int i)
+{
+	DedupRun   *run = &store->journals[i];
+	char		path[MAXPGPATH];
+	DedupJournalTrailer trailer;
+
+	dedup_journal_path(run->number, false, path);
+	dedup_map_file(path, &run->map, &run->maplen);
+	if (run->maplen < sizeof(trailer))
+		elog(ERROR, "dedup journal \"%s\" is invalid", path);
+	memcpy(&trailer, run->map + run->maplen - sizeof(trailer), sizeof(trailer));
+	if (trailer.magic != DEDUP_JOURNAL_MAGIC ||
+		trailer.version != DEDUP_INDEX_VERSION ||
+		run->maplen != trailer.nrefs * sizeof(DedupRef) +
+		trailer.nentries * sizeof(DedupEntry) + sizeof(trailer))
+		elog(ERROR, "dedup journal \"%s\" is invalid", path);
+
+	run->refs = (const DedupRef *) run->map;
+	run->nrefs = trailer.nrefs;
+	run->entries = (const DedupEntry *)
+		(run->map + trailer.nrefs * sizeof(DedupRef));
+	run->nentries = trailer.nentries;
+	run->crc = trailer.crc;
+	store->nrecords += run->nrefs + run->nentries;
+}
+
+static void
+dedup_map_file(const char *path, char **map, size_t *maplen)
+{
+	struct stat	st;
+	int			fd;
+
+	fd = open(path, O_RDONLY | PG_BINARY, 0);
+	if (fd == -1 || fstat(fd, &st) == -1)
+		elog(ERROR, "cannot open \"%s\": %s", path, strerror(errno));
+
+	*map = NULL;
+	*maplen = (size_t) st.st_size;
+	if (*maplen > 0)
+	{
+		*map = mmap(NULL, *maplen, PROT_READ, MAP_SHARED, fd, 0);
+		if (*map == MAP_FAILED)
+			elog(ERROR, "cannot map \"%s\": %s", path, strerror(errno));
+	}
+	close(fd);
+}
+
+/*
+ * Return the entry of the block identified by hash in the index or in the
+ * journals, or NULL if there is none. They do not change while the store is
+ * open, so they are searched without locking it.
+ */
+static const DedupEntry *
+dedup_find(const uint8 *hash)
+{
+	const DedupEntry *entry = NULL;
+	int			i;
+
+	if (store->index.nentries > 0)
+		entry = bsearch(hash, store->index.entries, store->index.nentries,
+						sizeof(DedupEntry), dedup_hash_cmp);
+
+	for (i = store->njournals - 1; entry == NULL && i >= 0; i--)
+	{
+		DedupRun   *run = &store->journals[i];
+
+		if (run->nentries > 0)
+			entry = bsearch(hash, run->entries, run->nentries,
+							sizeof(DedupEntry), dedup_hash_cmp);
+	}
+
+	return entry;
+}
+
+/* compare the hashes starting the entries and the changes */
+static int
+dedup_hash_cmp(const void *a, const void *b)
+{
+	return memcmp(a, b, DEDUP_HASH_LEN);
+}
+
+/*
+ * Record a change of the references to a block of the index or of the
+ * journals into the journal of this run.
+ */
+static bool
+dedup_add_ref(const uint8 *hash, int32 delta, char *errbuf)
+{
+	DedupRef	ref;
+	bool		ok;
+
+	memset(&ref, 0, sizeof(ref));
+	memcpy(ref.hash, hash, DEDUP_HASH_LEN);
+	ref.delta = delta;
+
+	pthread_mutex_lock(&store->lock);
+	ok = dedup_journal_write(&ref, sizeof(ref), errbuf);
+	if (ok)
+		store->journal_nrefs++;
+	pthread_mutex_unlock(&store->lock);
+
+	return ok;
+}
+
+/*
+ * Append data to the journal of this run, creating it on first use. Called
+ * with the store locked, so errors are reported into errbuf.
+ */
+static bool
+dedup_journal_write(const void *data, size_t len, char *errbuf)
+{
+	char		path[MAXPGPATH];
+
+	dedup_journal_path(store->next_journal, true, path);
+	if (store->journal == NULL)
+	{
+		store->journal = fopen(path, "w");
+		if (store->journal == NULL)
+		{
+			snprintf(errbuf, DEDUP_ERRBUF_LEN,
+					 "cannot create dedup journal \"%s\": %s",
+					 path, strerror(errno));
+			return false;
+		}
+		if (chmod(path, FILE_PERMISSION) == -1)
+		{
+			snprintf(errbuf, DEDUP_ERRBUF_LEN,
+					 "cannot change mode of \"%s\": %s",
+					 path, strerror(errno));
+			return false;
+		}
+		INIT_CRC32C(store->journal_crc);
+	}
+
+	if (fwrite(data, 1, len, store->journal) != len)
+	{
+		snprintf(errbuf, DEDUP_ERRBUF_LEN,
+				 "cannot write dedup journal \"%s\": %s",
+				 path, strerror(errno));
+		return false;
+	}
+	COMP_CRC32C(store->journal_crc, data, len);
+
+	return true;
+}
+
+/*
+ * Write the blocks added by this run after its references in its journal,
+ * and make the journal durable under its final name.
+ */
+static void
+dedup_commit_journal(void)
+{
+	char		errbuf[DEDUP_ERRBUF_LEN];
+	char		tmp_path[MAXPGPATH];
+	char		path[MAXPGPATH];
+	DedupJournalTrailer trailer;
+
+	if (store->journal == NULL && store->nentries == 0)
+		return;
+
+	qsort(store->entries, store->nentries, sizeof(DedupEntry),
+		  dedup_hash_cmp);
+	if (!dedup_journal_write(store->entries,
+							 sizeof(DedupEntry) * store->nentries, errbuf))
+		elog(ERROR, "%s", errbuf);
+
+	memset(&trailer, 0, sizeof(trailer));
+	trailer.magic = DEDUP_JOURNAL_MAGIC;
+	trailer.version = DEDUP_INDEX_VERSION;
+	trailer.nrefs = store->journal_nrefs;
+	trailer.nentries = store->nentries;
+	FIN_CRC32C(store->journal_crc);
+	trailer.crc = store->journal_crc;
+
+	dedup_journal_path(store->next_journal, true, tmp_path);
+	if (fwrite(&trailer, 1, sizeof(trailer), store->journal) != sizeof(trailer) ||
+		fclose(store->journal) != 0)
+		elog(ERROR, "cannot write dedup journal \"%s\": %s",
+			 tmp_path, strerror(errno));
+	store->journal = NULL;
+
+	/* this also makes durable the entries of the packs created */
+	dedup_journal_path(store->next_journal, false, path);
+	durable_rename(tmp_path, path);
+
+	/* the blocks of this run are searched in its journal from now on */
+	store->nentries = 0;
+	store->journal_nrefs = 0;
+	store->journals[store->njournals].number = store->next_journal++;
+	dedup_map_journal(store->njournals++);
+}
+
+/*
+ * Fold the journals into a new index. Their changes are first sorted into
+ * files by the first byte of their hash, then merged with the entries of
+ * the index one of these buckets after the other. The blocks not referenced
+ * anymore are dropped, packs without any block left are removed, and packs
+ * mostly made of such blocks are rewritten with only the blocks still in
+ * use. The journals and the packs are removed once the new index not
+ * referring to them anymore has been saved.
+ */
+static void
+dedup_fold(void)
+{
+	FILE	   *buckets[DEDUP_FOLD_BUCKETS];
+	uint64		counts[DEDUP_FOLD_BUCKETS];
+	char		path[MAXPGPATH];
+	char		tmp_path[MAXPGPATH];
+	FILE	   *fp;
+	DedupIndexHeader header;
+	pg_crc32	crc;
+	uint32		npacks = store->npacks;
+	uint64	   *live = pgut_newarray(uint64, npacks + 1);
+	uint64	   *dead = pgut_newarray(uint64, npacks + 1);
+	bool	   *rewrite = pgut_newarray(bool, npacks + 1);
+	bool		rewrite_any = false;
+	uint64		idx = 0;
+	uint64		n = 0;
+	uint64		nfreed = 0;
+	uint32		nrewritten = 0;
+	uint32		p;
+	int			b;
+	int			i;
+
+	memset(buckets, 0, sizeof(buckets));
+	memset(counts, 0, sizeof(counts));
+	memset(live, 0, sizeof(uint64) * (npacks + 1));
+	memset(dead, 0, sizeof(uint64) * (npacks + 1));
+
+	join_path_components(path, store->dir, DEDUP_INDEX_FILE);
+	if (store->index.nentries > 0)
+	{
+		INIT_CRC32C(crc);
+		COMP_CRC32C(crc, store->index.entries,
+					sizeof(DedupEntry) * store->index.nentries);
+		FIN_CRC32C(crc);
+		if (!EQ_CRC32C(crc, store->index.crc))
+			elog(ERROR, "dedup index \"%s\" is corrupted", path);
+	}
+
+	/* sort the changes of the journals into buckets */
+	for (i = 0; i < store->njournals; i++)
+	{
+		DedupRun   *run = &store->journals[i];
+		DedupChange	change;
+		uint64		j;
+
+		INIT_CRC32C(crc);
+		COMP_CRC32C(crc, run->map, run->maplen - sizeof(DedupJournalTrailer));
+		FIN_CRC32C(crc);
+		if (!EQ_CRC32C(crc, run->crc))
+		{
+			dedup_journal_path(run->number, false, path);
+			elog(ERROR, "dedup journal \"%s\" is corrupted", path);
+		}
+
+		memset(&change, 0, sizeof(change));
+		for (j = 0; j < run->nrefs; j++)
+		{
+			memcpy(change.hash, run->refs[j].hash, DEDUP_HASH_LEN);
+			change.delta = run->refs[j].delta;
+			dedup_fold_add(buckets, counts, &change);
+		}
+		for (j = 0; j < run->nentries; j++)
+		{
+			memcpy(change.hash, run->entries[j].hash, DEDUP_HASH_LEN);
+			change.pack = run->entries[j].pack;
+			change.length = run->entries[j].length;
+			change.offset = run->entries[j].offset;
+			change.delta = (int32) run->entries[j].refcount;
+			dedup_fold_add(buckets, counts, &change);
+		}
+	}
+
+	/* merge the changes of each bucket with the entries of the index */
+	join_path_components(path, store->dir, DEDUP_INDEX_FILE);
+	snprintf(tmp_path, lengthof(tmp_path), "%s.tmp", path);
+	fp = fopen(tmp_path, "w+");
+	if (fp == NULL)
+		elog(ERROR, "cannot create dedup index \"%s\": %s",
+			 tmp_path, strerror(errno));
+	memset(&header, 0, sizeof(header));
+	if (fwrite(&header, 1, sizeof(header), fp) != sizeof(header))
+		elog(ERROR, "cannot write dedup index \"%s\": %s",
+			 tmp_path, strerror(errno));
+
+	INIT_CRC32C(crc);
+	for (b = 0; b < DEDUP_FOLD_BUCKETS; b++)
+	{
+		DedupChange *changes = dedup_fold_load(buckets, counts, b);
+		uint64		c = 0;
+
+		for (;;)
+		{
+			DedupEntry	entry;
+			bool		located;
+			int64		refcount;
+
+			/* take the lowest hash of the index and of the changes */
+			if (idx < store->index.nentries &&
+				store->index.entries[idx].hash[0] == b &&
+				(c >= counts[b] ||
+				 dedup_hash_cmp(store->index.entries[idx].hash,
+								changes[c].hash) <= 0))
+			{
+				entry = store->index.entries[idx++];
+				located = true;
+				refcount = entry.refcount;
+			}
+			else if (c < counts[b])
+			{
+				memset(&entry, 0, sizeof(entry));
+				memcpy(entry.hash, changes[c].hash, DEDUP_HASH_LEN);
+				located = false;
+				refcount = 0;
+			}
+			else
+				break;
+
+			for (; c < counts[b] &&
+				 dedup_hash_cmp(changes[c].hash, entry.hash) == 0; c++)
+			{
+				if (!located && changes[c].length > 0)
+				{
+					entry.pack = changes[c].pack;
+					entry.length = changes[c].length;
+					entry.offset = changes[c].offset;
+					located = true;
+				}
+				refcount += changes[c].delta;
+			}
+
+			if (!located)
+			{
+				char		hex[DEDUP_HASH_LEN * 2 + 1];
+
+				hash_to_hex(entry.hash, hex);
+				elog(WARNING, "block %s not found in dedup store", hex);
+				continue;
+			}
+			if (entry.pack >= npacks)
+				elog(ERROR, "pack %u of dedup store not found", entry.pack);
+
+			if (refcount <= 0)
+			{
+				dead[entry.pack] += entry.length;
+				nfreed++;
+				continue;
+			}
+
+			entry.refcount = (uint32) refcount;
+			live[entry.pack] += entry.length;
+			if (fwrite(&entry, 1, sizeof(entry), fp) != sizeof(entry))
+				elog(ERROR, "cannot write dedup index \"%s\": %s",
+					 tmp_path, strerror(errno));
+			COMP_CRC32C(crc, &entry, sizeof(entry));
+			n++;
+		}
+		free(changes);
+	}
+
+	/* move the blocks still in use out of the packs mostly unused */
+	for (p = 0; p < npacks; p++)
+	{
+		rewrite[p] = (live[p] > 0 && dead[p] >= live[p]);
+		rewrite_any = rewrite_any || rewrite[p];
+	}
+	if (rewrite_any)
+		dedup_fold_move(fp, tmp_path, rewrite, n, &crc);
+	FIN_CRC32C(crc);
+
+	dedup_close_out();
+
+	header.magic = DEDUP_INDEX_MAGIC;
+	header.version = DEDUP_INDEX_VERSION;
+	header.nentries = n;
+	header.next_journal = store->next_journal;
+	header.npacks = store->npacks;
+	if (fwrite(&crc, 1, sizeof(crc), fp) != sizeof(crc) ||
+		fseeko(fp, 0, SEEK_SET) != 0 ||
+		fwrite(&header, 1, sizeof(header), fp) != sizeof(header) ||
+		fclose(fp) != 0)
+		elog(ERROR, "cannot write dedup index \"%s\": %s",
+			 tmp_path, strerror(errno));
+
+	/* this also makes durable the entries of the packs created */
+	durable_rename(tmp_path, path);
+
+	for (i = 0; i < store->njournals; i++)
+	{
+		dedup_journal_path(store->journals[i].number, false, path);
+		if (unlink(path) == -1 && errno != ENOENT)
+			elog(WARNING, "could not remove file \"%s\": %s",
+				 path, strerror(errno));
+	}
+
+	for (p = 0; p < npacks; p++)
+	{
+		if (live[p] > 0 && !rewrite[p])
+			continue;
+		if (rewrite[p])
+			nrewritten++;
+
+		if (store->pack_fds[p] != -1)
+		{
+			close(store->pack_fds[p]);
+			store->pack_fds[p] = -1;
+		}
+		dedup_pack_path(p, path);
+		if (unlink(path) == -1 && errno != ENOENT)
+			elog(WARNING, "could not remove file \"%s\": %s",
+				 path, strerror(errno));
+	}
+
+	elog(LOG, "dedup store: %d journals folded, %lu blocks removed, %u packs rewritten",
+		 store->njournals, (unsigned long) nfreed, nrewritten);
+
+	free(live);
+	free(dead);
+	free(rewrite);
+}
+
+/*
+ * Append a change to the file of its bucket, created on first use.
+ */
+static void
+dedup_fold_add(FILE **buckets, uint64 *counts, const DedupChange *change)
+{
+	int			b = change->hash[0];
+	char		path[MAXPGPATH];
+
+	dedup_bucket_path(b, path);
+	if (buckets[b] == NULL)
+	{
+		buckets[b] = fopen(path, "w+");
+		if (buckets[b] == NULL)
+			elog(ERROR, "cannot create \"%s\": %s", path, strerror(errno));
+	}
+
+	if (fwrite(change, 1, sizeof(DedupChange), buckets[b]) !=
+		sizeof(DedupChange))
+		elog(ERROR, "cannot write \"%s\": %s", path, strerror(errno));
+	counts[b]++;
+}
+
+/*
+ * Read back the changes of the bucket b sorted by hash, and remove its
+ * file. NULL is returned if there is none.
+ */
+static DedupChange *
+dedup_fold_load(FILE **buckets, uint64 *counts, int b)
+{
+	DedupChange *changes;
+	char		path[MAXPGPATH];
+
+	if (buckets[b] == NULL)
+		return NULL;
+
+	dedup_bucket_path(b, path);
+	changes = pgut_newarray(DedupChange, counts[b]);
+	if (fseeko(buckets[b], 0, SEEK_SET) != 0 ||
+		fread(changes, sizeof(DedupChange), counts[b], buckets[b]) != counts[b])
+		elog(ERROR, "cannot read \"%s\": %s", path, strerror(errno));
+	fclose(buckets[b]);
+	buckets[b] = NULL;
+	if (unlink(path) == -1)
+		elog(WARNING, "could not remove file \"%s\": %s",
+			 path, strerror(errno));
+
+	qsort(changes, counts[b], sizeof(DedupChange), dedup_hash_cmp);
+	return changes;
+}
+
+/*
+ * Copy the blocks of the packs to rewrite to new packs, updating their
+ * entries in the new index fp of nentries entries, whose CRC is computed
+ * again.
+ */
+static void
+dedup_fold_move(FILE *fp, const char *path, const bool *rewrite,
+				uint64 nentries, pg_crc32 *crc)
+{
+	DedupEntry *chunk = pgut_newarray(DedupEntry, DEDUP_FOLD_CHUNK);
+	char	   *buf = NULL;
+	size_t		buflen = 0;
+	uint64		done = 0;
+
+	INIT_CRC32C(*crc);
+	while (done < nentries)
+	{
+		char		errbuf[DEDUP_ERRBUF_LEN];
+		size_t		nchunk = (size_t) Min(nentries - done, DEDUP_FOLD_CHUNK);
+		off_t		pos = sizeof(DedupIndexHeader) + done * sizeof(DedupEntry);
+		size_t		i;
+
+		if (fseeko(fp, pos, SEEK_SET) != 0 ||
+			fread(chunk, sizeof(DedupEntry), nchunk, fp) != nchunk)
+			elog(ERROR, "cannot read dedup index \"%s\": %s",
+				 path, strerror(errno));
+
+		for (i = 0; i < nchunk; i++)
+		{
+			DedupEntry *entry = &chunk[i];
+
+			if (!rewrite[entry->pack])
+				continue;
+
+			if (entry->length > buflen)
+			{
+				buflen = entry->length;
+				buf = pgut_realloc(buf, buflen);
+			}
+			dedup_read_block(entry, buf);
+			if (!dedup_write_block(buf, entry->length, &entry->pack,
+								   &entry->offset, errbuf))
+				elog(ERROR, "%s", errbuf);
+		}
+
+		COMP_CRC32C(*crc, chunk, sizeof(DedupEntry) * nchunk);
+		if (fseeko(fp, pos, SEEK_SET) != 0 ||
+			fwrite(chunk, sizeof(DedupEntry), nchunk, fp) != nchunk)
+			elog(ERROR, "cannot write dedup index \"%s\": %s",
+				 path, strerror(errno));
+		done += nchunk;
+	}
+
+	/* the CRC is written after the entries */
+	if (fseeko(fp, 0, SEEK_END) != 0)
+		elog(ERROR, "cannot write dedup index \"%s\": %s",
+			 path, strerror(errno));
+
+	free(buf);
+	free(chunk);
+}
+
+/*
+ * Rebuild the hash table of the blocks added by this run, sized for at most
+ * half of its slots to be used. Errors are reported into errbuf, the table
+ * being left as it is.
+ */
+static bool
+dedup_rebuild_slots(char *errbuf)
+{
+	uint64		size = 1024;
+	uint64		i;
+	int64	   *slots;
+
+	while (size < store->maxentries * 2)
+		size *= 2;
+
+	slots = (int64 *) malloc(sizeof(int64) * size);
+	if (slots == NULL)
+	{
+		snprintf(errbuf, DEDUP_ERRBUF_LEN,
+				 "could not allocate memory (%lu bytes): %s",
+				 (unsigned long) (sizeof(int64) * size), strerror(errno));
+		return false;
+	}
+	free(store->slots);
+	store->slots = slots;
+	store->mask = size - 1;
+	for (i = 0; i < size; i++)
+		store->slots[i] = -1;
+
+	for (i = 0; i < store->nentries; i++)
+	{
+		uint64		slot;
+
+		memcpy(&slot, store->entries[i].hash, sizeof(slot));
+		slot &= store->mask;
+		while (store->slots[slot] != -1)
+			slot = (slot + 1) & store->mask;
+		store->slots[slot] = (int64) i;
+	}
+
+	return true;
+}
+
+/*
+ * Return the entry of the block identified by hash among those added by
+ * this run, or -1 if there is none. Called with the store locked.
+ */
+static int64
+dedup_lookup(const uint8 *hash)
+{
+	uint64		slot;
+
+	/* the hash is uniformly distributed, so its first bytes do */
+	memcpy(&slot, hash, sizeof(slot));
+	slot &= store->mask;
+	while (store->slots[slot] != -1)
+	{
+		int64	idx = store->slots[slot];
+
+		if (memcmp(store->entries[idx].hash, hash, DEDUP_HASH_LEN) == 0)
+			return idx;
+		slot = (slot + 1) & store->mask;
+	}
+
+	return -1;
+}
+
+/*
+ * Save a new block referenced once into the store. Called with the store
+ * locked, so errors are reported into errbuf.
+ */
+static bool
+dedup_append(const uint8 *hash, const char *data, size_t len, char *errbuf)
+{
+	DedupEntry *entry;
+	uint32		pack;
+	uint64		offset;
+	uint64		slot;
+
+	if (store->nentries >= store->maxentries)
+	{
+		DedupEntry *entries;
+
+		entries = (DedupEntry *) realloc(store->entries,
+							sizeof(DedupEntry) * store->maxentries * 2);
+		if (entries == NULL)
+		{
+			snprintf(errbuf, DEDUP_ERRBUF_LEN,
+					 "could not re-allocate memory (%lu bytes): %s",
+					 (unsigned long) (sizeof(DedupEntry) * store->maxentries * 2),
+					 strerror(errno));
+			return false;
+		}
+		store->entries = entries;
+		store->maxentries *= 2;
+		if (!dedup_rebuild_slots(errbuf))
+			return false;
+	}
+
+	if (!dedup_write_block(data, len, &pack, &offset, errbuf))
+		return false;
+
+	entry = &store->entries[store->nentries];
+	memset(entry, 0, sizeof(DedupEntry));
+	memcpy(entry->hash, hash, DEDUP_HASH_LEN);
+	entry->pack = pack;
+	entry->length = (uint32) len;
+	entry->offset = offset;
+	entry->refcount = 1;
+
+	memcpy(&slot, hash, sizeof(slot));
+	slot &= store->mask;
+	while (store->slots[slot] != -1)
+		slot = (slot + 1) & store->mask;
+	store->slots[slot] = (int64) store->nentries++;
+
+	return true;
+}
+
+/*
+ * Append a block to the current pack, starting a new pack if needed, and
+ * return its location. Errors are reported into errbuf.
+ */
+static bool
+dedup_write_block(const char *data, size_t len, uint32 *pack, uint64 *offset,
+				  char *errbuf)
+{
+	char		path[MAXPGPATH];
+	int		   *fds;
+
+	if (store->out == NULL || store->out_size >= DEDUP_PACK_SIZE)
+	{
+		dedup_close_out();
+
+		fds = (int *) realloc(store->pack_fds,
+							  sizeof(int) * (store->npacks + 2));
+		if (fds == NULL)
+		{
+			snprintf(errbuf, DEDUP_ERRBUF_LEN,
+					 "could not re-allocate memory (%lu bytes): %s",
+					 (unsigned long) (sizeof(int) * (store->npacks + 2)),
+					 strerror(errno));
+			return false;
+		}
+		store->pack_fds = fds;
+		store->out_pack = store->npacks++;
+		store->out_size = 0;
+		store->pack_fds[store->npacks] = -1;
+		store->pack_fds[store->out_pack] = -1;
+
+		dedup_pack_path(store->out_pack, path);
+		store->out = fopen(path, "w");
+		if (store->out == NULL)
+		{
+			snprintf(errbuf, DEDUP_ERRBUF_LEN, "cannot create pack \"%s\": %s",
+					 path, strerror(errno));
+			return false;
+		}
+		if (chmod(path, FILE_PERMISSION) == -1)
+		{
+			snprintf(errbuf, DEDUP_ERRBUF_LEN,
+					 "cannot change mode of \"%s\": %s",
+					 path, strerror(errno));
+			return false;
+		}
+	}
+
+	if (fwrite(data, 1, len, store->out) != len)
+	{
+		dedup_pack_path(store->out_pack, path);
+		snprintf(errbuf, DEDUP_ERRBUF_LEN, "cannot write pack \"%s\": %s",
+				 path, strerror(errno));
+		return false;
+	}
+
+	*pack = store->out_pack;
+	*offset = store->out_size;
+	store->out_size += len;
+
+	return true;
+}
+
+/*
+ * Return a descriptor to read the given pack, opened on first use, or -1
+ * with the error reported into errbuf.
+ */
+static int
+dedup_pack_fd(uint32 pack, char *errbuf)
+{
+	int			fd;
+
+	pthread_mutex_lock(&store->lock);
+	if (store->out != NULL && pack == store->out_pack)
+		fflush(store->out);
+	fd = store->pack_fds[pack];
+	if (fd == -1)
+	{
+		char		path[MAXPGPATH];
+
+		dedup_pack_path(pack, path);
+		fd = open(path, O_RDONLY | PG_BINARY, 0);
+		if (fd == -1)
+			snprintf(errbuf, DEDUP_ERRBUF_LEN, "cannot open pack \"%s\": %s",
+					 path, strerror(errno));
+		else
+			store->pack_fds[pack] = fd;
+	}
+	pthread_mutex_unlock(&store->lock);
+
+	return fd;
+}
+
+static void
+dedup_read_block(const DedupEntry *entry, char *buf)
+{
+	char		errbuf[DEDUP_ERRBUF_LEN];
+	size_t		done = 0;
+	int			fd;
+
+	if (entry->pack >= store->npacks)
+		elog(ERROR, "pack %u of dedup store not found", entry->pack);
+	fd = dedup_pack_fd(entry->pack, errbuf);
+	if (fd == -1)
+		elog(ERROR, "%s", errbuf);
+
+	while (done < entry->length)
+	{
+		ssize_t		rc = pread(fd, buf + done, entry->length - done,
+							   (off_t) (entry->offset + done));
+
+		if (rc <= 0)
+		{
+			char		path[MAXPGPATH];
+
+			dedup_pack_path(entry->pack, path);
+			elog(ERROR, "cannot read pack \"%s\": %s", path,
+				 rc == 0 ? "unexpected end of file" : strerror(errno));
+		}
+		done += rc;
+	}
+}
+
+/*
+ * Close the pack being written, synced at once as the journal or the index
+ * saved next refers to its blocks.
+ */
+static void
+dedup_close_out(void)
+{
+	char		path[MAXPGPATH];
+
+	if (store->out == NULL)
+		return;
+
+	dedup_pack_path(store->out_pack, path);
+	if (fclose(store->out) != 0)
+		elog(ERROR, "cannot write pack \"%s\": %s", path, strerror(errno));
+	store->out = NULL;
+
+	sync_file_now(path);
+}
+
+static void
+dedup_pack_path(uint32 pack, char *path)
+{
+	snprintf(path, MAXPGPATH, "%s/%s%u", store->dir, DEDUP_PACK_PREFIX, pack);
+}
+
+static void
+dedup_journal_path(uint32 number, bool tmp, char *path)
+{
+	snprintf(path, MAXPGPATH, "%s/%s%u%s", store->dir, DEDUP_JOURNAL_PREFIX,
+			 number, tmp ? ".tmp" : "");
+}
+
+static void
+dedup_bucket_path(int b, char *path)
+{
+	snprintf(path, MAXPGPATH, "%s/%s%02x.tmp", store->dir, DEDUP_FOLD_PREFIX, b);
+}
+
+static void
+hash_to_hex(const uint8 *hash, char *hex)
+{
+	int			i;
+
+	for (i = 0; i < DEDUP_HASH_LEN; i++)
+		sprintf(hex + i * 2, "%02x", hash[i]);
+}
+
+/*
+ * SHA-256 of len bytes of data, with the implementation of PostgreSQL.
+ */
+static void
+sha256(const char *data, size_t len, uint8 *hash)
+{
+	pg_sha256_ctx ctx;
+
+	StaticAssertStmt(DEDUP_HASH_LEN == PG_SHA256_DIGEST_LENGTH,
+					 "DEDUP_HASH_LEN must be the length of a SHA-256");
+
+	pg_sha256_init(&ctx);
+	pg_sha256_update(&ctx, (const uint8 *) data, len);
+	pg_sha256_final(&ctx, hash);
+}
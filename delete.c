@@ -68,6 +68,9 @@ do_delete(pgBackupRange *range)
 		}
 	}
 
+	/* remove the blocks of the dedup store the deleted backups used */
+	dedup_store_close(true);
+
 	/* release catalog lock */
 	catalog_unlock();
 
@@ -134,6 +137,9 @@ do_delete(pgBackupRange *range)
 						break;
 					}
 					elog(LOG, "removed WAL segment \"%s\"", wal_file);
+
+					/* its summary is not needed anymore either */
+					wal_summary_remove(arcde->d_name);
 				}
 			}
 			if (errno)
@@ -238,6 +244,9 @@ pgBackupDelete(int keep_generations, int keep_days)
 		pgBackupDeleteFiles(backup);
 	}
 
+	/* remove the blocks of the dedup store the deleted backups used */
+	dedup_store_close(true);
+
 	/* cleanup */
 	parray_walk(backup_list, pgBackupFree);
 	parray_free(backup_list);
@@ -254,11 +263,12 @@ pgBackupDeleteFiles(pgBackup *backup)
 	char	path[MAXPGPATH];
 	char	timestamp[20];
 	parray *files;
+	BackupStatus status = backup->status;
 
 	/*
 	 * If the backup was deleted already, there is nothing to do.
 	 */
-	if (backup->status == BACKUP_STATUS_DELETED)
+	if (status == BACKUP_STATUS_DELETED)
 		return 0;
 
 	time2iso(timestamp, lengthof(timestamp), backup->start_time);
@@ -275,6 +285,29 @@ pgBackupDeleteFiles(pgBackup *backup)
 		pgBackupWriteIni(backup);
 	}
 
+	/*
+	 * Release the references of the backup to the dedup store. They have
+	 * been saved once the backup was done, and they must not be released
+	 * twice if a previous deletion failed, which leaves some blocks in the
+	 * store at worst.
+	 */
+	if (backup->dedup && !check &&
+		(status == BACKUP_STATUS_OK || status == BACKUP_STATUS_DONE ||
+		 status == BACKUP_STATUS_CORRUPT))
+	{
+		char	list_path[MAXPGPATH];
+
+		dedup_store_open();
+		pgBackupGetPath(backup, path, lengthof(path), DATABASE_DIR);
+		pgBackupGetPath(backup, list_path, lengthof(list_path),
+						DATABASE_FILE_LIST);
+		files = dir_read_file_list(path, list_path);
+		for (i = 0; i < parray_num(files); i++)
+			release_data_file(path, (pgFile *) parray_get(files, i), backup);
+		parray_walk(files, pgFileFree);
+		parray_free(files);
+	}
+
 	/* list files to be deleted */
 	files = parray_new();
 	pgBackupGetPath(backup, path, lengthof(path), DATABASE_DIR);
@@ -9,7 +9,9 @@
 
 #include "pg_arman.h"
 
+#include <fcntl.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -30,8 +32,28 @@ const char *pgdata_exclude[] =
 	NULL,			/* sentinel */
 };
 
+/*
+ * Directories made by a worker of dir_make_dirs(), being those of $PGDATA
+ * or those of a location outside of it, as a tablespace.
+ */
+typedef struct MkdirsGroup
+{
+	const char *base;			/* absolute path of the top directory */
+	parray	   *dirs;			/* pgFile, parents first */
+} MkdirsGroup;
+
+/* arguments shared by the workers of dir_make_dirs() */
+typedef struct
+{
+	const char *root;
+	parray	   *groups;			/* MkdirsGroup */
+	int			next;			/* next group to make */
+	pthread_mutex_t lock;		/* protects next */
+} mkdirs_args;
+
 static pgFile *pgFileNew(const char *path, bool omit_symlink);
 static int BlackListCompare(const void *str1, const void *str2);
+static void *dir_make_dirs_worker(void *arg);
 
 /* create directory, also create parent directories if necessary */
 int
@@ -78,6 +100,9 @@ pgFileNew(const char *path, bool omit_symlink)
 	file = (pgFile *) pgut_malloc(sizeof(pgFile));
 
 	file->mtime = st.st_mtime;
+	file->mtime_nsec = st.st_mtim.tv_nsec;
+	file->ctime = st.st_ctime;
+	file->ctime_nsec = st.st_ctim.tv_nsec;
 	file->size = st.st_size;
 	file->read_size = 0;
 	file->write_size = 0;
@@ -85,8 +110,13 @@ pgFileNew(const char *path, bool omit_symlink)
 	file->crc = 0;
 	file->is_datafile = false;
 	file->linked = NULL;
-	file->pagemap.bitmap = NULL;
-	file->pagemap.bitmapsize = 0;
+	datapagemap_init(&file->pagemap);
+	file->pagemap_valid = false;
+	file->container = -1;
+	file->container_offset = 0;
+	file->nchunks = 0;
+	file->chunk_blocks = 0;
+	file->chunks = NULL;
 	file->path = pgut_malloc(strlen(path) + 1);
 	strcpy(file->path, path);		/* enough buffer size guaranteed */
 
@@ -125,37 +155,98 @@ delete_file:
 	}
 }
 
-pg_crc32
-pgFileGetCRC(pgFile *file)
+/*
+ * Calculate CRC of len bytes read from fp, or of all the bytes up to EOF if
+ * len is negative.
+ */
+static pg_crc32
+crc_of_stream(FILE *fp, const char *path, int64 len)
 {
-	FILE	   *fp;
 	pg_crc32	crc = 0;
-	char		buf[1024];
-	size_t		len;
+	char		buf[8192];
+	size_t		want;
+	size_t		read_len;
 	int			errno_tmp;
 
-	/* open file in binary read mode */
-	fp = fopen(file->path, "r");
-	if (fp == NULL)
-		elog(ERROR, "cannot open file \"%s\": %s",
-			file->path, strerror(errno));
-
-	/* calc CRC of backup file */
 	INIT_CRC32C(crc);
-	while ((len = fread(buf, 1, sizeof(buf), fp)) == sizeof(buf))
+	for (;;)
 	{
+		want = sizeof(buf);
+		if (len >= 0 && len < (int64) want)
+			want = (size_t) len;
+
+		read_len = fread(buf, 1, want, fp);
+		throttle_io(read_len, 1);
+		if (read_len > 0)
+			COMP_CRC32C(crc, buf, read_len);
+		if (read_len != sizeof(buf))
+			break;
+		if (len >= 0)
+			len -= read_len;
+
 		if (interrupted)
 			elog(ERROR, "interrupted during CRC calculation");
-		COMP_CRC32C(crc, buf, len);
 	}
 	errno_tmp = errno;
-	if (!feof(fp))
-		elog(WARNING, "cannot read \"%s\": %s", file->path,
+	if (len >= 0 ? read_len != want : !feof(fp))
+		elog(WARNING, "cannot read \"%s\": %s", path,
 			strerror(errno_tmp));
-	if (len > 0)
-		COMP_CRC32C(crc, buf, len);
 	FIN_CRC32C(crc);
 
+	return crc;
+}
+
+pg_crc32
+pgFileGetCRC(pgFile *file)
+{
+	FILE	   *fp;
+	pg_crc32	crc;
+
+	/* open file in binary read mode */
+	fp = fopen(file->path, "r");
+	if (fp == NULL)
+		elog(ERROR, "cannot open file \"%s\": %s",
+			file->path, strerror(errno));
+
+	/* calc CRC of backup file */
+	crc = crc_of_stream(fp, file->path, -1);
+
+	fclose(fp);
+
+	return crc;
+}
+
+/*
+ * Get the path of the container holding the backup of file, root being the
+ * database directory of the backup.
+ */
+void
+pgFileGetContainerPath(const char *root, const pgFile *file, char *path)
+{
+	snprintf(path, MAXPGPATH, "%s/%s.%d", root, CONTAINER_FILE_PREFIX,
+			 file->container);
+}
+
+/*
+ * Calculate CRC of the part of its container holding the backup of file.
+ */
+pg_crc32
+pgFileGetContainerCRC(const char *root, pgFile *file)
+{
+	char		path[MAXPGPATH];
+	FILE	   *fp;
+	pg_crc32	crc;
+
+	pgFileGetContainerPath(root, file, path);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		elog(ERROR, "cannot open file \"%s\": %s",
+			path, strerror(errno));
+	if (fseeko(fp, (off_t) file->container_offset, SEEK_SET) != 0)
+		elog(ERROR, "cannot seek in \"%s\": %s", path, strerror(errno));
+
+	crc = crc_of_stream(fp, path, (int64) file->write_size);
+
 	fclose(fp);
 
 	return crc;
@@ -168,6 +259,8 @@ pgFileFree(void *file)
 		return;
 	free(((pgFile *)file)->linked);
 	free(((pgFile *)file)->path);
+	free(((pgFile *)file)->chunks);
+	datapagemap_free(&((pgFile *)file)->pagemap);
 	free(file);
 }
 
@@ -210,6 +303,24 @@ pgFileCompareMtimeDesc(const void *f1, const void *f2)
 	return -pgFileCompareMtime(f1, f2);
 }
 
+/*
+ * Compare two pgFile with their size in descending order, so as the
+ * largest files are processed first by parallel workers.
+ */
+int
+pgFileCompareSizeDesc(const void *f1, const void *f2)
+{
+	pgFile *f1p = *(pgFile **)f1;
+	pgFile *f2p = *(pgFile **)f2;
+
+	if (f1p->size > f2p->size)
+		return -1;
+	else if (f1p->size < f2p->size)
+		return 1;
+	else
+		return 0;
+}
+
 static int
 BlackListCompare(const void *str1, const void *str2)
 {
@@ -440,6 +551,268 @@ dir_print_mkdirs_sh(FILE *out, const parray *files, const char *root)
 	}
 }
 
+/*
+ * Print the list of the directories and symbolic links to make at restore,
+ * the same as mkdirs.sh but read by dir_make_dirs(). Each line is made of
+ * the type, 'd' or 'l', the mode of a directory or the target of a link,
+ * and the path, relative to root if under it. The fields are separated by
+ * tabs, as the target and the path may hold spaces.
+ */
+void
+dir_print_mkdirs_list(FILE *out, const parray *files, const char *root)
+{
+	int i;
+
+	for (i = 0; i < parray_num(files); i++)
+	{
+		pgFile	   *file = (pgFile *) parray_get(files, i);
+		const char *path = file->path;
+
+		if (strstr(path, root) == path && path[strlen(root)] == '/')
+			path += strlen(root) + 1;
+
+		if (S_ISDIR(file->mode))
+			fprintf(out, "d\t0%o\t%s\n",
+					file->mode & (S_IRWXU | S_IRWXG | S_IRWXO), path);
+		else if (S_ISLNK(file->mode))
+			fprintf(out, "l\t%s\t%s\n", file->linked, path);
+	}
+}
+
+/*
+ * Make under root the directories and symbolic links of the list printed by
+ * dir_print_mkdirs_list() at list_txt, in process instead of running
+ * mkdirs.sh. The directories of $PGDATA and those of each location outside
+ * of it, as the tablespaces, are made by num_jobs workers in parallel, each
+ * directory being made relative to the top one of its location. The links
+ * are made once all the directories exist.
+ */
+void
+dir_make_dirs(const char *root, const char *list_txt)
+{
+	FILE	   *fp;
+	char		buf[MAXPGPATH * 2 + 16];
+	parray	   *links;
+	mkdirs_args	args;
+	MkdirsGroup *group;
+	pthread_t  *workers;
+	int			njobs;
+	int			rootfd;
+	int			ndirs = 0;
+	int			i;
+
+	fp = fopen(list_txt, "rt");
+	if (fp == NULL)
+		elog(ERROR, "cannot open \"%s\": %s", list_txt, strerror(errno));
+
+	args.root = root;
+	args.groups = parray_new();
+	args.next = 0;
+	pthread_mutex_init(&args.lock, NULL);
+	links = parray_new();
+
+	/* the directories of $PGDATA come first */
+	group = pgut_new(MkdirsGroup);
+	group->base = root;
+	group->dirs = parray_new();
+	parray_append(args.groups, group);
+
+	while (fgets(buf, lengthof(buf), fp))
+	{
+		char		type;
+		char	   *arg;
+		char	   *path;
+		int			len;
+		pgFile	   *file;
+
+		len = strlen(buf);
+		if (len > 0 && buf[len - 1] == '\n')
+			buf[--len] = '\0';
+		else if (!feof(fp))
+			elog(ERROR, "too long line found in \"%s\"", list_txt);
+
+		/* type, then mode or target, then path, separated by tabs */
+		type = buf[0];
+		if ((type != 'd' && type != 'l') || buf[1] != '\t')
+			elog(ERROR, "invalid format found in \"%s\"", list_txt);
+		arg = buf + 2;
+		path = strchr(arg, '\t');
+		if (path == NULL)
+			elog(ERROR, "invalid format found in \"%s\"", list_txt);
+		*path++ = '\0';
+		if (arg[0] == '\0' || strlen(arg) >= MAXPGPATH ||
+			path[0] == '\0' || strlen(path) >= MAXPGPATH)
+			elog(ERROR, "invalid format found in \"%s\"", list_txt);
+
+		file = pgut_new(pgFile);
+		memset(file, 0, sizeof(pgFile));
+		datapagemap_init(&file->pagemap);
+		file->container = -1;
+		file->path = pgut_strdup(path);
+
+		if (type == 'l')
+		{
+			file->mode = S_IFLNK;
+			file->linked = pgut_strdup(arg);
+			parray_append(links, file);
+			continue;
+		}
+
+		file->mode = S_IFDIR | (mode_t) strtoul(arg, NULL, 8);
+
+		/* a location outside of $PGDATA starts with its top directory */
+		group = (MkdirsGroup *) parray_get(args.groups, 0);
+		if (is_absolute_path(path))
+		{
+			group = NULL;
+			for (i = parray_num(args.groups) - 1; i > 0; i--)
+			{
+				MkdirsGroup *g = (MkdirsGroup *) parray_get(args.groups, i);
+
+				if (path_is_prefix_of_path(g->base, path))
+				{
+					group = g;
+					break;
+				}
+			}
+			if (group == NULL)
+			{
+				group = pgut_new(MkdirsGroup);
+				group->base = file->path;
+				group->dirs = parray_new();
+				parray_append(args.groups, group);
+			}
+		}
+		parray_append(group->dirs, file);
+	}
+	fclose(fp);
+
+	njobs = Min(num_jobs, parray_num(args.groups));
+	if (njobs <= 1)
+		dir_make_dirs_worker(&args);
+	else
+	{
+		workers = pgut_newarray(pthread_t, njobs);
+		for (i = 0; i < njobs; i++)
+		{
+			int		errnum;
+
+			errnum = pthread_create(&workers[i], NULL, dir_make_dirs_worker,
+									&args);
+			if (errnum != 0)
+				elog(ERROR, "cannot create directory worker: %s",
+					 strerror(errnum));
+		}
+		for (i = 0; i < njobs; i++)
+			pthread_join(workers[i], NULL);
+		free(workers);
+	}
+
+	/* the error has been reported by the worker which failed */
+	if (worker_failed)
+		elog(ERROR, "directory worker failed");
+
+	/* replace what is found at the path of a link, as "rm -f" */
+	rootfd = open(root, O_RDONLY | O_DIRECTORY);
+	if (rootfd == -1)
+		elog(ERROR, "cannot open directory \"%s\": %s", root,
+			 strerror(errno));
+	for (i = 0; i < parray_num(links); i++)
+	{
+		pgFile *file = (pgFile *) parray_get(links, i);
+
+		if (unlinkat(rootfd, file->path, 0) == -1 && errno != ENOENT)
+			elog(ERROR, "cannot remove \"%s\": %s", file->path,
+				 strerror(errno));
+		if (symlinkat(file->linked, rootfd, file->path) == -1)
+			elog(ERROR, "cannot create symbolic link \"%s\": %s", file->path,
+				 strerror(errno));
+	}
+	close(rootfd);
+
+	for (i = 0; i < parray_num(args.groups); i++)
+	{
+		group = (MkdirsGroup *) parray_get(args.groups, i);
+		ndirs += parray_num(group->dirs);
+	}
+	elog(LOG, "made %d directories in %d locations, and %d symbolic links",
+		 ndirs, (int) parray_num(args.groups), (int) parray_num(links));
+
+	for (i = 0; i < parray_num(args.groups); i++)
+	{
+		group = (MkdirsGroup *) parray_get(args.groups, i);
+		parray_walk(group->dirs, pgFileFree);
+		parray_free(group->dirs);
+		free(group);
+	}
+	parray_free(args.groups);
+	parray_walk(links, pgFileFree);
+	parray_free(links);
+	pthread_mutex_destroy(&args.lock);
+}
+
+/*
+ * Worker of dir_make_dirs(). Make the directories of one location after
+ * the other, relative to its top directory.
+ */
+static void *
+dir_make_dirs_worker(void *arg)
+{
+	mkdirs_args *args = (mkdirs_args *) arg;
+
+	for (;;)
+	{
+		MkdirsGroup *group;
+		int			basefd;
+		int			idx;
+		int			i;
+
+		/* stop if another worker failed */
+		if (worker_failed)
+			break;
+
+		pthread_mutex_lock(&args->lock);
+		idx = args->next++;
+		pthread_mutex_unlock(&args->lock);
+
+		if (idx >= parray_num(args->groups))
+			break;
+		group = (MkdirsGroup *) parray_get(args->groups, idx);
+
+		/* the top directory, and its parents if missing */
+		dir_create_dir(group->base, DIR_PERMISSION);
+		basefd = open(group->base, O_RDONLY | O_DIRECTORY);
+		if (basefd == -1)
+			elog(ERROR, "cannot open directory \"%s\": %s", group->base,
+				 strerror(errno));
+
+		for (i = 0; i < parray_num(group->dirs); i++)
+		{
+			pgFile	   *file = (pgFile *) parray_get(group->dirs, i);
+			const char *path = file->path;
+			mode_t		mode = file->mode & (S_IRWXU | S_IRWXG | S_IRWXO);
+
+			/* paths outside of $PGDATA are absolute */
+			if (group->base != args->root)
+			{
+				path += strlen(group->base);
+				while (*path == '/')
+					path++;
+				if (*path == '\0')
+					continue;	/* the top directory itself */
+			}
+
+			if (mkdirat(basefd, path, mode) == -1 && errno != EEXIST)
+				elog(ERROR, "cannot create directory \"%s\": %s", file->path,
+					 strerror(errno));
+		}
+
+		close(basefd);
+	}
+
+	return NULL;
+}
+
 /* print file list */
 void
 dir_print_file_list(FILE *out, const parray *files, const char *root, const char *prefix)
@@ -494,11 +867,61 @@ dir_print_file_list(FILE *out, const parray *files, const char *root, const char
 		{
 			char timestamp[20];
 			time2iso(timestamp, 20, file->mtime);
-			fprintf(out, " %s\n", timestamp);
+			fprintf(out, " %s %ld %lu %ld %ld", timestamp, file->mtime_nsec,
+					(unsigned long) file->size, (long) file->ctime,
+					file->ctime_nsec);
+
+			/* location of the file backed up into a container */
+			if (file->container >= 0)
+				fprintf(out, " %d " INT64_FORMAT, file->container,
+						file->container_offset);
+
+			/* location of the chunks backed up separately, but the first */
+			if (file->nchunks > 1)
+			{
+				int		j;
+
+				fprintf(out, " chunks=%u", file->chunk_blocks);
+				for (j = 1; j < file->nchunks; j++)
+					fprintf(out, "%c" INT64_FORMAT, j == 1 ? ':' : ',',
+							file->chunks[j].offset);
+			}
+			fprintf(out, "\n");
 		}
 	}
 }
 
+/*
+ * Read the chunks of file from the end of its line in the file list, being
+ * the number of blocks of a chunk followed by the offsets of all the chunks
+ * but the first in the backup of the file.
+ */
+static void
+read_file_chunks(pgFile *file, const char *str, const char *file_txt)
+{
+	const char *p;
+	char	   *end;
+	int			i;
+
+	file->nchunks = 1;
+	for (p = str; *p != '\0' && *p != '\n'; p++)
+		if (*p == ':' || *p == ',')
+			file->nchunks++;
+	file->chunks = pgut_newarray(pgFileChunk, file->nchunks);
+	memset(file->chunks, 0, sizeof(pgFileChunk) * file->nchunks);
+
+	file->chunk_blocks = (BlockNumber) strtoul(str, &end, 10);
+	for (i = 1; i < file->nchunks; i++)
+	{
+		if (*end != (i == 1 ? ':' : ','))
+			break;
+		file->chunks[i].offset = (int64) strtoll(end + 1, &end, 10);
+	}
+	if (file->chunk_blocks == 0 || i < file->nchunks || file->nchunks < 2 ||
+		(*end != '\0' && *end != '\n'))
+		elog(ERROR, "invalid format found in \"%s\"", file_txt);
+}
+
 /*
  * Construct parray of pgFile from the file list.
  * If root is not NULL, path will be absolute path.
@@ -525,13 +948,38 @@ dir_read_file_list(const char *root, const char *file_txt)
 		pg_crc32		crc;
 		unsigned int	mode;	/* bit length of mode_t depends on platforms */
 		struct tm		tm;
+		long			mtime_nsec = 0;
+		unsigned long	size = 0;
+		long			ctime = 0;
+		long			ctime_nsec = 0;
+		int				container = -1;
+		int64			container_offset = 0;
+		int				nfields;
+		char		   *chunks;
 		pgFile		   *file;
 
 		memset(&tm, 0, sizeof(tm));
-		if (sscanf(buf, "%s %c %lu %u %o %d-%d-%d %d:%d:%d",
+		nfields = sscanf(buf, "%s %c %lu %u %o %d-%d-%d %d:%d:%d %ld %lu %ld %ld %d " INT64_FORMAT,
 			path, &type, &write_size, &crc, &mode,
 			&tm.tm_year, &tm.tm_mon, &tm.tm_mday,
-			&tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 11)
+			&tm.tm_hour, &tm.tm_min, &tm.tm_sec,
+			&mtime_nsec, &size, &ctime, &ctime_nsec,
+			&container, &container_offset);
+
+		/*
+		 * mtime is followed by its nanoseconds, the size and ctime, then by
+		 * the location of the files saved in a container. Lists of older
+		 * backups have no nanoseconds, size nor ctime, the location in a
+		 * container coming just after mtime.
+		 */
+		if (nfields == 13)
+		{
+			container = (int) mtime_nsec;
+			container_offset = (int64) size;
+			mtime_nsec = 0;
+			size = 0;
+		}
+		else if (nfields != 11 && nfields != 15 && nfields != 17)
 		{
 			elog(ERROR, "invalid format found in \"%s\"",
 				file_txt);
@@ -545,21 +993,31 @@ dir_read_file_list(const char *root, const char *file_txt)
 
 		file = (pgFile *) pgut_malloc(sizeof(pgFile));
 		file->path = pgut_malloc((root ? strlen(root) + 1 : 0) + strlen(path) + 1);
-		file->pagemap.bitmap = NULL;
-		file->pagemap.bitmapsize = 0;
+		datapagemap_init(&file->pagemap);
+		file->pagemap_valid = false;
 
 		tm.tm_year -= 1900;
 		tm.tm_mon -= 1;
 		file->mtime = mktime(&tm);
+		file->mtime_nsec = mtime_nsec;
+		file->ctime = (time_t) ctime;
+		file->ctime_nsec = ctime_nsec;
 		file->mode = mode |
 			((type == 'f' || type == 'F') ? S_IFREG :
 			 type == 'd' ? S_IFDIR : type == 'l' ? S_IFLNK : 0);
-		file->size = 0;
+		file->size = size;
 		file->read_size = 0;
 		file->write_size = write_size;
 		file->crc = crc;
 		file->is_datafile = (type == 'F' ? true : false);
 		file->linked = NULL;
+		file->container = container;
+		file->container_offset = container_offset;
+		file->nchunks = 0;
+		file->chunk_blocks = 0;
+		file->chunks = NULL;
+		if ((chunks = strstr(buf, " chunks=")) != NULL)
+			read_file_chunks(file, chunks + strlen(" chunks="), file_txt);
 		if (root)
 			sprintf(file->path, "%s/%s", root, path);
 		else
@@ -607,7 +1065,7 @@ dir_copy_files(const char *from_root, const char *to_root)
 				elog(LOG, "copying \"%s\"",
 					file->path + strlen(from_root) + 1);
 			if (!check)
-				copy_file(from_root, to_root, file);
+				copy_file(from_root, to_root, file, NULL, false);
 		}
 	}
 
@@ -13,7 +13,11 @@
 
 #include "pg_arman.h"
 
+#include <pthread.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 #include "commands/dbcommands_xlog.h"
 #include "catalog/storage_xlog.h"
@@ -29,18 +33,54 @@ static const char *RmgrNames[RM_MAX_ID + 1] = {
 #include "access/rmgrlist.h"
 };
 
-static void extractPageInfo(XLogReaderState *record);
-
-static int	xlogreadfd = -1;
-static XLogSegNo xlogreadsegno = -1;
-static char xlogfpath[MAXPGPATH];
-
 typedef struct XLogPageReadPrivate
 {
 	const char *archivedir;
 	TimeLineID	tli;
+
+	/* segment currently open */
+	int			readfd;
+	XLogSegNo	readsegno;
+	char		readpath[MAXPGPATH];
+
+	/* whole content of the segment with the segment read method */
+	char	   *segbuf;
+	bool		segbuf_mapped;	/* mmap()'d, or else malloc()'d */
+
+	uint64		bytes_read;		/* for the decoding statistics */
+
+	/* for the WAL of a data directory, where its valid records go */
+	XLogRecPtr	startpoint;
+	bool		start_found;	/* a record starts at startpoint */
+	XLogRecPtr	wal_end;		/* lowest end of WAL found, if any */
 } XLogPageReadPrivate;
 
+/* arguments shared by the workers of extractPageMap() */
+typedef struct extract_args
+{
+	const char *archivedir;
+	TimeLineID	tli;
+	XLogRecPtr	startpoint;
+	XLogSegNo	endSegNo;
+	XLogRecPtr	endpoint;
+	bool		archived;		/* WAL of the archive, or of a data directory */
+
+	XLogSegNo	next;			/* next segment to summarize */
+	int			nreused;		/* summaries found in the backup catalog */
+	uint64		bytes_read;		/* WAL decoded by all the workers */
+	bool		start_found;	/* a record starts at startpoint */
+	XLogRecPtr	wal_end;		/* lowest end of WAL found, or endpoint */
+	pthread_mutex_t lock;		/* protects the above and the page maps */
+} extract_args;
+
+static void *extractPageMapWorker(void *arg);
+static void extractPageInfo(XLogReaderState *record, WalSummary *summary);
+static WalSummary *extractSegmentSummary(XLogPageReadPrivate *private,
+					  XLogSegNo segno, XLogRecPtr endpoint, bool archived);
+static bool OpenXLogSegment(XLogPageReadPrivate *private, XLogSegNo segno);
+static void CloseXLogSegment(XLogPageReadPrivate *private);
+static void PrefetchXLogSegment(XLogPageReadPrivate *private, XLogSegNo segno);
+
 static int SimpleXLogPageRead(XLogReaderState *xlogreader,
 				   XLogRecPtr targetPagePtr,
 				   int reqLen, XLogRecPtr targetRecPtr, char *readBuf,
@@ -50,25 +90,237 @@ static int SimpleXLogPageRead(XLogReaderState *xlogreader,
  * Read WAL from the archive directory, starting from 'startpoint' on the
  * given timeline, until 'endpoint'. Make note of the data blocks touched
  * by the WAL records, and return them in a page map.
+ *
+ * WAL is summarized one segment at a time. The summary of a segment older
+ * than the one of 'endpoint' covers all the records starting in it and is
+ * kept in the backup catalog, so as the next differential backups can use
+ * it instead of decoding the segment again. The segment of 'endpoint' is
+ * only decoded up to it, so its summary is not kept. Records located in
+ * the same segment before 'startpoint' are included as well, which only
+ * causes a few more blocks to be scanned.
+ *
+ * Segments are independent from each other, so they are summarized by
+ * num_jobs workers in parallel, each with its own WAL reader. A summary is
+ * merged into the page maps as soon as it is complete.
+ *
+ * If 'archived' is false, the WAL is the one of pg_xlog in a data
+ * directory, read up to 'endpoint' or up to its end if found before. No
+ * summary is then read from or kept in the backup catalog, as the WAL of a
+ * data directory may differ from the archived WAL of the same timeline.
+ * The end of the WAL read without a gap is then returned, or
+ * InvalidXLogRecPtr if no record starts at 'startpoint'. 'endpoint' is
+ * returned for archived WAL, where a gap is an error.
  */
-void
+XLogRecPtr
 extractPageMap(const char *archivedir, XLogRecPtr startpoint, TimeLineID tli,
-			   XLogRecPtr endpoint)
+			   XLogRecPtr endpoint, bool archived)
+{
+	int			i;
+	int			njobs;
+	XLogSegNo	startSegNo;
+	XLogSegNo	endSegNo;
+	extract_args args;
+	struct timeval start_time;
+	struct timeval end_time;
+	double		elapsed;
+
+	XLByteToSeg(startpoint, startSegNo);
+	XLByteToSeg(endpoint, endSegNo);
+
+	args.archivedir = archivedir;
+	args.tli = tli;
+	args.endSegNo = endSegNo;
+	args.endpoint = endpoint;
+	args.archived = archived;
+	args.next = startSegNo;
+	args.nreused = 0;
+	args.bytes_read = 0;
+	args.startpoint = startpoint;
+	args.start_found = false;
+	args.wal_end = endpoint;
+	pthread_mutex_init(&args.lock, NULL);
+
+	njobs = num_jobs;
+	if (njobs > endSegNo - startSegNo + 1)
+		njobs = (int) (endSegNo - startSegNo + 1);
+
+	gettimeofday(&start_time, NULL);
+
+	if (njobs <= 1)
+		extractPageMapWorker(&args);
+	else
+	{
+		pthread_t  *workers;
+
+		elog(LOG, "starting %d WAL decoding workers", njobs);
+
+		workers = pgut_newarray(pthread_t, njobs);
+		for (i = 0; i < njobs; i++)
+		{
+			int		ret;
+
+			ret = pthread_create(&workers[i], NULL, extractPageMapWorker, &args);
+			if (ret != 0)
+				elog(ERROR, "cannot create WAL decoding worker: %s",
+					 strerror(ret));
+		}
+		for (i = 0; i < njobs; i++)
+			pthread_join(workers[i], NULL);
+		free(workers);
+	}
+
+	/* the error has been reported by the worker which failed */
+	if (worker_failed)
+		elog(ERROR, "WAL decoding worker failed");
+
+	pthread_mutex_destroy(&args.lock);
+
+	gettimeofday(&end_time, NULL);
+	elapsed = (end_time.tv_sec - start_time.tv_sec) +
+		(end_time.tv_usec - start_time.tv_usec) / 1000000.0;
+
+	elog(LOG, "summarized %u WAL segments, %d of them from the backup catalog",
+		 (uint32) (endSegNo - startSegNo + 1), args.nreused);
+	elog(LOG, "decoded %.1f MB of WAL in %.3f s (%.1f MB/s) reading by %s",
+		 args.bytes_read / 1048576.0, elapsed,
+		 elapsed > 0 ? args.bytes_read / 1048576.0 / elapsed : 0.0,
+		 wal_read_method == WAL_READ_SEGMENT ? "segment" : "page");
+
+	if (archived)
+		return endpoint;
+	return args.start_found ? args.wal_end : InvalidXLogRecPtr;
+}
+
+/*
+ * Worker of extractPageMap(). Pull segments until all of them have been
+ * summarized, and merge their summaries into the page maps.
+ */
+static void *
+extractPageMapWorker(void *arg)
+{
+	extract_args *args = (extract_args *) arg;
+	XLogPageReadPrivate private;
+
+	memset(&private, 0, sizeof(private));
+	private.archivedir = args->archivedir;
+	private.tli = args->tli;
+	private.readfd = -1;
+	private.startpoint = args->startpoint;
+
+	for (;;)
+	{
+		XLogSegNo	segno;
+		WalSummary *summary = NULL;
+		bool		complete;
+		bool		reused = false;
+
+		/* stop if another worker failed */
+		if (worker_failed)
+			break;
+
+		pthread_mutex_lock(&args->lock);
+		segno = args->next++;
+		pthread_mutex_unlock(&args->lock);
+
+		if (segno > args->endSegNo)
+			break;
+
+		complete = (segno < args->endSegNo && args->archived);
+
+		if (complete)
+			summary = wal_summary_read(args->tli, segno);
+
+		if (summary != NULL)
+			reused = true;
+		else
+		{
+			summary = extractSegmentSummary(&private, segno, args->endpoint,
+											args->archived);
+			if (complete && !check)
+				wal_summary_write(summary);
+		}
+
+		/* the page maps are shared by all the workers */
+		pthread_mutex_lock(&args->lock);
+		wal_summary_apply(summary);
+		if (reused)
+			args->nreused++;
+		pthread_mutex_unlock(&args->lock);
+
+		wal_summary_free(summary);
+	}
+
+	CloseXLogSegment(&private);
+
+	pthread_mutex_lock(&args->lock);
+	args->bytes_read += private.bytes_read;
+	args->start_found |= private.start_found;
+	if (!XLogRecPtrIsInvalid(private.wal_end) && private.wal_end < args->wal_end)
+		args->wal_end = private.wal_end;
+	pthread_mutex_unlock(&args->lock);
+
+	return NULL;
+}
+
+/*
+ * Decode the records starting in the given segment, stopping at 'endpoint'
+ * if it is in this segment, and return the blocks they modify. The last
+ * record may continue in the next segment. Unless the WAL is 'archived',
+ * the end of the valid records is the end of the WAL, not an error: the
+ * segments following it in a data directory are recycled ones. It is then
+ * noted in private, and so is the record found at its startpoint.
+ */
+static WalSummary *
+extractSegmentSummary(XLogPageReadPrivate *private, XLogSegNo segno,
+					  XLogRecPtr endpoint, bool archived)
 {
 	XLogRecord *record;
 	XLogReaderState *xlogreader;
 	char	   *errormsg;
-	XLogPageReadPrivate private;
+	XLogRecPtr	segstart;
+	XLogRecPtr	segend;
+	XLogRecPtr	startpoint;
+	XLogRecPtr	readend;
+	WalSummary *summary;
+
+	XLogSegNoOffsetToRecPtr(segno, 0, segstart);
+	XLogSegNoOffsetToRecPtr(segno + 1, 0, segend);
 
-	private.archivedir = archivedir;
-	private.tli = tli;
-	xlogreader = XLogReaderAllocate(&SimpleXLogPageRead, &private);
+	xlogreader = XLogReaderAllocate(&SimpleXLogPageRead, private);
 	if (xlogreader == NULL)
 		elog(ERROR, "out of memory");
 
+	summary = wal_summary_new(private->tli, segno);
+
+	/* the segment may begin with the end of a record of the previous one */
+	startpoint = XLogFindNextRecord(xlogreader, segstart);
+	if (XLogRecPtrIsInvalid(startpoint))
+	{
+		if (!archived)
+		{
+			if (XLogRecPtrIsInvalid(private->wal_end) ||
+				segstart < private->wal_end)
+				private->wal_end = segstart;
+			XLogReaderFree(xlogreader);
+			return summary;
+		}
+		elog(ERROR, "could not find a valid record after %X/%X",
+			 (uint32) (segstart >> 32), (uint32) (segstart));
+	}
+
+	readend = startpoint;
 	do
 	{
 		record = XLogReadRecord(xlogreader, startpoint, &errormsg);
+		if (record == NULL && !archived)
+		{
+			elog(LOG, "end of WAL found at %X/%X",
+				 (uint32) (readend >> 32), (uint32) readend);
+			if (XLogRecPtrIsInvalid(private->wal_end) ||
+				readend < private->wal_end)
+				private->wal_end = readend;
+			break;
+		}
 		if (record == NULL)
 		{
 			XLogRecPtr	errptr;
@@ -81,22 +333,153 @@ extractPageMap(const char *archivedir, XLogRecPtr startpoint, TimeLineID tli,
 						 errormsg);
 			else
 				elog(ERROR, "could not read WAL record at %X/%X",
-						 (uint32) (startpoint >> 32),
-						 (uint32) (startpoint));
+						 (uint32) (errptr >> 32),
+						 (uint32) (errptr));
 		}
 
-		extractPageInfo(xlogreader);
+		readend = xlogreader->EndRecPtr;
+		if (xlogreader->ReadRecPtr == private->startpoint)
+			private->start_found = true;
+
+		/* this record belongs to the summary of the next segment */
+		if (xlogreader->ReadRecPtr >= segend)
+			break;
+
+		extractPageInfo(xlogreader, summary);
 
 		startpoint = InvalidXLogRecPtr; /* continue reading at next record */
 
-	} while (xlogreader->ReadRecPtr != endpoint);
+	} while (xlogreader->ReadRecPtr < endpoint);
 
 	XLogReaderFree(xlogreader);
-	if (xlogreadfd != -1)
+
+	wal_summary_compact(summary);
+
+	return summary;
+}
+
+/*
+ * Open the given WAL segment of the archive. With the segment read method,
+ * the whole segment is mapped in memory, or read at once if it cannot be
+ * mapped, and the following segment is prefetched by the kernel while this
+ * one is decoded. Return false on failure.
+ */
+static bool
+OpenXLogSegment(XLogPageReadPrivate *private, XLogSegNo segno)
+{
+	char		xlogfname[MAXFNAMELEN];
+	struct stat	st;
+
+	XLogFileName(xlogfname, private->tli, segno);
+	snprintf(private->readpath, MAXPGPATH, "%s/%s", private->archivedir,
+			 xlogfname);
+	elog(LOG, "opening WAL segment \"%s\"", private->readpath);
+
+	private->readfd = open(private->readpath, O_RDONLY | PG_BINARY, 0);
+	if (private->readfd < 0)
 	{
-		close(xlogreadfd);
-		xlogreadfd = -1;
+		elog(WARNING, "could not open WAL segment \"%s\": %s",
+			 private->readpath, strerror(errno));
+		return false;
 	}
+	private->readsegno = segno;
+
+#if defined(USE_POSIX_FADVISE) && defined(POSIX_FADV_SEQUENTIAL)
+	(void) posix_fadvise(private->readfd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	if (wal_read_method != WAL_READ_SEGMENT)
+		return true;
+
+	/* mapping a segment shorter than expected would fault when reading */
+	if (fstat(private->readfd, &st) < 0 || st.st_size != XLogSegSize)
+	{
+		elog(WARNING, "WAL segment \"%s\" has an incorrect size",
+			 private->readpath);
+		CloseXLogSegment(private);
+		return false;
+	}
+
+	private->segbuf = mmap(NULL, XLogSegSize, PROT_READ, MAP_PRIVATE,
+						   private->readfd, 0);
+	if (private->segbuf != MAP_FAILED)
+	{
+		private->segbuf_mapped = true;
+#ifdef MADV_SEQUENTIAL
+		(void) madvise(private->segbuf, XLogSegSize, MADV_SEQUENTIAL);
+#endif
+	}
+	else
+	{
+		size_t		done = 0;
+
+		private->segbuf = pgut_malloc(XLogSegSize);
+		private->segbuf_mapped = false;
+
+		while (done < XLogSegSize)
+		{
+			ssize_t		rc = read(private->readfd, private->segbuf + done,
+								  XLogSegSize - done);
+
+			if (rc <= 0)
+			{
+				elog(WARNING, "could not read from file \"%s\": %s",
+					 private->readpath, rc < 0 ? strerror(errno) : "unexpected EOF");
+				CloseXLogSegment(private);
+				return false;
+			}
+			done += rc;
+		}
+	}
+
+	/* the content is in memory, so the file is not needed anymore */
+	close(private->readfd);
+	private->readfd = -1;
+
+	PrefetchXLogSegment(private, segno + 1);
+
+	return true;
+}
+
+static void
+CloseXLogSegment(XLogPageReadPrivate *private)
+{
+	if (private->segbuf != NULL)
+	{
+		if (private->segbuf_mapped)
+			munmap(private->segbuf, XLogSegSize);
+		else
+			free(private->segbuf);
+		private->segbuf = NULL;
+	}
+	if (private->readfd != -1)
+	{
+		close(private->readfd);
+		private->readfd = -1;
+	}
+}
+
+/*
+ * Ask the kernel to start reading the given segment in the background, if
+ * it is already archived. This is only a hint, so errors are ignored.
+ */
+static void
+PrefetchXLogSegment(XLogPageReadPrivate *private, XLogSegNo segno)
+{
+#if defined(USE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+	char		xlogfname[MAXFNAMELEN];
+	char		path[MAXPGPATH];
+	int			fd;
+
+	XLogFileName(xlogfname, private->tli, segno);
+	snprintf(path, MAXPGPATH, "%s/%s", private->archivedir, xlogfname);
+
+	fd = open(path, O_RDONLY | PG_BINARY, 0);
+	if (fd < 0)
+		return;
+	(void) posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	close(fd);
+#endif
 }
 
 /* XLogreader callback function, to read a WAL page */
@@ -107,65 +490,53 @@ SimpleXLogPageRead(XLogReaderState *xlogreader, XLogRecPtr targetPagePtr,
 {
 	XLogPageReadPrivate *private = (XLogPageReadPrivate *) xlogreader->private_data;
 	uint32		targetPageOff;
-	XLogRecPtr	targetSegEnd;
 	XLogSegNo	targetSegNo;
+	bool		isopen;
 
 	XLByteToSeg(targetPagePtr, targetSegNo);
-	XLogSegNoOffsetToRecPtr(targetSegNo + 1, 0, targetSegEnd);
 	targetPageOff = targetPagePtr % XLogSegSize;
 
 	/*
 	 * See if we need to switch to a new segment because the requested record
 	 * is not in the currently open one.
 	 */
-	if (xlogreadfd >= 0 && !XLByteInSeg(targetPagePtr, xlogreadsegno))
+	isopen = (private->readfd >= 0 || private->segbuf != NULL);
+	if (isopen && private->readsegno != targetSegNo)
 	{
-		close(xlogreadfd);
-		xlogreadfd = -1;
+		CloseXLogSegment(private);
+		isopen = false;
 	}
 
-	XLByteToSeg(targetPagePtr, xlogreadsegno);
+	if (!isopen && !OpenXLogSegment(private, targetSegNo))
+		return -1;
 
-	if (xlogreadfd < 0)
+	/*
+	 * At this point, we have the right segment open. The xlogreader wants
+	 * the page in its own buffer, so it is copied even from a segment held
+	 * in memory.
+	 */
+	if (private->segbuf != NULL)
+		memcpy(readBuf, private->segbuf + targetPageOff, XLOG_BLCKSZ);
+	else
 	{
-		char		xlogfname[MAXFNAMELEN];
+		Assert(private->readfd != -1);
 
-		XLogFileName(xlogfname, private->tli, xlogreadsegno);
-		snprintf(xlogfpath, MAXPGPATH, "%s/%s", private->archivedir,
-				 xlogfname);
-		elog(LOG, "opening WAL segment \"%s\"", xlogfpath);
-
-		xlogreadfd = open(xlogfpath, O_RDONLY | PG_BINARY, 0);
-
-		if (xlogreadfd < 0)
+		if (lseek(private->readfd, (off_t) targetPageOff, SEEK_SET) < 0)
 		{
-			elog(WARNING, "could not open WAL segment \"%s\": %s",
-				 xlogfpath, strerror(errno));
+			elog(WARNING, "could not seek in file \"%s\": %s",
+				 private->readpath, strerror(errno));
 			return -1;
 		}
-	}
-
-	/*
-	 * At this point, we have the right segment open.
-	 */
-	Assert(xlogreadfd != -1);
 
-	/* Read the requested page */
-	if (lseek(xlogreadfd, (off_t) targetPageOff, SEEK_SET) < 0)
-	{
-		elog(WARNING, "could not seek in file \"%s\": %s", xlogfpath,
-			 strerror(errno));
-		return -1;
-	}
-
-	if (read(xlogreadfd, readBuf, XLOG_BLCKSZ) != XLOG_BLCKSZ)
-	{
-		elog(WARNING, "could not read from file \"%s\": %s",
-			 xlogfpath, strerror(errno));
-		return -1;
+		if (read(private->readfd, readBuf, XLOG_BLCKSZ) != XLOG_BLCKSZ)
+		{
+			elog(WARNING, "could not read from file \"%s\": %s",
+				 private->readpath, strerror(errno));
+			return -1;
+		}
 	}
 
-	Assert(targetSegNo == xlogreadsegno);
+	private->bytes_read += XLOG_BLCKSZ;
 
 	*pageTLI = private->tli;
 	return XLOG_BLCKSZ;
@@ -175,7 +546,7 @@ SimpleXLogPageRead(XLogReaderState *xlogreader, XLogRecPtr targetPagePtr,
  * Extract information on which blocks the current record modifies.
  */
 static void
-extractPageInfo(XLogReaderState *record)
+extractPageInfo(XLogReaderState *record, WalSummary *summary)
 {
 	int			block_id;
 	RmgrId		rmid = XLogRecGetRmid(record);
@@ -239,6 +610,6 @@ extractPageInfo(XLogReaderState *record)
 		if (forknum != MAIN_FORKNUM)
 			continue;
 
-		process_block_change(forknum, rnode, blkno);
+		wal_summary_add(summary, rnode, forknum, blkno);
 	}
 }
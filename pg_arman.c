@@ -9,6 +9,7 @@
 
 #include "pg_arman.h"
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
@@ -25,6 +26,13 @@ char *arclog_path = NULL;
 
 /* common configuration */
 bool check = false;
+int  num_jobs = 1;
+IoMethod io_method = IO_METHOD_SYNC;
+CachePolicy cache_policy = CACHE_POLICY_KEEP;
+SyncMethod sync_method = SYNC_METHOD_FSYNC;
+int64 max_rate = 0;
+int  max_iops = 0;
+int  max_latency = 0;
 
 /* directory configuration */
 pgBackup	current;
@@ -34,17 +42,28 @@ static bool		smooth_checkpoint;
 static int		keep_data_generations = KEEP_INFINITE;
 static int		keep_data_days = KEEP_INFINITE;
 static bool		backup_validate = false;
+WalReadMethod	wal_read_method = WAL_READ_SEGMENT;
+int				max_read_gap = 8;
+int				chunk_size = 0;
 
 /* restore configuration */
 static char		   *target_time;
 static char		   *target_xid;
 static char		   *target_inclusive;
 static TimeLineID	target_tli;
+bool				restore_delta = false;
+bool				restore_rewind = false;
 
 /* show configuration */
 static bool			show_all = false;
 
 static void opt_backup_mode(pgut_option *opt, const char *arg);
+static void opt_wal_read_method(pgut_option *opt, const char *arg);
+static void opt_io_method(pgut_option *opt, const char *arg);
+static void opt_cache_policy(pgut_option *opt, const char *arg);
+static void opt_sync_method(pgut_option *opt, const char *arg);
+static void opt_compress_algorithm(pgut_option *opt, const char *arg);
+static void opt_backup_format(pgut_option *opt, const char *arg);
 static void parse_range(pgBackupRange *range, const char *arg1, const char *arg2);
 
 static pgut_option options[] =
@@ -55,9 +74,21 @@ static pgut_option options[] =
 	{ 's', 'B', "backup-path",	&backup_path,	SOURCE_ENV },
 	/* common options */
 	{ 'b', 'c', "check",		&check },
+	{ 'i', 'j', "jobs",			&num_jobs,		SOURCE_ENV },
+	{ 'f', 10, "io-method",		opt_io_method,	SOURCE_ENV },
+	{ 'f', 18, "cache-policy",	opt_cache_policy, SOURCE_ENV },
+	{ 'f', 19, "sync-method",	opt_sync_method, SOURCE_ENV },
+	{ 'I', 15, "max-rate",		&max_rate,		SOURCE_ENV },
+	{ 'i', 16, "max-iops",		&max_iops,		SOURCE_ENV },
+	{ 'i', 17, "max-latency",	&max_latency,	SOURCE_ENV },
 	/* backup options */
 	{ 'f', 'b', "backup-mode",			opt_backup_mode,		SOURCE_ENV },
 	{ 'b', 'C', "smooth-checkpoint",	&smooth_checkpoint,		SOURCE_ENV },
+	{ 'f', 13, "backup-format",			opt_backup_format,		SOURCE_ENV },
+	{ 'f', 11, "compress-algorithm",	opt_compress_algorithm,	SOURCE_ENV },
+	{ 'i', 12, "compress-level",		&current.compress_level, SOURCE_ENV },
+	{ 'b', 14, "dedup",					&current.dedup,			SOURCE_ENV },
+	{ 'i', 20, "chunk-size",			&chunk_size,			SOURCE_ENV },
 	/* options with only long name (keep-xxx) */
 	{ 'i',  1, "keep-data-generations", &keep_data_generations, SOURCE_ENV },
 	{ 'i',  2, "keep-data-days",		&keep_data_days,		SOURCE_ENV },
@@ -67,6 +98,10 @@ static pgut_option options[] =
 	{ 's',  5, "recovery-target-inclusive", &target_inclusive,	SOURCE_ENV },
 	{ 'u',  6, "recovery-target-timeline",	&target_tli,		SOURCE_ENV },
 	{ 'b',  7, "validate",					&backup_validate,	SOURCE_ENV },
+	{ 'f',  8, "wal-read-method",			opt_wal_read_method, SOURCE_ENV },
+	{ 'i',  9, "max-read-gap",				&max_read_gap,		SOURCE_ENV },
+	{ 'b', 21, "delta",						&restore_delta,		SOURCE_ENV },
+	{ 'b', 22, "rewind",					&restore_rewind,	SOURCE_ENV },
 	/* catalog options */
 	{ 'b', 'a', "show-all",					&show_all },
 	{ 0 }
@@ -148,6 +183,29 @@ main(int argc, char *argv[])
 	if (arclog_path != NULL && !is_absolute_path(arclog_path))
 		elog(ERROR, "-A, --arclog-path must be an absolute path");
 
+	/* at least one worker is needed to copy files */
+	if (num_jobs < 1)
+		elog(ERROR, "-j, --jobs must be a positive integer");
+	if (max_rate < 0)
+		elog(ERROR, "--max-rate must be a positive integer or zero");
+	if (max_iops < 0)
+		elog(ERROR, "--max-iops must be a positive integer or zero");
+	if (max_latency < 0)
+		elog(ERROR, "--max-latency must be a positive integer or zero");
+	if (max_latency > 0 && max_rate == 0)
+		elog(ERROR, "--max-latency needs --max-rate to be set");
+	if (max_read_gap < 0)
+		elog(ERROR, "--max-read-gap must be a positive integer or zero");
+	if (chunk_size != 0 && chunk_size < MIN_CHUNK_SIZE)
+		elog(ERROR, "--chunk-size must be zero or at least %d", MIN_CHUNK_SIZE);
+	if (current.compress_alg == COMPRESS_ZLIB &&
+		(current.compress_level < 0 || current.compress_level > 9))
+		elog(ERROR, "--compress-level must be between 0 and 9 with zlib");
+
+	/* a rewinding restore is a delta restore of fewer blocks */
+	if (restore_rewind)
+		restore_delta = true;
+
 	/* Sanity checks with commands */
 	if (pg_strcasecmp(cmd, "delete") == 0 && arclog_path == NULL)
 		elog(ERROR, "delete command needs ARCLOG_PATH (-A, --arclog-path) to be set");
@@ -215,17 +273,33 @@ pgut_help(bool details)
 	printf(_("  -A, --arclog-path=PATH    location of archive WAL storage area\n"));
 	printf(_("  -B, --backup-path=PATH    location of the backup storage area\n"));
 	printf(_("  -c, --check               show what would have been done\n"));
+	printf(_("  -j, --jobs=NUM            number of parallel workers copying files\n"));
+	printf(_("  --io-method=METHOD        sync or io_uring, to read and write data pages\n"));
+	printf(_("  --cache-policy=POLICY     keep, drop or direct, for files in the OS cache\n"));
+	printf(_("  --sync-method=METHOD      fsync, syncfs, writeback or none, to make durable\n"));
+	printf(_("  --max-rate=BYTES          bytes per second read or written, 0 for no limit\n"));
+	printf(_("  --max-iops=NUM            I/O per second on data files, 0 for no limit\n"));
+	printf(_("  --max-latency=MS          lower max-rate while the server is slower than MS\n"));
 	printf(_("\nBackup options:\n"));
 	printf(_("  -b, --backup-mode=MODE    full or page\n"));
 	printf(_("  -C, --smooth-checkpoint   do smooth checkpoint before backup\n"));
+	printf(_("  --backup-format=FORMAT    plain or container, to save files in containers\n"));
+	printf(_("  --compress-algorithm=ALG  none, pglz or zlib, to compress data pages\n"));
+	printf(_("  --compress-level=LEVEL    compression level of zlib, from 0 to 9\n"));
+	printf(_("  --dedup                   save pages once in a store shared by backups\n"));
+	printf(_("  --chunk-size=MB           back up data files larger than MB by chunks\n"));
 	printf(_("  --validate                validate backup after taking it\n"));
 	printf(_("  --keep-data-generations=N keep GENERATION of full data backup\n"));
 	printf(_("  --keep-data-days=DAY      keep enough data backup to recover to DAY days age\n"));
+	printf(_("  --wal-read-method=METHOD  read archived WAL by page or by segment\n"));
+	printf(_("  --max-read-gap=BLOCKS     unchanged blocks read to merge two changed ranges\n"));
 	printf(_("\nRestore options:\n"));
 	printf(_("  --recovery-target-time    time stamp up to which recovery will proceed\n"));
 	printf(_("  --recovery-target-xid     transaction ID up to which recovery will proceed\n"));
 	printf(_("  --recovery-target-inclusive whether we stop just after the recovery target\n"));
 	printf(_("  --recovery-target-timeline  recovering into a particular timeline\n"));
+	printf(_("  --delta                   rewrite only the files and pages which differ\n"));
+	printf(_("  --rewind                  restore only the pages changed since the backup\n"));
 	printf(_("\nCatalog options:\n"));
 	printf(_("  -a, --show-all            show deleted backup too\n"));
 }
@@ -312,3 +386,87 @@ opt_backup_mode(pgut_option *opt, const char *arg)
 {
 	current.backup_mode = parse_backup_mode(arg);
 }
+
+static void
+opt_wal_read_method(pgut_option *opt, const char *arg)
+{
+	if (pg_strcasecmp(arg, "page") == 0)
+		wal_read_method = WAL_READ_PAGE;
+	else if (pg_strcasecmp(arg, "segment") == 0)
+		wal_read_method = WAL_READ_SEGMENT;
+	else
+		elog(ERROR, "invalid wal-read-method \"%s\"", arg);
+}
+
+static void
+opt_io_method(pgut_option *opt, const char *arg)
+{
+	if (pg_strcasecmp(arg, "sync") == 0)
+		io_method = IO_METHOD_SYNC;
+	else if (pg_strcasecmp(arg, "io_uring") == 0)
+	{
+#ifdef HAVE_LIBURING
+		io_method = IO_METHOD_IO_URING;
+#else
+		elog(ERROR, "io_uring is not supported by this build of pg_arman");
+#endif
+	}
+	else
+		elog(ERROR, "invalid io-method \"%s\"", arg);
+}
+
+static void
+opt_cache_policy(pgut_option *opt, const char *arg)
+{
+	if (pg_strcasecmp(arg, "keep") == 0)
+		cache_policy = CACHE_POLICY_KEEP;
+	else if (pg_strcasecmp(arg, "drop") == 0)
+		cache_policy = CACHE_POLICY_DROP;
+	else if (pg_strcasecmp(arg, "direct") == 0)
+	{
+#ifdef O_DIRECT
+		cache_policy = CACHE_POLICY_DIRECT;
+#else
+		elog(ERROR, "direct I/O is not supported on this platform");
+#endif
+	}
+	else
+		elog(ERROR, "invalid cache-policy \"%s\"", arg);
+}
+
+static void
+opt_compress_algorithm(pgut_option *opt, const char *arg)
+{
+	current.compress_alg = parse_compress_algorithm(arg);
+#ifndef HAVE_LIBZ
+	if (current.compress_alg == COMPRESS_ZLIB)
+		elog(ERROR, "zlib compression is not supported by this build of pg_arman");
+#endif
+}
+
+static void
+opt_backup_format(pgut_option *opt, const char *arg)
+{
+	current.backup_format = parse_backup_format(arg);
+}
+
+static void
+opt_sync_method(pgut_option *opt, const char *arg)
+{
+	if (pg_strcasecmp(arg, "none") == 0)
+		sync_method = SYNC_METHOD_NONE;
+	else if (pg_strcasecmp(arg, "fsync") == 0)
+		sync_method = SYNC_METHOD_FSYNC;
+	else if (pg_strcasecmp(arg, "syncfs") == 0)
+	{
+#ifdef __linux__
+		sync_method = SYNC_METHOD_SYNCFS;
+#else
+		elog(ERROR, "syncfs is not supported on this platform");
+#endif
+	}
+	else if (pg_strcasecmp(arg, "writeback") == 0)
+		sync_method = SYNC_METHOD_WRITEBACK;
+	else
+		elog(ERROR, "invalid sync-method \"%s\"", arg);
+}
@@ -33,18 +33,44 @@
 #define BACKUP_INI_FILE			"backup.ini"
 #define PG_RMAN_INI_FILE		"pg_arman.ini"
 #define MKDIRS_SH_FILE			"mkdirs.sh"
+#define MKDIRS_LIST_FILE		"mkdirs.txt"
 #define DATABASE_FILE_LIST		"file_database.txt"
 #define PG_BACKUP_LABEL_FILE		"backup_label"
 #define PG_BLACK_LIST			"black_list"
+#define WAL_SUMMARY_DIR			"wal_summary"
+#define CONTAINER_FILE_PREFIX	"pg_arman_container"
+#define DEDUP_DIR				"dedup"
+
+/* length of the SHA-256 identifying the blocks of the dedup store */
+#define DEDUP_HASH_LEN			32
+
+/* smallest --chunk-size in MB, and most chunks a data file is split into */
+#define MIN_CHUNK_SIZE			1
+#define MAX_FILE_CHUNKS			64
 
 /* Direcotry/File permission */
 #define DIR_PERMISSION		(0700)
 #define FILE_PERMISSION		(0600)
 
+/* chunk of a data file backed up by a worker of its own */
+typedef struct pgFileChunk
+{
+	int64		offset;			/* location of its pages in the backup of the
+								   file */
+	/* results of the backup of the chunk, merged into its pgFile */
+	size_t		read_size;
+	size_t		write_size;
+	pg_crc32	crc;
+	bool		valid;			/* false if an invalid page was found */
+} pgFileChunk;
+
 /* backup mode file */
 typedef struct pgFile
 {
 	time_t	mtime;			/* time of last modification */
+	long	mtime_nsec;		/* nanoseconds of mtime */
+	time_t	ctime;			/* time of last status change, 0 if unknown */
+	long	ctime_nsec;		/* nanoseconds of ctime */
 	mode_t	mode;			/* protection (file type and permission) */
 	size_t	size;			/* size of the file */
 	size_t	read_size;		/* size of the portion read (if only some pages are
@@ -57,6 +83,14 @@ typedef struct pgFile
 	bool	is_datafile;	/* true if the file is PostgreSQL data file */
 	char	*path; 		/* path of the file */
 	datapagemap_t pagemap;
+	bool	pagemap_valid;	/* true if pagemap has all the blocks changed
+							   since the previous backup */
+	int		container;		/* container holding the backup of the file,
+							   -1 if saved as a file of its own */
+	int64	container_offset;	/* location of the file in its container */
+	int		nchunks;		/* chunks backed up separately, 0 if none */
+	BlockNumber chunk_blocks;	/* blocks of each chunk but the last */
+	pgFileChunk *chunks;
 } pgFile;
 
 typedef struct pgBackupRange
@@ -99,6 +133,21 @@ typedef enum BackupMode
 	BACKUP_MODE_FULL			/* full backup */
 } BackupMode;
 
+/* layout of the files saved in the backup */
+typedef enum BackupFormat
+{
+	BACKUP_FORMAT_PLAIN,		/* one backup file per file of $PGDATA */
+	BACKUP_FORMAT_CONTAINER		/* files appended to a few containers */
+} BackupFormat;
+
+/* compression of the pages of data files */
+typedef enum CompressAlg
+{
+	COMPRESS_NONE,
+	COMPRESS_PGLZ,
+	COMPRESS_ZLIB
+} CompressAlg;
+
 /*
  * pg_arman takes backup into the directroy $BACKUP_PATH/<date>/<time>.
  *
@@ -132,6 +181,16 @@ typedef struct pgBackup
 	/* data/wal block size for compatibility check */
 	uint32		block_size;
 	uint32		wal_block_size;
+
+	/* of the database cluster backed up, 0 if unknown */
+	uint64		system_identifier;
+
+	BackupFormat backup_format;
+	bool		dedup;			/* pages saved in the dedup store */
+
+	/* compression of data pages, needed to read them back */
+	CompressAlg	compress_alg;
+	int			compress_level;
 } pgBackup;
 
 typedef struct pgBackupOption
@@ -161,6 +220,80 @@ typedef struct pgRecoveryTarget
 	bool		recovery_target_inclusive;
 } pgRecoveryTarget;
 
+/* range of blocks of a relation fork modified by WAL records */
+typedef struct WalSummaryRange
+{
+	RelFileNode	rnode;
+	int32		forknum;
+	BlockNumber	blkno;			/* first block of the range */
+	uint32		nblocks;
+} WalSummaryRange;
+
+/* how archived WAL segments are read when decoding them */
+typedef enum WalReadMethod
+{
+	WAL_READ_PAGE,				/* one read() per WAL page */
+	WAL_READ_SEGMENT			/* whole segment mapped or read at once */
+} WalReadMethod;
+
+/* append-only file receiving the files copied by a backup worker */
+typedef struct pgContainer
+{
+	int			id;				/* suffix of the container file name */
+	FILE	   *fp;
+	char		path[MAXPGPATH];
+} pgContainer;
+
+/* how data pages are read and written by batches */
+typedef enum IoMethod
+{
+	IO_METHOD_SYNC,				/* one pread() or pwrite() after the other */
+	IO_METHOD_IO_URING			/* all the requests in flight with io_uring */
+} IoMethod;
+
+/* how the files written by backup and restore are made durable */
+typedef enum SyncMethod
+{
+	SYNC_METHOD_NONE,			/* not synced */
+	SYNC_METHOD_FSYNC,			/* fdatasync() of each file in background */
+	SYNC_METHOD_SYNCFS,			/* syncfs() at the end */
+	SYNC_METHOD_WRITEBACK		/* writeback started by sync_file_range() */
+} SyncMethod;
+
+/* what is left in the page cache of the files read and written */
+typedef enum CachePolicy
+{
+	CACHE_POLICY_KEEP,			/* left as the OS wants */
+	CACHE_POLICY_DROP,			/* dropped once read or written */
+	CACHE_POLICY_DIRECT			/* data pages read with direct I/O, else drop */
+} CachePolicy;
+
+/* read or write of a batch */
+typedef struct IoRequest
+{
+	char	   *buf;
+	size_t		len;
+	off_t		offset;
+	size_t		done;			/* lower than len only at end of file */
+} IoRequest;
+
+typedef struct IoBatch
+{
+	IoRequest  *requests;
+	int			nrequests;
+	int			maxrequests;
+} IoBatch;
+
+/* blocks modified by the records starting in a WAL segment */
+typedef struct WalSummary
+{
+	TimeLineID	tli;
+	XLogSegNo	segno;
+	WalSummaryRange *ranges;	/* sorted once compacted */
+	int			nranges;
+	int			maxranges;
+} WalSummary;
+
 
 /*
  * return pointer that exceeds the length of prefix from character string.
@@ -183,6 +316,22 @@ extern char *arclog_path;
 
 /* common configuration */
 extern bool check;
+extern int	num_jobs;
+extern IoMethod io_method;
+extern CachePolicy cache_policy;
+extern SyncMethod sync_method;
+extern int64 max_rate;
+extern int	max_iops;
+extern int	max_latency;
+
+/* backup configuration */
+extern WalReadMethod wal_read_method;
+extern int	max_read_gap;
+extern int	chunk_size;
+
+/* restore configuration */
+extern bool	restore_delta;
+extern bool	restore_rewind;
 
 /* current settings */
 extern pgBackup current;
@@ -200,6 +349,12 @@ extern void check_server_version(void);
 extern bool fileExists(const char *path);
 extern void process_block_change(ForkNumber forknum, RelFileNode rnode,
 								 BlockNumber blkno);
+extern void add_files(parray *files, const char *root, bool add_root,
+					  bool is_pgdata);
+extern void build_relseg_index(parray *files, const char *root);
+extern void free_relseg_index(void);
+extern void mark_covered_relsegs(parray *files, parray *prev_files,
+								 const char *root);
 
 /* in restore.c */
 extern int do_restore(const char *target_time,
@@ -238,6 +393,9 @@ extern int catalog_lock(void);
 extern void catalog_unlock(void);
 
 extern void catalog_init_config(pgBackup *backup);
+extern CompressAlg parse_compress_algorithm(const char *value);
+extern BackupFormat parse_backup_format(const char *value);
+extern const char *compress_alg2str(CompressAlg alg);
 
 extern void pgBackupWriteConfigSection(FILE *out, pgBackup *backup);
 extern void pgBackupWriteResultSection(FILE *out, pgBackup *backup);
@@ -253,6 +411,8 @@ extern void dir_list_file(parray *files, const char *root, const char *exclude[]
 extern void dir_list_file_internal(parray *files, const char *root, const char *exclude[],
 					bool omit_symlink, bool add_root, parray *black_list);
 extern void dir_print_mkdirs_sh(FILE *out, const parray *files, const char *root);
+extern void dir_print_mkdirs_list(FILE *out, const parray *files, const char *root);
+extern void dir_make_dirs(const char *root, const char *list_txt);
 extern void dir_print_file_list(FILE *out, const parray *files, const char *root, const char *prefix);
 extern parray *dir_read_file_list(const char *root, const char *file_txt);
 
@@ -262,24 +422,93 @@ extern void dir_copy_files(const char *from_root, const char *to_root);
 extern void pgFileDelete(pgFile *file);
 extern void pgFileFree(void *file);
 extern pg_crc32 pgFileGetCRC(pgFile *file);
+extern void pgFileGetContainerPath(const char *root, const pgFile *file,
+								   char *path);
+extern pg_crc32 pgFileGetContainerCRC(const char *root, pgFile *file);
 extern int pgFileComparePath(const void *f1, const void *f2);
 extern int pgFileComparePathDesc(const void *f1, const void *f2);
 extern int pgFileCompareMtime(const void *f1, const void *f2);
 extern int pgFileCompareMtimeDesc(const void *f1, const void *f2);
+extern int pgFileCompareSizeDesc(const void *f1, const void *f2);
 
 /* in data.c */
 extern bool backup_data_file(const char *from_root, const char *to_root,
-							 pgFile *file, const XLogRecPtr *lsn);
+							 pgFile *file, const XLogRecPtr *lsn,
+							 pgContainer *container);
+extern void backup_data_chunk(const char *from_root, const char *to_root,
+							  pgFile *file, const XLogRecPtr *lsn,
+							  int chunkno);
+extern bool backup_data_chunks_end(const char *from_root, const char *to_root,
+								   pgFile *file);
 extern void restore_data_file(const char *from_root, const char *to_root,
-							  pgFile *file);
+							  pgFile *file, pgBackup *backup);
+extern void restore_data_chunk(const char *from_root, const char *to_root,
+							   pgFile *file, pgBackup *backup, int chunkno);
+extern void restore_data_chunks_end(const char *from_root, const char *to_root,
+									pgFile *file);
+extern void restore_data_file_merge(const char *from_root, const char *to_root,
+									pgFile *file, pgBackup *backup,
+									datapagemap_t *written,
+									datapagemap_t *wanted);
+extern bool restore_file_is_restored(const char *from_root,
+									 const char *to_root, pgFile *file);
+extern void restore_data_truncate(const char *from_root, const char *to_root,
+								  pgFile *file);
+extern void release_data_file(const char *from_root, pgFile *file,
+							  pgBackup *backup);
 extern bool copy_file(const char *from_root, const char *to_root,
-					  pgFile *file);
+					  pgFile *file, pgContainer *container, bool calc_crc);
 
 /* parsexlog.c */
-extern void extractPageMap(const char *datadir, XLogRecPtr startpoint,
-						   TimeLineID tli, XLogRecPtr endpoint);
+extern XLogRecPtr extractPageMap(const char *datadir, XLogRecPtr startpoint,
+								 TimeLineID tli, XLogRecPtr endpoint,
+								 bool archived);
+
+/* in walsummary.c */
+extern WalSummary *wal_summary_new(TimeLineID tli, XLogSegNo segno);
+extern void wal_summary_free(WalSummary *summary);
+extern void wal_summary_add(WalSummary *summary, RelFileNode rnode,
+							ForkNumber forknum, BlockNumber blkno);
+extern void wal_summary_compact(WalSummary *summary);
+extern void wal_summary_apply(WalSummary *summary);
+extern WalSummary *wal_summary_read(TimeLineID tli, XLogSegNo segno);
+extern void wal_summary_write(WalSummary *summary);
+extern void wal_summary_remove(const char *wal_fname);
+
+/* in dedup.c */
+extern void dedup_store_open(void);
+extern void dedup_store_close(bool save);
+extern bool dedup_store_is_open(void);
+extern void dedup_put(const char *data, size_t len, uint8 *hash);
+extern void dedup_get(const uint8 *hash, char *buf, size_t len);
+extern void dedup_release(const uint8 *hash);
+
+/* in batchio.c */
+extern IoBatch *io_batch_new(int maxrequests);
+extern void io_batch_free(IoBatch *batch);
+extern void io_batch_reset(IoBatch *batch);
+extern void io_batch_add(IoBatch *batch, char *buf, size_t len, off_t offset);
+extern void io_batch_read(IoBatch *batch, int fd, const char *path);
+extern void io_batch_write(IoBatch *batch, int fd, const char *path);
+extern char *io_buffer_alloc(size_t size);
+extern int io_open_data_file(const char *path);
+extern void io_drop_cache(int fd, const char *path, off_t offset, off_t len,
+						  bool written);
+
+/* in sync.c */
+extern void sync_start(void);
+extern void sync_file(const char *path);
+extern void sync_finish(const char *root, const char *top);
+extern void durable_rename(const char *oldpath, const char *newpath);
+extern void sync_file_now(const char *path);
+
+/* in throttle.c */
+extern void throttle_io(int64 bytes, int nios);
+extern void throttle_adapt_start(void);
+extern void throttle_adapt_stop(void);
 
 /* in util.c */
+extern void get_control_file(ControlFileData *ControlFile);
 extern TimeLineID get_current_timeline(void);
 extern void sanityChecks(void);
 extern void time2iso(char *buf, size_t len, time_t time);
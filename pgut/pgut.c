@@ -12,6 +12,7 @@
 
 #include <getopt.h>
 #include <limits.h>
+#include <pthread.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -48,6 +49,15 @@ static PGcancel *volatile cancel_conn = NULL;
 bool			interrupted = false;
 static bool		in_cleanup = false;
 
+/*
+ * Set when a worker thread stopped on an error. Only the main thread exits,
+ * raising the error once it has waited for the workers. The other workers
+ * poll it without a lock.
+ */
+volatile sig_atomic_t worker_failed = false;
+static pthread_t main_thread;
+static bool		main_thread_known = false;
+
 static bool parse_pair(const char buffer[], char key[], char value[]);
 
 /* Connection routines */
@@ -593,6 +603,9 @@ pgut_getopt(int argc, char **argv, pgut_option options[])
 	struct option	   *longopts;
 	pgut_option		   *opt;
 
+	main_thread = pthread_self();
+	main_thread_known = true;
+
 	if (PROGRAM_NAME == NULL)
 	{
 		PROGRAM_NAME = get_progname(argv[0]);
@@ -1160,6 +1173,9 @@ command(const char *query, int nParams, const char **params)
 
 /*
  * elog - log to stderr and exit if ERROR or FATAL
+ *
+ * In a worker thread, the thread stops instead of the process, after setting
+ * worker_failed for the other threads to stop as well.
  */
 void
 elog(int elevel, const char *fmt, ...)
@@ -1171,6 +1187,9 @@ elog(int elevel, const char *fmt, ...)
 	if (quiet && elevel < WARNING)
 		return;
 
+	/* keep messages of concurrent workers from being interleaved */
+	flockfile(stderr);
+
 	switch (elevel)
 	{
 	case LOG:
@@ -1203,8 +1222,27 @@ elog(int elevel, const char *fmt, ...)
 	fflush(stderr);
 	va_end(args);
 
+	funlockfile(stderr);
+
 	if (elevel > 0)
+	{
+		if (main_thread_known && !pthread_equal(pthread_self(), main_thread))
+		{
+			worker_failed = true;
+			pthread_exit(NULL);
+		}
 		exit_or_abort(elevel);
+	}
+}
+
+/*
+ * Unlock the pthread mutex given, as a handler of pthread_cleanup_push() in
+ * a worker, so as the mutex is not left locked if elog() stops the worker.
+ */
+void
+pgut_mutex_unlock(void *lock)
+{
+	pthread_mutex_unlock((pthread_mutex_t *) lock);
 }
 
 #ifdef WIN32
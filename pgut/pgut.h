@@ -14,6 +14,7 @@
 #include "pqexpbuffer.h"
 
 #include <assert.h>
+#include <signal.h>
 #include <sys/time.h>
 
 #if !defined(C_H) && !defined(__cplusplus)
@@ -100,12 +101,14 @@ extern YesNo	prompt_password;
 
 extern PGconn	   *connection;
 extern bool			interrupted;
+extern volatile sig_atomic_t worker_failed;
 
 extern void help(bool details);
 extern int pgut_getopt(int argc, char **argv, pgut_option options[]);
 extern void pgut_readopt(const char *path, pgut_option options[], int elevel);
 extern void pgut_atexit_push(pgut_atexit_callback callback, void *userdata);
 extern void pgut_atexit_pop(pgut_atexit_callback callback, void *userdata);
+extern void pgut_mutex_unlock(void *lock);
 
 /*
  * Database connections
@@ -9,15 +9,58 @@
 
 #include "pg_arman.h"
 
+#include <dirent.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "catalog/pg_control.h"
 
+/*
+ * File to restore, or chunk of a data file backed up by chunks, handed to a
+ * worker of restore_files(). A file is restored from its versions saved by
+ * the backups of the chain, newest first, down to the first complete one.
+ */
+typedef struct RestoreItem
+{
+	const char *rel_path;		/* path of the file relative to $PGDATA */
+	int			nversions;		/* 0 if not backed up */
+	pgFile	  **versions;
+	pgBackup  **backups;		/* backup of each version */
+	int			index;			/* of file in the file list, for progress */
+	int			chunkno;		/* -1 for the whole file */
+	int		   *chunks_left;	/* chunks of file not restored yet */
+	size_t		size;			/* bytes to read from the backups */
+	datapagemap_t *wanted;		/* blocks to restore, NULL for all */
+	char		tablespace[16];	/* OID of its tablespace, "" for $PGDATA */
+} RestoreItem;
+
+/* arguments shared by the workers of restore_files() */
+typedef struct
+{
+	int			nfiles;			/* files of the file list */
+
+	/* queue of files and chunks to restore */
+	parray	   *queue;
+	int			next;			/* next item of queue to process */
+
+	pthread_mutex_t lock;		/* protects next and chunks_left */
+} restore_files_args;
+
+/*
+ * Files of $PGDATA with --rewind, sorted by path. The page map of those
+ * whose changes since the backup are all known from the WAL of $PGDATA
+ * gives the only blocks to restore.
+ */
+static parray *rewind_files = NULL;
+
 static void backup_online_files(bool re_recovery);
-static void restore_database(pgBackup *backup);
+static bool rewind_scan_wal(pgBackup *backup, TimeLineID tli);
+static void restore_database(parray *chain);
+static void restore_files(parray *chain, parray **lists);
+static void *restore_files_worker(void *arg);
 static void create_recovery_conf(const char *target_time,
 								 const char *target_xid,
 								 const char *target_inclusive,
@@ -52,6 +95,7 @@ do_restore(const char *target_time,
 	pgBackup *base_backup = NULL;
 	parray *files;
 	parray *timelines;
+	parray *chain;				/* backups to restore, oldest first */
 	pgRecoveryTarget *rt = NULL;
 	XLogRecPtr need_lsn;
 
@@ -101,28 +145,6 @@ do_restore(const char *target_time,
 	/* backup online WAL */
 	backup_online_files(cur_tli != 0 && cur_tli != backup_tli);
 
-	/*
-	 * Clear restore destination, but don't remove $PGDATA.
-	 * To remove symbolic link, get file list with "omit_symlink = false".
-	 */
-	if (!check)
-	{
-		elog(LOG, "----------------------------------------");
-		elog(LOG, "clearing restore destination");
-
-		files = parray_new();
-		dir_list_file(files, pgdata, NULL, false, false);
-		parray_qsort(files, pgFileComparePathDesc);	/* delete from leaf */
-
-		for (i = 0; i < parray_num(files); i++)
-		{
-			pgFile *file = (pgFile *) parray_get(files, i);
-			pgFileDelete(file);
-		}
-		parray_walk(files, pgFileFree);
-		parray_free(files);
-	}
-
 	/* Read timeline history files from archives */
 	timelines = readTimeLineHistory(target_tli);
 
@@ -148,8 +170,9 @@ base_backup_found:
 
 	print_backup_lsn(base_backup);
 
-	/* restore base backup */
-	restore_database(base_backup);
+	/* the base backup starts the chain of backups to restore */
+	chain = parray_new();
+	parray_append(chain, base_backup);
 
 	last_restored_index = base_index;
 
@@ -176,10 +199,66 @@ base_backup_found:
 
 		print_backup_lsn(backup);
 
-		restore_database(backup);
+		parray_append(chain, backup);
 		last_restored_index = i;
 	}
 
+	/*
+	 * With --rewind, find the blocks changed in $PGDATA since the newest
+	 * backup from its WAL, before pg_xlog is cleared.
+	 */
+	if (restore_rewind && !check &&
+		!rewind_scan_wal((pgBackup *) parray_get(chain, parray_num(chain) - 1),
+						 cur_tli))
+		elog(WARNING, "cannot rewind $PGDATA from its WAL, "
+			 "its pages are compared with the backup instead");
+
+	/*
+	 * Clear restore destination, but don't remove $PGDATA. A delta restore
+	 * clears only pg_xlog, the other files being compared with the backup
+	 * and rewritten only where they differ.
+	 * To remove symbolic link, get file list with "omit_symlink = false".
+	 */
+	if (!check)
+	{
+		char	clear_path[MAXPGPATH];
+
+		elog(LOG, "----------------------------------------");
+		elog(LOG, "clearing restore destination");
+
+		if (restore_delta)
+			join_path_components(clear_path, pgdata, PG_XLOG_DIR);
+		else
+			strlcpy(clear_path, pgdata, MAXPGPATH);
+
+		files = parray_new();
+		dir_list_file(files, clear_path, NULL, false, false);
+		parray_qsort(files, pgFileComparePathDesc);	/* delete from leaf */
+
+		for (i = 0; i < parray_num(files); i++)
+		{
+			pgFile *file = (pgFile *) parray_get(files, i);
+			pgFileDelete(file);
+		}
+		parray_walk(files, pgFileFree);
+		parray_free(files);
+	}
+
+	/* the files restored are synced once all are written */
+	if (!check)
+		sync_start();
+
+	/* restore the chain at once, newest backup first */
+	restore_database(chain);
+	parray_free(chain);
+
+	if (rewind_files != NULL)
+	{
+		parray_walk(rewind_files, pgFileFree);
+		parray_free(rewind_files);
+		rewind_files = NULL;
+	}
+
 	for (i = last_restored_index; i >= 0; i--)
 	{
 		char	xlogpath[MAXPGPATH];
@@ -195,9 +274,14 @@ base_backup_found:
 		elog(LOG, "all necessary files are found");
 	}
 
+	/* pages of deduplicated backups are not needed anymore */
+	dedup_store_close(false);
+
 	/* create recovery.conf */
 	create_recovery_conf(target_time, target_xid, target_inclusive, target_tli);
 
+	sync_finish(pgdata, NULL);
+
 	/* release catalog lock */
 	catalog_unlock();
 
@@ -218,47 +302,200 @@ base_backup_found:
 }
 
 /*
- * Validate and restore backup.
+ * Find the blocks changed in $PGDATA since backup, the newest backup of the
+ * chain to restore, as pg_rewind does: the WAL of pg_xlog on the timeline
+ * tli of $PGDATA is read from the start of backup up to its end, past the
+ * point where $PGDATA diverged from the WAL archived. The files of $PGDATA
+ * are kept in rewind_files, with the blocks changed in their page map.
+ * Return false if the blocks changed cannot be known for sure: $PGDATA has
+ * to be the database cluster backed up, its hint bit changes have to be
+ * WAL-logged, and its WAL has to be read without a gap from a record at the
+ * start of the backup up to the end of the backup at least.
  */
-void
-restore_database(pgBackup *backup)
+static bool
+rewind_scan_wal(pgBackup *backup, TimeLineID tli)
 {
+	char		xlog_path[MAXPGPATH];
+	char		path[MAXPGPATH];
+	char		xlogfname[MAXFNAMELEN];
+	XLogSegNo	startSegNo;
+	XLogSegNo	endSegNo;
+	XLogRecPtr	endpoint;
+	DIR		   *dir;
+	struct dirent *de;
+	parray	   *backup_files;
+	ControlFileData ControlFile;
+	XLogRecPtr	wal_end;
+	int			ncovered = 0;
+	int			i;
+
+	/* the WAL of $PGDATA has to follow the timeline of the backup */
+	if (tli == 0 || tli != backup->tli)
+		return false;
+
+	/* backups taken before the identifier was recorded are not trusted */
+	get_control_file(&ControlFile);
+	if (backup->system_identifier == 0 ||
+		ControlFile.system_identifier != backup->system_identifier)
+	{
+		elog(LOG, "$PGDATA is not the database cluster backed up");
+		return false;
+	}
+
+	/* else a page may change with only its hint bits, not in WAL */
+	if (ControlFile.data_checksum_version != PG_DATA_CHECKSUM_VERSION &&
+		!ControlFile.wal_log_hints)
+	{
+		elog(LOG, "$PGDATA uses neither data checksums nor \"wal_log_hints = on\"");
+		return false;
+	}
+
+	join_path_components(xlog_path, pgdata, PG_XLOG_DIR);
+	XLByteToSeg(backup->start_lsn, startSegNo);
+	XLogFileName(xlogfname, tli, startSegNo);
+	join_path_components(path, xlog_path, xlogfname);
+	if (!fileExists(path))
+		return false;
+
+	/* the WAL ends in the last segment of the timeline, if not before */
+	endSegNo = startSegNo;
+	dir = opendir(xlog_path);
+	if (dir == NULL)
+		elog(ERROR, "cannot open directory \"%s\": %s", xlog_path,
+			 strerror(errno));
+	while ((de = readdir(dir)) != NULL)
+	{
+		TimeLineID	seg_tli;
+		XLogSegNo	segno;
+
+		if (!IsXLogFileName(de->d_name))
+			continue;
+		XLogFromFileName(de->d_name, &seg_tli, &segno);
+		if (seg_tli == tli && segno > endSegNo)
+			endSegNo = segno;
+	}
+	closedir(dir);
+	XLogSegNoOffsetToRecPtr(endSegNo, XLogSegSize - 1, endpoint);
+
+	elog(LOG, "----------------------------------------");
+	elog(LOG, "reading WAL of $PGDATA from %X/%X",
+		 (uint32) (backup->start_lsn >> 32), (uint32) backup->start_lsn);
+
+	/* files of $PGDATA, with the blocks changed in WAL */
+	rewind_files = parray_new();
+	add_files(rewind_files, pgdata, false, true);
+	parray_qsort(rewind_files, pgFileComparePath);
+	build_relseg_index(rewind_files, pgdata);
+	wal_end = extractPageMap(xlog_path, backup->start_lsn, tli, endpoint,
+							 false);
+	if (XLogRecPtrIsInvalid(wal_end) || wal_end < backup->stop_lsn)
+	{
+		if (XLogRecPtrIsInvalid(wal_end))
+			elog(LOG, "no WAL record found at %X/%X",
+				 (uint32) (backup->start_lsn >> 32),
+				 (uint32) backup->start_lsn);
+		else
+			elog(LOG, "WAL of $PGDATA ends at %X/%X, before the end of the backup",
+				 (uint32) (wal_end >> 32), (uint32) wal_end);
+		free_relseg_index();
+		parray_walk(rewind_files, pgFileFree);
+		parray_free(rewind_files);
+		rewind_files = NULL;
+		return false;
+	}
+
+	/* only the relation segments saved by the backup qualify */
+	pgBackupGetPath(backup, path, lengthof(path), DATABASE_FILE_LIST);
+	backup_files = dir_read_file_list(pgdata, path);
+	mark_covered_relsegs(rewind_files, backup_files, pgdata);
+	free_relseg_index();
+	parray_walk(backup_files, pgFileFree);
+	parray_free(backup_files);
+
+	for (i = 0; i < parray_num(rewind_files); i++)
+	{
+		if (((pgFile *) parray_get(rewind_files, i))->pagemap_valid)
+			ncovered++;
+	}
+	elog(LOG, "%d relation segments are restored from the blocks changed in WAL",
+		 ncovered);
+
+	return true;
+}
+
+/*
+ * Validate and restore a chain of backups, made of a full backup followed
+ * by differential backups, oldest first.
+ *
+ * The chain is restored in a single pass instead of one backup after the
+ * other: each file of the newest backup is restored from its newest version
+ * back to the oldest one needed, skipping the blocks already restored from
+ * a newer version, so as each block is written once. The directories and
+ * the files left are those of the newest backup, as if the backups of the
+ * chain had been restored in turn.
+ */
+static void
+restore_database(parray *chain)
+{
+	pgBackup *backup = (pgBackup *) parray_get(chain, parray_num(chain) - 1);
 	char	timestamp[100];
 	char	path[MAXPGPATH];
 	char	list_path[MAXPGPATH];
 	int		ret;
 	parray *files;
+	parray **lists;				/* file list of each backup of chain */
+	bool	dedup = false;
 	int		i;
 
-	/* confirm block size compatibility */
-	if (backup->block_size != BLCKSZ)
-		elog(ERROR,
-			"BLCKSZ(%d) is not compatible(%d expected)",
-			backup->block_size, BLCKSZ);
-	if (backup->wal_block_size != XLOG_BLCKSZ)
-		elog(ERROR,
-			"XLOG_BLCKSZ(%d) is not compatible(%d expected)",
-			backup->wal_block_size, XLOG_BLCKSZ);
-
-	time2iso(timestamp, lengthof(timestamp), backup->start_time);
-	if (!check)
+	for (i = 0; i < parray_num(chain); i++)
 	{
-		elog(LOG, "----------------------------------------");
-		elog(LOG, "restoring database from backup %s", timestamp);
+		pgBackup *b = (pgBackup *) parray_get(chain, i);
+
+		/* confirm block size compatibility */
+		if (b->block_size != BLCKSZ)
+			elog(ERROR,
+				"BLCKSZ(%d) is not compatible(%d expected)",
+				b->block_size, BLCKSZ);
+		if (b->wal_block_size != XLOG_BLCKSZ)
+			elog(ERROR,
+				"XLOG_BLCKSZ(%d) is not compatible(%d expected)",
+				b->wal_block_size, XLOG_BLCKSZ);
+
+		time2iso(timestamp, lengthof(timestamp), b->start_time);
+		if (!check)
+		{
+			elog(LOG, "----------------------------------------");
+			elog(LOG, "restoring database from backup %s", timestamp);
+		}
+
+		/*
+		 * Validate backup files with its size, because load of CRC calculation is
+		 * not right.
+		 */
+		pgBackupValidate(b, true, false);
+
+		if (b->dedup)
+			dedup = true;
 	}
 
 	/*
-	 * Validate backup files with its size, because load of CRC calculation is
-	 * not right.
+	 * make directories and symbolic links of the newest backup, in process
+	 * from their list, or with mkdirs.sh for backups taken without it.
 	 */
-	pgBackupValidate(backup, true, false);
+	pgBackupGetPath(backup, path, lengthof(path), MKDIRS_LIST_FILE);
+	if (!check && fileExists(path))
+	{
+		/* create pgdata directory */
+		dir_create_dir(pgdata, DIR_PERMISSION);
 
-	/* make direcotries and symbolic links */
-	pgBackupGetPath(backup, path, lengthof(path), MKDIRS_SH_FILE);
-	if (!check)
+		dir_make_dirs(pgdata, path);
+	}
+	else if (!check)
 	{
 		char pwd[MAXPGPATH];
 
+		pgBackupGetPath(backup, path, lengthof(path), MKDIRS_SH_FILE);
+
 		/* keep orginal directory */
 		if (getcwd(pwd, sizeof(pwd)) == NULL)
 			elog(ERROR, "cannot get current working directory: %s",
@@ -285,70 +522,39 @@ restore_database(pgBackup *backup)
 	}
 
 	/*
-	 * get list of files which need to be restored.
+	 * get list of files of each backup, the files to restore being those of
+	 * the newest one.
 	 */
-	pgBackupGetPath(backup, path, lengthof(path), DATABASE_DIR);
-	pgBackupGetPath(backup, list_path, lengthof(list_path), DATABASE_FILE_LIST);
-	files = dir_read_file_list(path, list_path);
-	for (i = parray_num(files) - 1; i >= 0; i--)
+	lists = pgut_newarray(parray *, parray_num(chain));
+	for (i = 0; i < parray_num(chain); i++)
 	{
-		pgFile *file = (pgFile *) parray_get(files, i);
+		pgBackup *b = (pgBackup *) parray_get(chain, i);
 
-		/* remove files which are not backed up */
-		if (file->write_size == BYTES_INVALID)
-			pgFileFree(parray_remove(files, i));
+		pgBackupGetPath(b, path, lengthof(path), DATABASE_DIR);
+		pgBackupGetPath(b, list_path, lengthof(list_path), DATABASE_FILE_LIST);
+		lists[i] = dir_read_file_list(path, list_path);
 	}
 
-	/* restore files into $PGDATA */
-	for (i = 0; i < parray_num(files); i++)
-	{
-		char from_root[MAXPGPATH];
-		pgFile *file = (pgFile *) parray_get(files, i);
-
-		pgBackupGetPath(backup, from_root, lengthof(from_root), DATABASE_DIR);
-
-		/* check for interrupt */
-		if (interrupted)
-			elog(ERROR, "interrupted during restore database");
-
-		/* print progress */
-		if (!check)
-			elog(LOG, "(%d/%lu) %s ", i + 1, (unsigned long) parray_num(files),
-				file->path + strlen(from_root) + 1);
-
-		/* directories are created with mkdirs.sh */
-		if (S_ISDIR(file->mode))
-		{
-			if (!check)
-				elog(LOG, "directory, skip");
-			continue;
-		}
+	/* pages of deduplicated backups are read from the dedup store */
+	if (dedup && !check)
+		dedup_store_open();
 
-		/* not backed up */
-		if (file->write_size == BYTES_INVALID)
-		{
-			if (!check)
-				elog(LOG, "not backed up, skip");
-			continue;
-		}
-
-		/* restore file */
-		if (!check)
-			restore_data_file(from_root, pgdata, file);
+	/* restore files into $PGDATA */
+	restore_files(chain, lists);
 
-		/* print size of restored file */
-		if (!check)
-			elog(LOG, "restored %lu\n", (unsigned long) file->write_size);
+	for (i = 0; i < parray_num(chain); i++)
+	{
+		parray_walk(lists[i], pgFileFree);
+		parray_free(lists[i]);
 	}
+	free(lists);
 
 	/* Delete files which are not in file list. */
+	files = NULL;
 	if (!check)
 	{
 		parray *files_now;
 
-		parray_walk(files, pgFileFree);
-		parray_free(files);
-
 		/* re-read file list to change base path to $PGDATA */
 		files = dir_read_file_list(pgdata, list_path);
 		parray_qsort(files, pgFileComparePathDesc);
@@ -382,8 +588,11 @@ restore_database(pgBackup *backup)
 			strerror(errno));
 
 	/* cleanup */
-	parray_walk(files, pgFileFree);
-	parray_free(files);
+	if (files != NULL)
+	{
+		parray_walk(files, pgFileFree);
+		parray_free(files);
+	}
 
 	if (!check)
 		elog(LOG, "restore backup completed");
@@ -425,7 +634,453 @@ create_recovery_conf(const char *target_time,
 		fprintf(fp, "recovery_target_timeline = '%u'\n", target_tli);
 
 		fclose(fp);
+		sync_file(path);
+	}
+}
+/*
+ * Compare two RestoreItem by their size in descending order.
+ */
+static int
+restore_item_compare_size_desc(const void *i1, const void *i2)
+{
+	const RestoreItem *i1p = *(RestoreItem **) i1;
+	const RestoreItem *i2p = *(RestoreItem **) i2;
+
+	if (i1p->size > i2p->size)
+		return -1;
+	if (i1p->size < i2p->size)
+		return 1;
+	return 0;
+}
+
+/*
+ * Queue the item for restore_files(), with the tablespace of its file.
+ */
+static void
+restore_queue_item(parray *queue, const char *rel_path, int nversions,
+				   pgFile **versions, pgBackup **backups, int index,
+				   int chunkno, int *chunks_left, size_t size,
+				   datapagemap_t *wanted)
+{
+	RestoreItem *item = pgut_new(RestoreItem);
+
+	item->rel_path = rel_path;
+	item->nversions = nversions;
+	item->versions = versions;
+	item->backups = backups;
+	item->index = index;
+	item->chunkno = chunkno;
+	item->chunks_left = chunks_left;
+	item->size = size;
+	item->wanted = wanted;
+
+	/* files of a tablespace are under pg_tblspc/<oid>/ */
+	item->tablespace[0] = '\0';
+	if (strncmp(rel_path, PG_TBLSPC_DIR "/", strlen(PG_TBLSPC_DIR) + 1) == 0)
+	{
+		const char *oid = rel_path + strlen(PG_TBLSPC_DIR) + 1;
+		size_t		len = strcspn(oid, "/");
+
+		if (len < sizeof(item->tablespace))
+		{
+			memcpy(item->tablespace, oid, len);
+			item->tablespace[len] = '\0';
+		}
+	}
+
+	parray_append(queue, item);
+}
+
+/*
+ * Find the versions of the file at rel_path to restore, from the newest
+ * backup of chain back to the oldest one needed, into versions and backups.
+ * Return their number. A version is complete if the file was saved by a
+ * simple copy, or by a full backup. Older versions are not needed either if
+ * the file did not exist yet or has been created again since.
+ */
+static int
+restore_file_versions(parray *chain, parray **lists, const char *rel_path,
+					  pgFile **versions, pgBackup **backups)
+{
+	int		nversions = 0;
+	int		i;
+
+	for (i = parray_num(chain) - 1; i >= 0; i--)
+	{
+		pgBackup   *b = (pgBackup *) parray_get(chain, i);
+		pgFile		key;
+		pgFile	  **found;
+		char		path[MAXPGPATH];
+		char		root[MAXPGPATH];
+
+		pgBackupGetPath(b, root, lengthof(root), DATABASE_DIR);
+		join_path_components(path, root, rel_path);
+		key.path = path;
+		found = (pgFile **) parray_bsearch(lists[i], &key, pgFileComparePath);
+		if (found == NULL)
+			break;
+
+		/* not backed up, as not modified since the previous backup */
+		if ((*found)->write_size != BYTES_INVALID)
+		{
+			versions[nversions] = *found;
+			backups[nversions] = b;
+			nversions++;
+			if (!(*found)->is_datafile)
+				break;
+		}
+
+		if (b->backup_mode == BACKUP_MODE_FULL)
+			break;
 	}
+
+	return nversions;
+}
+
+/*
+ * Return the blocks to restore of the data file at rel_path with --rewind,
+ * version being its newest version, or NULL if the whole file has to be
+ * restored as its changes in $PGDATA are not all known. Those are the
+ * blocks changed in $PGDATA since the backup, and the blocks cut from it
+ * since then.
+ */
+static datapagemap_t *
+rewind_wanted_blocks(const char *rel_path, pgFile *version)
+{
+	pgFile		key;
+	pgFile	  **found;
+	char		path[MAXPGPATH];
+	BlockNumber	blknum;
+
+	join_path_components(path, pgdata, rel_path);
+	key.path = path;
+	found = (pgFile **) parray_bsearch(rewind_files, &key, pgFileComparePath);
+	if (found == NULL || !(*found)->pagemap_valid)
+		return NULL;
+
+	for (blknum = (BlockNumber) ((*found)->size / BLCKSZ);
+		 blknum < (BlockNumber) ((version->size + BLCKSZ - 1) / BLCKSZ);
+		 blknum++)
+		datapagemap_add(&(*found)->pagemap, blknum);
+
+	return &(*found)->pagemap;
+}
+
+/*
+ * Restore the regular files of the newest backup of chain into $PGDATA,
+ * with a pool of num_jobs workers. lists are the file lists of the backups.
+ *
+ * The workers pull the files from a queue sorted by size in descending
+ * order, the data files backed up by chunks being queued as one item per
+ * chunk when a single version of the file is needed. Items of different
+ * tablespaces are interleaved in the queue, so as the workers write to as
+ * many devices as possible at the same time instead of to one tablespace
+ * after the other.
+ */
+static void
+restore_files(parray *chain, parray **lists)
+{
+	parray			   *files = lists[parray_num(chain) - 1];
+	char				from_root[MAXPGPATH];
+	restore_files_args	args;
+	parray			   *items;
+	parray			   *tablespaces;	/* items of each tablespace */
+	pthread_t		   *workers;
+	int					njobs;
+	int					i;
+
+	pgBackupGetPath((pgBackup *) parray_get(chain, parray_num(chain) - 1),
+					from_root, lengthof(from_root), DATABASE_DIR);
+
+	args.nfiles = parray_num(files);
+	args.queue = parray_new();
+	args.next = 0;
+	pthread_mutex_init(&args.lock, NULL);
+
+	items = parray_new();
+	for (i = 0; i < parray_num(files); i++)
+	{
+		pgFile	   *file = (pgFile *) parray_get(files, i);
+		const char *rel_path = file->path + strlen(from_root) + 1;
+		pgFile	  **versions;
+		pgBackup  **backups;
+		int			nversions;
+		datapagemap_t *wanted;
+		size_t		size = 0;
+		int			j;
+
+		/* directories are made before the files */
+		if (S_ISDIR(file->mode))
+		{
+			if (!check)
+			{
+				elog(LOG, "(%d/%lu) %s ", i + 1, (unsigned long) parray_num(files),
+					rel_path);
+				elog(LOG, "directory, skip");
+			}
+			continue;
+		}
+
+		versions = pgut_newarray(pgFile *, parray_num(chain));
+		backups = pgut_newarray(pgBackup *, parray_num(chain));
+		nversions = restore_file_versions(chain, lists, rel_path, versions,
+										  backups);
+		wanted = NULL;
+		if (rewind_files != NULL && nversions > 0 && versions[0]->is_datafile)
+			wanted = rewind_wanted_blocks(rel_path, versions[0]);
+
+		if (nversions == 1 && versions[0]->is_datafile &&
+			versions[0]->nchunks > 1 && wanted == NULL)
+		{
+			pgFile *version = versions[0];
+			int	   *chunks_left = pgut_new(int);
+
+			/* the chunks are restored by separate workers */
+			if (restore_delta && !check)
+				restore_data_truncate(from_root, pgdata, version);
+
+			*chunks_left = version->nchunks;
+			for (j = 0; j < version->nchunks; j++)
+			{
+				int64	end = (j < version->nchunks - 1) ?
+					version->chunks[j + 1].offset : (int64) version->write_size;
+
+				restore_queue_item(items, rel_path, 1, versions, backups, i,
+								   j, chunks_left,
+								   (size_t) (end - version->chunks[j].offset),
+								   NULL);
+			}
+			continue;
+		}
+
+		/* nothing is read from the backups for a segment left as it is */
+		if (wanted == NULL || !datapagemap_is_empty(wanted))
+		{
+			for (j = 0; j < nversions; j++)
+				size += versions[j]->write_size;
+		}
+		restore_queue_item(items, rel_path, nversions, versions, backups, i,
+						   -1, NULL, size, wanted);
+	}
+
+	/* largest first, then taking in turn from each tablespace */
+	parray_qsort(items, restore_item_compare_size_desc);
+	tablespaces = parray_new();
+	for (i = 0; i < parray_num(items); i++)
+	{
+		RestoreItem *item = (RestoreItem *) parray_get(items, i);
+		parray	   *ts = NULL;
+		int			j;
+
+		for (j = 0; j < parray_num(tablespaces); j++)
+		{
+			parray *t = (parray *) parray_get(tablespaces, j);
+
+			if (strcmp(((RestoreItem *) parray_get(t, 0))->tablespace,
+					   item->tablespace) == 0)
+			{
+				ts = t;
+				break;
+			}
+		}
+		if (ts == NULL)
+		{
+			ts = parray_new();
+			parray_append(tablespaces, ts);
+		}
+		parray_append(ts, item);
+	}
+	for (i = 0; parray_num(args.queue) < parray_num(items); i++)
+	{
+		int		j;
+
+		for (j = 0; j < parray_num(tablespaces); j++)
+		{
+			parray *ts = (parray *) parray_get(tablespaces, j);
+
+			if (i < parray_num(ts))
+				parray_append(args.queue, parray_get(ts, i));
+		}
+	}
+	for (i = 0; i < parray_num(tablespaces); i++)
+		parray_free(parray_get(tablespaces, i));
+	parray_free(tablespaces);
+	parray_free(items);
+
+	/* nothing is written in check mode */
+	njobs = check ? 1 : num_jobs;
+	if (njobs > parray_num(args.queue))
+		njobs = parray_num(args.queue);
+
+	if (njobs <= 1)
+		restore_files_worker(&args);
+	else
+	{
+		elog(LOG, "starting %d restore workers", njobs);
+
+		workers = pgut_newarray(pthread_t, njobs);
+		for (i = 0; i < njobs; i++)
+		{
+			int		ret;
+
+			ret = pthread_create(&workers[i], NULL, restore_files_worker, &args);
+			if (ret != 0)
+				elog(ERROR, "cannot create restore worker: %s", strerror(ret));
+		}
+		for (i = 0; i < njobs; i++)
+			pthread_join(workers[i], NULL);
+		free(workers);
+	}
+
+	/* the error has been reported by the worker which failed */
+	if (worker_failed)
+		elog(ERROR, "restore worker failed");
+
+	for (i = 0; i < parray_num(args.queue); i++)
+	{
+		RestoreItem *item = (RestoreItem *) parray_get(args.queue, i);
+
+		if (item->chunkno <= 0)
+		{
+			free(item->chunks_left);
+			free(item->versions);
+			free(item->backups);
+		}
+		free(item);
+	}
+	pthread_mutex_destroy(&args.lock);
+	parray_free(args.queue);
+}
+
+/*
+ * Worker of restore_files(). Pull files and chunks from the shared queue
+ * until it is empty and restore them. The worker restoring the last chunk
+ * of a file finishes its restore.
+ */
+static void *
+restore_files_worker(void *arg)
+{
+	restore_files_args *args = (restore_files_args *) arg;
+
+	for (;;)
+	{
+		int			idx;
+		RestoreItem *item;
+		char		from_root[MAXPGPATH];
+		pgFile	   *file;
+		pgBackup   *backup;
+		size_t		size = 0;
+		bool		done = true;
+
+		/* stop if another thread failed */
+		if (worker_failed)
+			break;
+
+		pthread_mutex_lock(&args->lock);
+		idx = args->next++;
+		pthread_mutex_unlock(&args->lock);
+
+		if (idx >= parray_num(args->queue))
+			break;
+		item = (RestoreItem *) parray_get(args->queue, idx);
+
+		/* check for interrupt */
+		if (interrupted)
+			elog(ERROR, "interrupted during restore database");
+
+		/* print progress */
+		if (!check && item->chunkno <= 0)
+			elog(LOG, "(%d/%lu) %s ", item->index + 1,
+				 (unsigned long) args->nfiles, item->rel_path);
+
+		/* not backed up */
+		if (item->nversions == 0)
+		{
+			if (!check)
+				elog(LOG, "not backed up, skip");
+			continue;
+		}
+
+		if (check)
+			continue;
+
+		file = item->versions[0];
+		backup = item->backups[0];
+		pgBackupGetPath(backup, from_root, lengthof(from_root), DATABASE_DIR);
+
+		/* with --delta, compare the file left in $PGDATA with the backup */
+		if (restore_delta && item->chunkno < 0)
+		{
+			if (file->is_datafile)
+				restore_data_truncate(from_root, pgdata, file);
+			else if (restore_file_is_restored(from_root, pgdata, file))
+			{
+				elog(LOG, "unchanged, skip");
+				continue;
+			}
+		}
+
+		/* with --rewind, a segment not changed since the backup is kept */
+		if (item->wanted != NULL && datapagemap_is_empty(item->wanted))
+		{
+			elog(LOG, "unchanged, skip");
+			continue;
+		}
+
+		/* restore file, or chunk */
+		if (item->chunkno >= 0)
+		{
+			restore_data_chunk(from_root, pgdata, file, backup,
+							   item->chunkno);
+
+			pthread_mutex_lock(&args->lock);
+			done = (--(*item->chunks_left) == 0);
+			pthread_mutex_unlock(&args->lock);
+			if (done)
+				restore_data_chunks_end(from_root, pgdata, file);
+			size = file->write_size;
+		}
+		else if (item->nversions == 1 && item->wanted == NULL)
+		{
+			restore_data_file(from_root, pgdata, file, backup);
+			size = file->write_size;
+		}
+		else
+		{
+			datapagemap_t	written;
+			bool			pages = false;
+			int				i;
+
+			/*
+			 * Newest version first, each block being restored once. With
+			 * --rewind, only the blocks wanted are restored.
+			 */
+			datapagemap_init(&written);
+			for (i = 0; i < item->nversions; i++)
+			{
+				char	root[MAXPGPATH];
+
+				pgBackupGetPath(item->backups[i], root, lengthof(root),
+								DATABASE_DIR);
+				if (item->versions[i]->is_datafile)
+					pages = true;
+				size += item->versions[i]->write_size;
+				restore_data_file_merge(root, pgdata, item->versions[i],
+										item->backups[i], &written,
+										item->wanted);
+			}
+			datapagemap_free(&written);
+
+			if (pages)
+				restore_data_chunks_end(from_root, pgdata, file);
+		}
+
+		/* print size of restored file */
+		if (done)
+			elog(LOG, "restored %lu\n", (unsigned long) size);
+	}
+
+	return NULL;
 }
 
 static void
@@ -13,6 +13,22 @@ unset PGDATABASE
 unset BACKUP_MODE
 unset ARCLOG_PATH
 unset BACKUP_PATH
+unset JOBS
+unset IO_METHOD
+unset CACHE_POLICY
+unset SYNC_METHOD
+unset MAX_RATE
+unset MAX_IOPS
+unset MAX_LATENCY
+unset WAL_READ_METHOD
+unset MAX_READ_GAP
+unset BACKUP_FORMAT
+unset COMPRESS_ALGORITHM
+unset COMPRESS_LEVEL
+unset DEDUP
+unset CHUNK_SIZE
+unset DELTA
+unset REWIND
 unset SMOOTH_CHECKPOINT
 unset KEEP_DATA_GENERATIONS
 unset KEEP_DATA_DAYS
@@ -89,6 +89,52 @@ echo "BACKUP_MODE=ENV_PATH_A" > ${BACKUP_PATH}/conf_path_a/pg_arman.ini
 pg_arman backup -B ${BACKUP_PATH} -A ${ARCLOG_PATH} -p ${TEST_PGPORT};echo $?
 echo ''
 
+echo '###### COMMAND OPTION TEST-0014 ######'
+echo '###### backup command failure with chunk size below minimum ######'
+init_catalog
+pg_arman backup -B ${BACKUP_PATH} -A ${ARCLOG_PATH} -b full --chunk-size=-1 -p ${TEST_PGPORT};echo $?
+echo ''
+
+echo '###### COMMAND OPTION TEST-0015 ######'
+echo '###### backup command failure with --max-latency without --max-rate ######'
+pg_arman backup -B ${BACKUP_PATH} -A ${ARCLOG_PATH} -b full --max-latency=100 -p ${TEST_PGPORT};echo $?
+echo ''
+
+echo '###### COMMAND OPTION TEST-0016 ######'
+echo '###### backup command failure with negative --max-rate ######'
+pg_arman backup -B ${BACKUP_PATH} -A ${ARCLOG_PATH} -b full --max-rate=-1 -p ${TEST_PGPORT};echo $?
+echo ''
+
+echo '###### COMMAND OPTION TEST-0017 ######'
+echo '###### backup command failure with negative --max-iops ######'
+pg_arman backup -B ${BACKUP_PATH} -A ${ARCLOG_PATH} -b full --max-iops=-1 -p ${TEST_PGPORT};echo $?
+echo ''
+
+echo '###### COMMAND OPTION TEST-0018 ######'
+echo '###### backup command failure with negative --max-read-gap ######'
+pg_arman backup -B ${BACKUP_PATH} -A ${ARCLOG_PATH} -b full --max-read-gap=-1 -p ${TEST_PGPORT};echo $?
+echo ''
+
+echo '###### COMMAND OPTION TEST-0019 ######'
+echo '###### backup command failure with invalid io method ######'
+pg_arman backup -B ${BACKUP_PATH} -A ${ARCLOG_PATH} -b full --io-method=bad -p ${TEST_PGPORT};echo $?
+echo ''
+
+echo '###### COMMAND OPTION TEST-0020 ######'
+echo '###### backup command failure with invalid cache policy ######'
+pg_arman backup -B ${BACKUP_PATH} -A ${ARCLOG_PATH} -b full --cache-policy=bad -p ${TEST_PGPORT};echo $?
+echo ''
+
+echo '###### COMMAND OPTION TEST-0021 ######'
+echo '###### backup command failure with invalid sync method ######'
+pg_arman backup -B ${BACKUP_PATH} -A ${ARCLOG_PATH} -b full --sync-method=bad -p ${TEST_PGPORT};echo $?
+echo ''
+
+echo '###### COMMAND OPTION TEST-0022 ######'
+echo '###### backup command failure with invalid WAL read method ######'
+pg_arman backup -B ${BACKUP_PATH} -A ${ARCLOG_PATH} -b full --wal-read-method=bad -p ${TEST_PGPORT};echo $?
+echo ''
+
 # clean up the temporal test data
 pg_ctl stop -m immediate > /dev/null 2>&1
 rm -fr ${PGDATA_PATH}
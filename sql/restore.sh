@@ -156,13 +156,238 @@ psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT * FROM tbl0006;" > ${TE
 diff ${TEST_BASE}/TEST-0006-before.out ${TEST_BASE}/TEST-0006-after.out
 if grep "inserted" ${TEST_BASE}/TEST-0006-tbl.dump > /dev/null ; then
 	echo 'NG: recovery-target-inclusive=false does not work well.'
-else
-	echo 'OK: recovery-target-inclusive=false works well.'
 	pg_ctl stop -m immediate -D ${PGDATA_PATH} > /dev/null 2>&1
 	exit 1
+else
+	echo 'OK: recovery-target-inclusive=false works well.'
+fi
+echo ''
+
+echo '###### RESTORE COMMAND TEST-0007 ######'
+echo '###### recovery to latest from compressed full + page backups ######'
+init_backup
+pgbench_objs 0007
+pg_arman backup -B ${BACKUP_PATH} -b full --compress-algorithm=pglz -p ${TEST_PGPORT} -d postgres --verbose > ${TEST_BASE}/TEST-0007-run.out 2>&1;echo $?
+pg_arman validate -B ${BACKUP_PATH} --verbose >> ${TEST_BASE}/TEST-0007-run.out 2>&1
+pgbench -p ${TEST_PGPORT} -d pgbench > /dev/null 2>&1
+pg_arman backup -B ${BACKUP_PATH} -b page --compress-algorithm=pglz -p ${TEST_PGPORT} -d postgres --verbose >> ${TEST_BASE}/TEST-0007-run.out 2>&1;echo $?
+pg_arman validate -B ${BACKUP_PATH} --verbose >> ${TEST_BASE}/TEST-0007-run.out 2>&1
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT * FROM pgbench_branches;" > ${TEST_BASE}/TEST-0007-before.out
+pg_ctl stop -m immediate > /dev/null 2>&1
+pg_arman restore -B ${BACKUP_PATH} --verbose >> ${TEST_BASE}/TEST-0007-run.out 2>&1;echo $?
+pg_ctl start -w -t 600 > /dev/null 2>&1
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT * FROM pgbench_branches;" > ${TEST_BASE}/TEST-0007-after.out
+diff ${TEST_BASE}/TEST-0007-before.out ${TEST_BASE}/TEST-0007-after.out
+echo ''
+
+echo '###### RESTORE COMMAND TEST-0008 ######'
+echo '###### recovery to latest from full + page backups in containers ######'
+init_backup
+pgbench_objs 0008
+pg_arman backup -B ${BACKUP_PATH} -b full --backup-format=container -j 4 -p ${TEST_PGPORT} -d postgres --verbose > ${TEST_BASE}/TEST-0008-run.out 2>&1;echo $?
+pg_arman validate -B ${BACKUP_PATH} --verbose >> ${TEST_BASE}/TEST-0008-run.out 2>&1
+pgbench -p ${TEST_PGPORT} -d pgbench > /dev/null 2>&1
+pg_arman backup -B ${BACKUP_PATH} -b page --backup-format=container -j 4 -p ${TEST_PGPORT} -d postgres --verbose >> ${TEST_BASE}/TEST-0008-run.out 2>&1;echo $?
+pg_arman validate -B ${BACKUP_PATH} --verbose >> ${TEST_BASE}/TEST-0008-run.out 2>&1
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT * FROM pgbench_branches;" > ${TEST_BASE}/TEST-0008-before.out
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT count(*), md5(string_agg(aid::text || ':' || abalance, ',' ORDER BY aid)) FROM pgbench_accounts;" >> ${TEST_BASE}/TEST-0008-before.out
+pg_ctl stop -m immediate > /dev/null 2>&1
+pg_arman restore -B ${BACKUP_PATH} -j 4 --verbose >> ${TEST_BASE}/TEST-0008-run.out 2>&1;echo $?
+pg_ctl start -w -t 600 > /dev/null 2>&1
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT * FROM pgbench_branches;" > ${TEST_BASE}/TEST-0008-after.out
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT count(*), md5(string_agg(aid::text || ':' || abalance, ',' ORDER BY aid)) FROM pgbench_accounts;" >> ${TEST_BASE}/TEST-0008-after.out
+diff ${TEST_BASE}/TEST-0008-before.out ${TEST_BASE}/TEST-0008-after.out
+echo ''
+
+echo '###### RESTORE COMMAND TEST-0009 ######'
+echo '###### recovery to latest from deduplicated full + full + page backups ######'
+init_backup
+pgbench_objs 0009
+pg_arman backup -B ${BACKUP_PATH} -b full --dedup -p ${TEST_PGPORT} -d postgres --verbose > ${TEST_BASE}/TEST-0009-run.out 2>&1;echo $?
+pg_arman validate -B ${BACKUP_PATH} --verbose >> ${TEST_BASE}/TEST-0009-run.out 2>&1
+pgbench -p ${TEST_PGPORT} -d pgbench > /dev/null 2>&1
+pg_arman backup -B ${BACKUP_PATH} -b full --dedup -p ${TEST_PGPORT} -d postgres --verbose >> ${TEST_BASE}/TEST-0009-run.out 2>&1;echo $?
+pg_arman validate -B ${BACKUP_PATH} --verbose >> ${TEST_BASE}/TEST-0009-run.out 2>&1
+pgbench -p ${TEST_PGPORT} -d pgbench > /dev/null 2>&1
+pg_arman backup -B ${BACKUP_PATH} -b page --dedup -p ${TEST_PGPORT} -d postgres --verbose >> ${TEST_BASE}/TEST-0009-run.out 2>&1;echo $?
+pg_arman validate -B ${BACKUP_PATH} --verbose >> ${TEST_BASE}/TEST-0009-run.out 2>&1
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT * FROM pgbench_branches;" > ${TEST_BASE}/TEST-0009-before.out
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT count(*), md5(string_agg(aid::text || ':' || abalance, ',' ORDER BY aid)) FROM pgbench_accounts;" >> ${TEST_BASE}/TEST-0009-before.out
+pg_ctl stop -m immediate > /dev/null 2>&1
+pg_arman restore -B ${BACKUP_PATH} -j 4 --verbose >> ${TEST_BASE}/TEST-0009-run.out 2>&1;echo $?
+pg_ctl start -w -t 600 > /dev/null 2>&1
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT * FROM pgbench_branches;" > ${TEST_BASE}/TEST-0009-after.out
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT count(*), md5(string_agg(aid::text || ':' || abalance, ',' ORDER BY aid)) FROM pgbench_accounts;" >> ${TEST_BASE}/TEST-0009-after.out
+diff ${TEST_BASE}/TEST-0009-before.out ${TEST_BASE}/TEST-0009-after.out
+echo ''
+
+echo '###### RESTORE COMMAND TEST-0010 ######'
+echo '###### delta recovery to latest from full + page backups ######'
+init_backup
+pgbench_objs 0010
+pg_arman backup -B ${BACKUP_PATH} -b full -p ${TEST_PGPORT} -d postgres --verbose > ${TEST_BASE}/TEST-0010-run.out 2>&1;echo $?
+pg_arman validate -B ${BACKUP_PATH} --verbose >> ${TEST_BASE}/TEST-0010-run.out 2>&1
+pgbench -p ${TEST_PGPORT} -d pgbench > /dev/null 2>&1
+pg_arman backup -B ${BACKUP_PATH} -b page -p ${TEST_PGPORT} -d postgres --verbose >> ${TEST_BASE}/TEST-0010-run.out 2>&1;echo $?
+pg_arman validate -B ${BACKUP_PATH} --verbose >> ${TEST_BASE}/TEST-0010-run.out 2>&1
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT * FROM pgbench_branches;" > ${TEST_BASE}/TEST-0010-before.out
+pg_ctl stop -m immediate > /dev/null 2>&1
+pg_arman restore -B ${BACKUP_PATH} --delta --verbose >> ${TEST_BASE}/TEST-0010-run.out 2>&1;echo $?
+pg_ctl start -w -t 600 > /dev/null 2>&1
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT * FROM pgbench_branches;" > ${TEST_BASE}/TEST-0010-after.out
+diff ${TEST_BASE}/TEST-0010-before.out ${TEST_BASE}/TEST-0010-after.out
+if grep "LOG: unchanged, skip" ${TEST_BASE}/TEST-0010-run.out > /dev/null &&
+	grep "pages unchanged, skip" ${TEST_BASE}/TEST-0010-run.out > /dev/null ; then
+	echo 'OK: files and pages left unchanged are not restored again.'
+else
+	echo 'NG: delta restore rewrote all the files and pages.'
 fi
 echo ''
 
+echo '###### RESTORE COMMAND TEST-0011 ######'
+echo '###### rewinding recovery to latest from full backup ######'
+init_backup
+pgbench_objs 0011
+pg_arman backup -B ${BACKUP_PATH} -b full -p ${TEST_PGPORT} -d postgres --verbose > ${TEST_BASE}/TEST-0011-run.out 2>&1;echo $?
+pg_arman validate -B ${BACKUP_PATH} --verbose >> ${TEST_BASE}/TEST-0011-run.out 2>&1
+pgbench -p ${TEST_PGPORT} -d pgbench > /dev/null 2>&1
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT * FROM pgbench_branches;" > ${TEST_BASE}/TEST-0011-before.out
+pg_ctl stop -m immediate > /dev/null 2>&1
+pg_arman restore -B ${BACKUP_PATH} --rewind --verbose >> ${TEST_BASE}/TEST-0011-run.out 2>&1;echo $?
+pg_ctl start -w -t 600 > /dev/null 2>&1
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT * FROM pgbench_branches;" > ${TEST_BASE}/TEST-0011-after.out
+diff ${TEST_BASE}/TEST-0011-before.out ${TEST_BASE}/TEST-0011-after.out
+if grep "cannot rewind" ${TEST_BASE}/TEST-0011-run.out > /dev/null ; then
+	echo 'NG: $PGDATA is not rewound from its WAL.'
+elif grep "restored from the blocks changed in WAL" ${TEST_BASE}/TEST-0011-run.out > /dev/null ; then
+	echo 'OK: $PGDATA is rewound from its WAL.'
+else
+	echo 'NG: the WAL of $PGDATA is not read.'
+fi
+echo ''
+
+echo '###### RESTORE COMMAND TEST-0012 ######'
+echo '###### recovery to latest from deduplicated full backup after deletion ######'
+init_backup
+pgbench_objs 0012
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "CREATE TABLE dedup_garbage AS SELECT i, md5(i::text) AS v FROM generate_series(1, 1000000) i;" > /dev/null 2>&1
+pg_arman backup -B ${BACKUP_PATH} -b full --dedup -p ${TEST_PGPORT} -d postgres --verbose > ${TEST_BASE}/TEST-0012-run.out 2>&1;echo $?
+pg_arman validate -B ${BACKUP_PATH} --verbose >> ${TEST_BASE}/TEST-0012-run.out 2>&1
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "DROP TABLE dedup_garbage;" > /dev/null 2>&1
+pgbench -p ${TEST_PGPORT} -d pgbench > /dev/null 2>&1
+pg_arman backup -B ${BACKUP_PATH} -b full --dedup -p ${TEST_PGPORT} -d postgres --verbose >> ${TEST_BASE}/TEST-0012-run.out 2>&1;echo $?
+pg_arman validate -B ${BACKUP_PATH} --verbose >> ${TEST_BASE}/TEST-0012-run.out 2>&1
+SECOND_BACKUP_DATE=`date +"%Y-%m-%d %H:%M:%S"`
+PACKS_BEFORE=`cat ${BACKUP_PATH}/dedup/pack.* | wc -c`
+pg_arman delete -B ${BACKUP_PATH} --verbose ${SECOND_BACKUP_DATE} >> ${TEST_BASE}/TEST-0012-run.out 2>&1;echo $?
+PACKS_AFTER=`cat ${BACKUP_PATH}/dedup/pack.* | wc -c`
+if [ ${PACKS_AFTER} -lt ${PACKS_BEFORE} ]; then
+	echo "OK: the pages of the deleted backup are removed from the dedup store."
+else
+	echo "NG: the dedup store did not shrink, ${PACKS_BEFORE} bytes before and ${PACKS_AFTER} bytes after."
+fi
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT * FROM pgbench_branches;" > ${TEST_BASE}/TEST-0012-before.out
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT count(*), md5(string_agg(aid::text || ':' || abalance, ',' ORDER BY aid)) FROM pgbench_accounts;" >> ${TEST_BASE}/TEST-0012-before.out
+pg_ctl stop -m immediate > /dev/null 2>&1
+pg_arman restore -B ${BACKUP_PATH} -j 4 --verbose >> ${TEST_BASE}/TEST-0012-run.out 2>&1;echo $?
+pg_ctl start -w -t 600 > /dev/null 2>&1
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT * FROM pgbench_branches;" > ${TEST_BASE}/TEST-0012-after.out
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT count(*), md5(string_agg(aid::text || ':' || abalance, ',' ORDER BY aid)) FROM pgbench_accounts;" >> ${TEST_BASE}/TEST-0012-after.out
+diff ${TEST_BASE}/TEST-0012-before.out ${TEST_BASE}/TEST-0012-after.out
+echo ''
+
+echo '###### RESTORE COMMAND TEST-0013 ######'
+echo '###### recovery to latest from full + page backups changing over 4096 blocks of a relation ######'
+init_backup
+pgbench_objs 0013
+# 500000 rows at fillfactor 50 fill about 8000 blocks, all in the first
+# 65536-block container of the page map
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "CREATE TABLE tbl0013 (i int, v text) WITH (fillfactor = 50); INSERT INTO tbl0013 SELECT i, md5(i::text) FROM generate_series(1, 500000) i;" > /dev/null 2>&1
+pg_arman backup -B ${BACKUP_PATH} -b full -p ${TEST_PGPORT} -d postgres --verbose > ${TEST_BASE}/TEST-0013-run.out 2>&1;echo $?
+pg_arman validate -B ${BACKUP_PATH} --verbose >> ${TEST_BASE}/TEST-0013-run.out 2>&1
+# every block is changed, so the page map of the table turns into a bitset
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "UPDATE tbl0013 SET v = md5(v);" > /dev/null 2>&1
+pg_arman backup -B ${BACKUP_PATH} -b page -p ${TEST_PGPORT} -d postgres --verbose >> ${TEST_BASE}/TEST-0013-run.out 2>&1;echo $?
+pg_arman validate -B ${BACKUP_PATH} --verbose >> ${TEST_BASE}/TEST-0013-run.out 2>&1
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT count(*), md5(string_agg(v, ',' ORDER BY i)) FROM tbl0013;" > ${TEST_BASE}/TEST-0013-before.out
+pg_ctl stop -m immediate > /dev/null 2>&1
+pg_arman restore -B ${BACKUP_PATH} --verbose >> ${TEST_BASE}/TEST-0013-run.out 2>&1;echo $?
+pg_ctl start -w -t 600 > /dev/null 2>&1
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT count(*), md5(string_agg(v, ',' ORDER BY i)) FROM tbl0013;" > ${TEST_BASE}/TEST-0013-after.out
+diff ${TEST_BASE}/TEST-0013-before.out ${TEST_BASE}/TEST-0013-after.out
+echo ''
+
+echo '###### RESTORE COMMAND TEST-0014 ######'
+echo '###### recovery to latest from full + page backups split into chunks ######'
+init_backup
+pgbench_objs 0014
+pg_arman backup -B ${BACKUP_PATH} -b full --chunk-size=1 -j 4 -p ${TEST_PGPORT} -d postgres --verbose > ${TEST_BASE}/TEST-0014-run.out 2>&1;echo $?
+pg_arman validate -B ${BACKUP_PATH} --verbose >> ${TEST_BASE}/TEST-0014-run.out 2>&1
+pgbench -p ${TEST_PGPORT} -d pgbench > /dev/null 2>&1
+pg_arman backup -B ${BACKUP_PATH} -b page --chunk-size=1 -j 4 -p ${TEST_PGPORT} -d postgres --verbose >> ${TEST_BASE}/TEST-0014-run.out 2>&1;echo $?
+pg_arman validate -B ${BACKUP_PATH} --verbose >> ${TEST_BASE}/TEST-0014-run.out 2>&1
+# pgbench_accounts is about 26MB at this scale
+if grep "split into" ${TEST_BASE}/TEST-0014-run.out > /dev/null ; then
+	echo 'OK: data files are backed up by chunks.'
+else
+	echo 'NG: no data file is backed up by chunks.'
+fi
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT count(*), md5(string_agg(aid::text || ':' || abalance, ',' ORDER BY aid)) FROM pgbench_accounts;" > ${TEST_BASE}/TEST-0014-before.out
+pg_ctl stop -m immediate > /dev/null 2>&1
+pg_arman restore -B ${BACKUP_PATH} -j 4 --verbose >> ${TEST_BASE}/TEST-0014-run.out 2>&1;echo $?
+pg_ctl start -w -t 600 > /dev/null 2>&1
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT count(*), md5(string_agg(aid::text || ':' || abalance, ',' ORDER BY aid)) FROM pgbench_accounts;" > ${TEST_BASE}/TEST-0014-after.out
+diff ${TEST_BASE}/TEST-0014-before.out ${TEST_BASE}/TEST-0014-after.out
+echo ''
+
+echo '###### RESTORE COMMAND TEST-0015 ######'
+echo '###### recovery to latest from full + page backups with throttled direct I/O ######'
+init_backup
+pgbench_objs 0015
+# io_uring is used only if this build supports it
+IO_OPTS="--cache-policy=direct --max-rate=67108864 --max-iops=10000 --max-latency=100"
+if pg_arman show -B ${BACKUP_PATH} --io-method=io_uring > /dev/null 2>&1 ; then
+	IO_OPTS="${IO_OPTS} --io-method=io_uring"
+fi
+pg_arman backup -B ${BACKUP_PATH} -b full ${IO_OPTS} --sync-method=writeback -j 4 -p ${TEST_PGPORT} -d postgres --verbose > ${TEST_BASE}/TEST-0015-run.out 2>&1;echo $?
+pg_arman validate -B ${BACKUP_PATH} ${IO_OPTS} --verbose >> ${TEST_BASE}/TEST-0015-run.out 2>&1
+pgbench -p ${TEST_PGPORT} -d pgbench > /dev/null 2>&1
+pg_arman backup -B ${BACKUP_PATH} -b page ${IO_OPTS} --sync-method=writeback --wal-read-method=page --max-read-gap=0 -j 4 -p ${TEST_PGPORT} -d postgres --verbose >> ${TEST_BASE}/TEST-0015-run.out 2>&1;echo $?
+pg_arman validate -B ${BACKUP_PATH} ${IO_OPTS} --verbose >> ${TEST_BASE}/TEST-0015-run.out 2>&1
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT * FROM pgbench_branches;" > ${TEST_BASE}/TEST-0015-before.out
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT count(*), md5(string_agg(aid::text || ':' || abalance, ',' ORDER BY aid)) FROM pgbench_accounts;" >> ${TEST_BASE}/TEST-0015-before.out
+pg_ctl stop -m immediate > /dev/null 2>&1
+pg_arman restore -B ${BACKUP_PATH} ${IO_OPTS} --sync-method=syncfs -j 4 --verbose >> ${TEST_BASE}/TEST-0015-run.out 2>&1;echo $?
+pg_ctl start -w -t 600 > /dev/null 2>&1
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT * FROM pgbench_branches;" > ${TEST_BASE}/TEST-0015-after.out
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT count(*), md5(string_agg(aid::text || ':' || abalance, ',' ORDER BY aid)) FROM pgbench_accounts;" >> ${TEST_BASE}/TEST-0015-after.out
+diff ${TEST_BASE}/TEST-0015-before.out ${TEST_BASE}/TEST-0015-after.out
+echo ''
+
+echo '###### RESTORE COMMAND TEST-0016 ######'
+echo '###### recovery to latest from full backup with a tablespace path holding a space ######'
+init_backup
+mkdir -p "${TBLSPC_PATH}/tblspc 0016"
+psql --no-psqlrc -p ${TEST_PGPORT} -d postgres > /dev/null 2>&1 <<EOF
+CREATE TABLESPACE tblspc0016 LOCATION '${TBLSPC_PATH}/tblspc 0016';
+CREATE TABLE tbl0016 TABLESPACE tblspc0016 AS SELECT i, md5(i::text) AS v FROM generate_series(1, 10000) i;
+EOF
+TBLSPC_OID=`psql --no-psqlrc -p ${TEST_PGPORT} -d postgres -tAq -c "SELECT oid FROM pg_tablespace WHERE spcname = 'tblspc0016';"`
+pg_arman backup -B ${BACKUP_PATH} -b full -p ${TEST_PGPORT} -d postgres --verbose > ${TEST_BASE}/TEST-0016-run.out 2>&1;echo $?
+pg_arman validate -B ${BACKUP_PATH} --verbose >> ${TEST_BASE}/TEST-0016-run.out 2>&1
+psql --no-psqlrc -p ${TEST_PGPORT} -d postgres -c "SELECT count(*), md5(string_agg(v, ',' ORDER BY i)) FROM tbl0016;" > ${TEST_BASE}/TEST-0016-before.out
+pg_ctl stop -m immediate > /dev/null 2>&1
+pg_arman restore -B ${BACKUP_PATH} --verbose >> ${TEST_BASE}/TEST-0016-run.out 2>&1;echo $?
+if [ "`readlink ${PGDATA_PATH}/pg_tblspc/${TBLSPC_OID}`" = "${TBLSPC_PATH}/tblspc 0016" ]; then
+	echo 'OK: the link to the tablespace is restored.'
+else
+	echo 'NG: the link to the tablespace is not restored.'
+fi
+pg_ctl start -w -t 600 > /dev/null 2>&1
+psql --no-psqlrc -p ${TEST_PGPORT} -d postgres -c "SELECT count(*), md5(string_agg(v, ',' ORDER BY i)) FROM tbl0016;" > ${TEST_BASE}/TEST-0016-after.out
+diff ${TEST_BASE}/TEST-0016-before.out ${TEST_BASE}/TEST-0016-after.out
+echo ''
+
 # clean up the temporal test data
 pg_ctl stop -m immediate > /dev/null 2>&1
 rm -fr ${PGDATA_PATH}
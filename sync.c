@@ -0,0 +1,333 @@
+/*-------------------------------------------------------------------------
+ *
+ * sync.c: durability of the files written by backup and restore
+ *
+ * A backup marked as done or a restored data directory must not lose any
+ * file if the system crashes just after. Syncing each file right after
+ * writing it would leave the disk idle while the workers wait, so the
+ * files are handed over once written and synced according to
+ * --sync-method:
+ *
+ * - "fsync": a background thread runs fdatasync() on each file, in the
+ *   order they have been written, while the workers go on.
+ * - "writeback": the writeback of each file is started at once with
+ *   sync_file_range(), and the files are synced at the end, which costs
+ *   little as their pages are mostly written by then.
+ * - "syncfs": nothing is done until the end, where the file systems
+ *   holding the files are synced at once with syncfs().
+ * - "none": nothing is synced.
+ *
+ * In every mode but "none", the directories are synced at the end, and
+ * sync_finish() reports the time spent.
+ *
+ * Copyright (c) 2009-2013, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_arman.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* files handed over, and their syncing in the background */
+static parray	   *sync_files = NULL;		/* paths, freed once synced */
+static size_t		sync_next = 0;			/* next file to sync */
+static bool			sync_started = false;
+static bool			sync_done = false;		/* no file will be added */
+static pthread_t	sync_thread;
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_cond = PTHREAD_COND_INITIALIZER;
+
+/* cost of the syncs, reported at the end */
+static int			sync_nfiles = 0;
+static double		sync_file_seconds = 0;	/* spent by fdatasync() */
+
+static double
+now_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1000000000.0;
+}
+
+/*
+ * Flush the file or directory at path to disk, with fdatasync() for a file.
+ */
+static void
+sync_path(const char *path, bool isdir)
+{
+	int			fd;
+
+	fd = open(path, (isdir ? O_RDONLY : O_RDWR) | PG_BINARY, 0);
+	/* a file not writable by us may still be synced opened read-only */
+	if (fd == -1 && errno == EACCES && !isdir)
+		fd = open(path, O_RDONLY | PG_BINARY, 0);
+	if (fd == -1)
+		elog(ERROR, "cannot open \"%s\" to sync it: %s", path,
+			 strerror(errno));
+
+	if ((isdir ? fsync(fd) : fdatasync(fd)) != 0)
+	{
+		/* some systems cannot sync directories, see fsync_fname() */
+		if (!isdir || (errno != EBADF && errno != EINVAL))
+			elog(ERROR, "cannot sync \"%s\": %s", path, strerror(errno));
+	}
+
+	close(fd);
+}
+
+/*
+ * Sync the files handed over from sync_next, and free their paths. In the
+ * background thread, wait for more files until sync_finish() is called.
+ */
+static void
+sync_pending_files(bool wait)
+{
+	pthread_mutex_lock(&sync_lock);
+	for (;;)
+	{
+		char	   *path;
+		double		start;
+
+		while (sync_next >= parray_num(sync_files) && wait && !sync_done)
+			pthread_cond_wait(&sync_cond, &sync_lock);
+		if (sync_next >= parray_num(sync_files))
+			break;
+
+		path = (char *) parray_get(sync_files, sync_next);
+		parray_set(sync_files, sync_next, NULL);
+		sync_next++;
+		pthread_mutex_unlock(&sync_lock);
+
+		start = now_seconds();
+		sync_path(path, false);
+		free(path);
+
+		pthread_mutex_lock(&sync_lock);
+		sync_file_seconds += now_seconds() - start;
+	}
+	pthread_mutex_unlock(&sync_lock);
+}
+
+static void *
+sync_thread_main(void *arg)
+{
+	sync_pending_files(true);
+	return NULL;
+}
+
+/*
+ * Start accepting files to sync, in the background with "fsync".
+ */
+void
+sync_start(void)
+{
+	if (sync_method == SYNC_METHOD_NONE || check)
+		return;
+
+	sync_files = parray_new();
+	sync_next = 0;
+	sync_done = false;
+	sync_nfiles = 0;
+	sync_file_seconds = 0;
+	sync_started = true;
+
+	if (sync_method == SYNC_METHOD_FSYNC)
+	{
+		int			errnum;
+
+		errnum = pthread_create(&sync_thread, NULL, sync_thread_main, NULL);
+		if (errnum != 0)
+			elog(ERROR, "cannot create sync thread: %s", strerror(errnum));
+	}
+}
+
+/*
+ * Hand over a file completely written and closed, to be synced before
+ * sync_finish() returns. Called by the workers.
+ */
+void
+sync_file(const char *path)
+{
+	char	   *copy;
+
+	if (!sync_started || sync_method == SYNC_METHOD_SYNCFS)
+		return;
+
+#ifdef HAVE_SYNC_FILE_RANGE
+	if (sync_method == SYNC_METHOD_WRITEBACK)
+	{
+		int			fd = open(path, O_RDONLY | PG_BINARY, 0);
+
+		/* only a hint, errors are seen when the file is synced */
+		if (fd != -1)
+		{
+			(void) sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+			close(fd);
+		}
+	}
+#endif
+
+	copy = pgut_strdup(path);
+	pthread_mutex_lock(&sync_lock);
+	pthread_cleanup_push(pgut_mutex_unlock, &sync_lock);
+	parray_append(sync_files, copy);
+	sync_nfiles++;
+	pthread_cond_signal(&sync_cond);
+	pthread_cleanup_pop(1);
+}
+
+/*
+ * Sync the directories of the tree at path, following symbolic links like
+ * those of tablespaces. With "syncfs", sync instead the file systems of the
+ * tree, being that of path and those reached through symbolic links.
+ */
+static void
+sync_dir_tree(const char *path, bool is_root)
+{
+	DIR		   *dir;
+	struct dirent *de;
+
+	if (sync_method == SYNC_METHOD_SYNCFS)
+	{
+#ifdef __linux__
+		if (is_root)
+		{
+			int			fd = open(path, O_RDONLY | PG_BINARY, 0);
+
+			if (fd == -1 || syncfs(fd) != 0)
+				elog(ERROR, "cannot sync file system of \"%s\": %s", path,
+					 strerror(errno));
+			close(fd);
+		}
+#endif
+	}
+	else
+		sync_path(path, true);
+
+	dir = opendir(path);
+	if (dir == NULL)
+		elog(ERROR, "cannot open directory \"%s\": %s", path, strerror(errno));
+
+	while ((de = readdir(dir)) != NULL)
+	{
+		char		child[MAXPGPATH];
+		struct stat	st;
+		bool		is_link;
+
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+
+		join_path_components(child, path, de->d_name);
+		if (lstat(child, &st) == -1)
+			continue;		/* removed meanwhile */
+		is_link = S_ISLNK(st.st_mode);
+		if (is_link && stat(child, &st) == -1)
+			continue;		/* dangling link */
+
+		if (S_ISDIR(st.st_mode))
+			sync_dir_tree(child, is_link);
+	}
+
+	closedir(dir);
+}
+
+/*
+ * Wait for the files handed over to be synced, then sync the directories
+ * of the tree at root, and its parents up to top, or only its parent if
+ * top is NULL. Report the cost of the syncs.
+ */
+void
+sync_finish(const char *root, const char *top)
+{
+	char		parent[MAXPGPATH];
+	double		start;
+	size_t		i;
+
+	if (!sync_started)
+		return;
+
+	start = now_seconds();
+
+	if (sync_method == SYNC_METHOD_FSYNC)
+	{
+		pthread_mutex_lock(&sync_lock);
+		sync_done = true;
+		pthread_cond_signal(&sync_cond);
+		pthread_mutex_unlock(&sync_lock);
+		pthread_join(sync_thread, NULL);
+
+		/* the error has been reported by the sync thread */
+		if (worker_failed)
+			elog(ERROR, "sync thread failed");
+	}
+	else
+		sync_pending_files(false);
+
+	sync_dir_tree(root, true);
+	if (sync_method != SYNC_METHOD_SYNCFS)
+	{
+		strlcpy(parent, root, MAXPGPATH);
+		for (;;)
+		{
+			get_parent_directory(parent);
+			if (parent[0] == '\0')
+				break;
+			sync_path(parent, true);
+			if (top == NULL || strcmp(parent, top) == 0)
+				break;
+		}
+	}
+
+	elog(LOG, "sync (%s): %d files synced in %.3f s, %.3f s waited at the end",
+		 sync_method == SYNC_METHOD_FSYNC ? "fsync" :
+		 sync_method == SYNC_METHOD_WRITEBACK ? "writeback" : "syncfs",
+		 sync_nfiles, sync_file_seconds, now_seconds() - start);
+
+	for (i = 0; i < parray_num(sync_files); i++)
+		free(parray_get(sync_files, i));
+	parray_free(sync_files);
+	sync_files = NULL;
+	sync_started = false;
+}
+
+/*
+ * Replace newpath by the file oldpath durably: once this returns, newpath
+ * is either its old or its new content after a crash, never a partially
+ * written one.
+ */
+void
+durable_rename(const char *oldpath, const char *newpath)
+{
+	char		parent[MAXPGPATH];
+
+	if (sync_method != SYNC_METHOD_NONE)
+		sync_path(oldpath, false);
+
+	if (rename(oldpath, newpath) == -1)
+		elog(ERROR, "cannot rename \"%s\" to \"%s\": %s",
+			 oldpath, newpath, strerror(errno));
+
+	if (sync_method != SYNC_METHOD_NONE)
+	{
+		strlcpy(parent, newpath, MAXPGPATH);
+		get_parent_directory(parent);
+		sync_path(parent, true);
+	}
+}
+
+/*
+ * Sync at once a file written outside of sync_start() and sync_finish().
+ */
+void
+sync_file_now(const char *path)
+{
+	if (sync_method != SYNC_METHOD_NONE)
+		sync_path(path, false);
+}
@@ -0,0 +1,328 @@
+/*-------------------------------------------------------------------------
+ *
+ * throttle.c: rate limiting of the I/O on data directories
+ *
+ * A backup, a restore or a validation may use all the bandwidth of the
+ * disks it works on, at the expense of the queries of a server using the
+ * same disks. --max-rate and --max-iops cap the bytes and the number of I/O
+ * per second of all the workers together. Each limit is a token bucket
+ * filled at the given rate and holding at most THROTTLE_BURST_MSEC worth
+ * of tokens, so that an idle period does not allow a long burst after it.
+ * An I/O takes its tokens before being done, running the bucket into debt
+ * if needed, and its worker then sleeps until the debt has been paid back.
+ *
+ * With --max-latency, the rate in bytes is adapted during a backup by a
+ * sampler thread following the latency of the server, probed every
+ * ADAPT_INTERVAL_MSEC: it is halved each time the latency is above the
+ * limit, and raised by a fraction of --max-rate when it is not (AIMD).
+ *
+ * Copyright (c) 2009-2013, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_arman.h"
+
+#include <pthread.h>
+#include <time.h>
+
+#include "libpq-fe.h"
+
+/* largest burst allowed by a bucket, in milliseconds of its rate */
+#define THROTTLE_BURST_MSEC	100
+
+/* interval between two probes of the server latency */
+#define ADAPT_INTERVAL_MSEC	2000
+
+/* an adapted rate goes up by max_rate / ADAPT_STEPS, and not below this */
+#define ADAPT_STEPS			16
+#define ADAPT_MIN_RATE		(1024 * 1024)
+
+/* query probing the latency, also giving the block reads of the server */
+#define ADAPT_PROBE_QUERY \
+	"SELECT sum(blks_read), sum(blk_read_time) FROM pg_catalog.pg_stat_database"
+
+typedef struct TokenBucket
+{
+	double		rate;		/* tokens added per second, 0 if no limit */
+	double		capacity;	/* largest number of tokens held */
+	double		tokens;		/* tokens available, negative if in debt */
+} TokenBucket;
+
+static pthread_mutex_t throttle_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool			throttle_started = false;
+static TokenBucket	bytes_bucket;
+static TokenBucket	ios_bucket;
+static double		last_refill;
+
+/* sampler thread adapting the rate */
+static pthread_mutex_t adapt_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t adapt_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t	adapt_thread;
+static PGconn	   *adapt_conn = NULL;
+static bool			adapt_stop = false;
+
+/* accounting of the current second, reported in the log */
+static double		window_start;
+static int64		window_bytes;
+static int64		window_ios;
+static double		window_wait;
+
+static double
+now_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1000000000.0;
+}
+
+static void
+bucket_init(TokenBucket *bucket, double rate)
+{
+	bucket->rate = rate;
+	bucket->capacity = rate * THROTTLE_BURST_MSEC / 1000.0;
+	bucket->tokens = bucket->capacity;
+}
+
+/*
+ * Fill the buckets with the limits. Called under throttle_lock by the first
+ * user of the buckets.
+ */
+static void
+throttle_start(double now)
+{
+	bucket_init(&bytes_bucket, (double) Max(max_rate, 0));
+	bucket_init(&ios_bucket, (double) Max(max_iops, 0));
+	last_refill = now;
+	window_start = now;
+	throttle_started = true;
+}
+
+/*
+ * Refill the bucket for elapsed seconds and take amount tokens from it.
+ * Return the number of seconds to wait for its debt to be paid back.
+ */
+static double
+bucket_take(TokenBucket *bucket, double amount, double elapsed)
+{
+	if (bucket->rate <= 0)
+		return 0;
+
+	bucket->tokens = Min(bucket->capacity, bucket->tokens + elapsed * bucket->rate);
+	bucket->tokens -= amount;
+
+	return bucket->tokens < 0 ? -bucket->tokens / bucket->rate : 0;
+}
+
+/*
+ * Charge nios I/O transferring bytes bytes to the limits, sleeping as long
+ * as needed to stay under them. Called by the workers before doing the I/O.
+ */
+void
+throttle_io(int64 bytes, int nios)
+{
+	double		now;
+	double		wait;
+	double		elapsed = 0;
+	int64		report_bytes = 0;
+	int64		report_ios = 0;
+	double		report_wait = 0;
+
+	if (max_rate <= 0 && max_iops <= 0)
+		return;
+
+	pthread_mutex_lock(&throttle_lock);
+
+	now = now_seconds();
+	if (!throttle_started)
+		throttle_start(now);
+
+	wait = Max(bucket_take(&bytes_bucket, (double) bytes, now - last_refill),
+			   bucket_take(&ios_bucket, (double) nios, now - last_refill));
+	last_refill = now;
+
+	window_bytes += bytes;
+	window_ios += nios;
+	window_wait += wait;
+	if (now - window_start >= 1.0)
+	{
+		elapsed = now - window_start;
+		report_bytes = window_bytes;
+		report_ios = window_ios;
+		report_wait = window_wait;
+		window_start = now;
+		window_bytes = 0;
+		window_ios = 0;
+		window_wait = 0;
+	}
+
+	pthread_mutex_unlock(&throttle_lock);
+
+	if (elapsed > 0)
+		elog(LOG, "throttle: %.0f kB/s, %.0f IOPS, workers waited %.0f ms per second",
+			 report_bytes / elapsed / 1024, report_ios / elapsed,
+			 report_wait * 1000 / elapsed);
+
+	if (wait > 0)
+		pg_usleep((long) (wait * 1000000));
+}
+
+/*
+ * Change the rate in bytes of the limit, keeping the tokens of the bucket.
+ */
+static void
+throttle_set_rate(double rate)
+{
+	double		now;
+
+	pthread_mutex_lock(&throttle_lock);
+
+	now = now_seconds();
+	if (!throttle_started)
+		throttle_start(now);
+
+	/* the tokens earned at the old rate are kept */
+	(void) bucket_take(&bytes_bucket, 0, now - last_refill);
+	last_refill = now;
+
+	bytes_bucket.rate = rate;
+	bytes_bucket.capacity = rate * THROTTLE_BURST_MSEC / 1000.0;
+	bytes_bucket.tokens = Min(bytes_bucket.tokens, bytes_bucket.capacity);
+
+	pthread_mutex_unlock(&throttle_lock);
+}
+
+/*
+ * Probe the latency of the server, in milliseconds. This is the time taken
+ * by the probe query or, if larger, the average time taken by the server to
+ * read a block since the previous probe, known if track_io_timing is on.
+ * Return -1 if the probe failed.
+ */
+static double
+probe_latency(int64 *prev_blks, double *prev_time)
+{
+	PGresult   *res;
+	double		start;
+	double		latency;
+	int64		blks;
+	double		time;
+
+	start = now_seconds();
+	res = PQexec(adapt_conn, ADAPT_PROBE_QUERY);
+	latency = (now_seconds() - start) * 1000;
+
+	if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) != 1)
+	{
+		elog(WARNING, "cannot probe server latency: %s",
+			 PQerrorMessage(adapt_conn));
+		PQclear(res);
+		return -1;
+	}
+
+	blks = atoll(PQgetvalue(res, 0, 0));
+	time = atof(PQgetvalue(res, 0, 1));
+	PQclear(res);
+
+	if (*prev_blks >= 0 && blks > *prev_blks && time > *prev_time)
+		latency = Max(latency, (time - *prev_time) / (blks - *prev_blks));
+	*prev_blks = blks;
+	*prev_time = time;
+
+	return latency;
+}
+
+/*
+ * Main of the sampler thread, adapting the rate to the server latency until
+ * throttle_adapt_stop() is called.
+ */
+static void *
+adapt_rate_worker(void *arg)
+{
+	double		rate = (double) max_rate;
+	double		min_rate = Min((double) ADAPT_MIN_RATE, (double) max_rate);
+	int64		prev_blks = -1;
+	double		prev_time = 0;
+
+	pthread_mutex_lock(&adapt_lock);
+	while (!adapt_stop)
+	{
+		struct timespec	until;
+		double		latency;
+		double		new_rate;
+
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += ADAPT_INTERVAL_MSEC / 1000;
+		until.tv_nsec += (ADAPT_INTERVAL_MSEC % 1000) * 1000000L;
+		if (until.tv_nsec >= 1000000000L)
+		{
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&adapt_cond, &adapt_lock, &until);
+		if (adapt_stop)
+			break;
+		pthread_mutex_unlock(&adapt_lock);
+
+		latency = probe_latency(&prev_blks, &prev_time);
+		if (latency >= 0)
+		{
+			if (latency > max_latency)
+				new_rate = Max(rate / 2, min_rate);
+			else
+				new_rate = Min(rate + (double) max_rate / ADAPT_STEPS,
+							   (double) max_rate);
+
+			if (new_rate != rate)
+			{
+				elog(LOG, "server latency %.1f ms, rate set to %.0f kB/s",
+					 latency, new_rate / 1024);
+				rate = new_rate;
+				throttle_set_rate(rate);
+			}
+		}
+
+		pthread_mutex_lock(&adapt_lock);
+	}
+	pthread_mutex_unlock(&adapt_lock);
+
+	return NULL;
+}
+
+/*
+ * Start adapting the rate to the latency of the server if --max-latency is
+ * set, with a connection of its own.
+ */
+void
+throttle_adapt_start(void)
+{
+	int			errnum;
+
+	if (max_latency <= 0 || check)
+		return;
+
+	adapt_conn = pgut_connect(ERROR);
+	adapt_stop = false;
+	errnum = pthread_create(&adapt_thread, NULL, adapt_rate_worker, NULL);
+	if (errnum != 0)
+		elog(ERROR, "cannot create rate sampler thread: %s", strerror(errnum));
+}
+
+/*
+ * Stop adapting the rate, the last rate staying in effect.
+ */
+void
+throttle_adapt_stop(void)
+{
+	if (adapt_conn == NULL)
+		return;
+
+	pthread_mutex_lock(&adapt_lock);
+	adapt_stop = true;
+	pthread_cond_signal(&adapt_cond);
+	pthread_mutex_unlock(&adapt_lock);
+
+	pthread_join(adapt_thread, NULL);
+	pgut_disconnect(adapt_conn);
+	adapt_conn = NULL;
+}
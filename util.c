@@ -75,6 +75,20 @@ sanityChecks(void)
 			 "target master need to use either data checksums or \"wal_log_hints = on\".");
 }
 
+/*
+ * Read and check the control file of $PGDATA.
+ */
+void
+get_control_file(ControlFileData *ControlFile)
+{
+	char	   *buffer;
+	size_t		size;
+
+	buffer = slurpFile(pgdata, "global/pg_control", &size);
+	digestControlFile(ControlFile, buffer, size);
+	pg_free(buffer);
+}
+
 /*
  * Utility shared by backup and restore to fetch the current timeline
  * used by a node.
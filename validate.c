@@ -153,6 +153,44 @@ pgBackupValidateFiles(parray *files, const char *root, bool size_only)
 		elog(LOG, "(%d/%lu) %s", i + 1, (unsigned long) parray_num(files),
 			get_relative_path(file->path, root));
 
+		/* the backup of the file is a part of a container */
+		if (file->container >= 0)
+		{
+			char	path[MAXPGPATH];
+
+			pgFileGetContainerPath(root, file, path);
+			if (stat(path, &st) == -1)
+			{
+				if (errno == ENOENT)
+					elog(WARNING, "container \"%s\" vanished", path);
+				else
+					elog(ERROR, "cannot stat container \"%s\": %s",
+						get_relative_path(path, root), strerror(errno));
+				return false;
+			}
+			if (st.st_size < file->container_offset + (int64) file->write_size)
+			{
+				elog(WARNING, "container \"%s\" is too short for backup file \"%s\"",
+					get_relative_path(path, root),
+					get_relative_path(file->path, root));
+				return false;
+			}
+
+			if (!size_only)
+			{
+				pg_crc32	crc;
+
+				crc = pgFileGetContainerCRC(root, file);
+				if (crc != file->crc)
+				{
+					elog(WARNING, "CRC of backup file \"%s\" must be %X but %X",
+						get_relative_path(file->path, root), file->crc, crc);
+					return false;
+				}
+			}
+			continue;
+		}
+
 		/* always validate file size */
 		if (stat(file->path, &st) == -1)
 		{
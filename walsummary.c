@@ -0,0 +1,349 @@
+/*-------------------------------------------------------------------------
+ *
+ * walsummary.c: summaries of the blocks modified by archived WAL segments
+ *
+ * Decoding the WAL archived since the previous backup is needed to build
+ * the page maps of a differential backup. Archived segments do not change
+ * once they are in the archive, so the list of blocks modified by the
+ * records starting in a segment is saved in $BACKUP_PATH/wal_summary the
+ * first time the segment is decoded, and reused by the next differential
+ * backups instead of decoding the segment again.
+ *
+ * Copyright (c) 2009-2013, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_arman.h"
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define WAL_SUMMARY_MAGIC		0x57414C53	/* "WALS" */
+#define WAL_SUMMARY_VERSION		2
+
+/* header of a summary file, followed by the ranges and a CRC */
+typedef struct WalSummaryHeader
+{
+	uint32		magic;
+	uint32		version;
+	TimeLineID	tli;
+	uint32		nranges;
+	XLogSegNo	segno;
+	uint64		system_identifier;	/* of the database cluster backed up */
+} WalSummaryHeader;
+
+static void wal_summary_get_path(TimeLineID tli, XLogSegNo segno,
+								 char *path, size_t len);
+static int wal_summary_range_compare(const void *r1, const void *r2);
+
+/*
+ * Create an empty summary for the given segment.
+ */
+WalSummary *
+wal_summary_new(TimeLineID tli, XLogSegNo segno)
+{
+	WalSummary *summary = pgut_new(WalSummary);
+
+	summary->tli = tli;
+	summary->segno = segno;
+	summary->nranges = 0;
+	summary->maxranges = 1024;
+	summary->ranges = pgut_newarray(WalSummaryRange, summary->maxranges);
+
+	return summary;
+}
+
+void
+wal_summary_free(WalSummary *summary)
+{
+	if (summary == NULL)
+		return;
+	free(summary->ranges);
+	free(summary);
+}
+
+/*
+ * Add a block to the summary. Consecutive references to the same block or
+ * to the block just after the last one extend the last range, which is
+ * the common case when a relation is bulk-loaded or scanned.
+ */
+void
+wal_summary_add(WalSummary *summary, RelFileNode rnode, ForkNumber forknum,
+				BlockNumber blkno)
+{
+	WalSummaryRange *range;
+
+	if (summary->nranges > 0)
+	{
+		range = &summary->ranges[summary->nranges - 1];
+
+		if (RelFileNodeEquals(range->rnode, rnode) &&
+			range->forknum == (int32) forknum &&
+			blkno >= range->blkno &&
+			blkno <= range->blkno + range->nblocks)
+		{
+			if (blkno == range->blkno + range->nblocks)
+				range->nblocks++;
+			return;
+		}
+	}
+
+	if (summary->nranges >= summary->maxranges)
+	{
+		summary->maxranges *= 2;
+		summary->ranges = pgut_realloc(summary->ranges,
+							sizeof(WalSummaryRange) * summary->maxranges);
+	}
+
+	range = &summary->ranges[summary->nranges++];
+	memset(range, 0, sizeof(WalSummaryRange));
+	range->rnode = rnode;
+	range->forknum = (int32) forknum;
+	range->blkno = blkno;
+	range->nblocks = 1;
+}
+
+/*
+ * Sort the ranges of the summary and merge the ones overlapping or
+ * adjacent, so as the summary gets as compact as possible.
+ */
+void
+wal_summary_compact(WalSummary *summary)
+{
+	int			i;
+	int			n;
+
+	if (summary->nranges <= 1)
+		return;
+
+	qsort(summary->ranges, summary->nranges, sizeof(WalSummaryRange),
+		  wal_summary_range_compare);
+
+	n = 0;
+	for (i = 1; i < summary->nranges; i++)
+	{
+		WalSummaryRange *last = &summary->ranges[n];
+		WalSummaryRange *range = &summary->ranges[i];
+
+		if (RelFileNodeEquals(last->rnode, range->rnode) &&
+			last->forknum == range->forknum &&
+			range->blkno <= last->blkno + last->nblocks)
+		{
+			BlockNumber	end = range->blkno + range->nblocks;
+
+			if (end > last->blkno + last->nblocks)
+				last->nblocks = end - last->blkno;
+		}
+		else
+			summary->ranges[++n] = *range;
+	}
+	summary->nranges = n + 1;
+}
+
+/*
+ * Mark all the blocks of the summary as changed in the page maps of the
+ * files being backed up.
+ */
+void
+wal_summary_apply(WalSummary *summary)
+{
+	int			i;
+
+	for (i = 0; i < summary->nranges; i++)
+	{
+		WalSummaryRange *range = &summary->ranges[i];
+		BlockNumber	blkno;
+
+		for (blkno = range->blkno; blkno < range->blkno + range->nblocks; blkno++)
+			process_block_change((ForkNumber) range->forknum, range->rnode,
+								 blkno);
+	}
+}
+
+/*
+ * Read the summary of the given segment from the backup catalog. Return
+ * NULL if there is no summary for this segment, or if it cannot be used,
+ * as when it was made from the WAL of another database cluster archived
+ * at the same place.
+ */
+WalSummary *
+wal_summary_read(TimeLineID tli, XLogSegNo segno)
+{
+	char		path[MAXPGPATH];
+	FILE	   *fp;
+	WalSummaryHeader header;
+	WalSummary *summary;
+	pg_crc32	crc;
+	pg_crc32	file_crc;
+
+	wal_summary_get_path(tli, segno, path, lengthof(path));
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+	{
+		if (errno != ENOENT)
+			elog(WARNING, "cannot open WAL summary \"%s\": %s",
+				 path, strerror(errno));
+		return NULL;
+	}
+
+	if (fread(&header, 1, sizeof(header), fp) != sizeof(header) ||
+		header.magic != WAL_SUMMARY_MAGIC ||
+		header.version != WAL_SUMMARY_VERSION ||
+		header.tli != tli || header.segno != segno)
+	{
+		elog(WARNING, "WAL summary \"%s\" is invalid, ignoring it", path);
+		fclose(fp);
+		return NULL;
+	}
+	if (header.system_identifier != current.system_identifier)
+	{
+		elog(WARNING, "WAL summary \"%s\" is of another database cluster, ignoring it",
+			 path);
+		fclose(fp);
+		return NULL;
+	}
+
+	summary = wal_summary_new(tli, segno);
+	if (header.nranges > summary->maxranges)
+	{
+		summary->maxranges = header.nranges;
+		summary->ranges = pgut_realloc(summary->ranges,
+							sizeof(WalSummaryRange) * summary->maxranges);
+	}
+	summary->nranges = header.nranges;
+
+	if (fread(summary->ranges, sizeof(WalSummaryRange), header.nranges, fp) != header.nranges ||
+		fread(&file_crc, 1, sizeof(file_crc), fp) != sizeof(file_crc))
+	{
+		elog(WARNING, "WAL summary \"%s\" is truncated, ignoring it", path);
+		fclose(fp);
+		wal_summary_free(summary);
+		return NULL;
+	}
+	fclose(fp);
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, &header, sizeof(header));
+	COMP_CRC32C(crc, summary->ranges, sizeof(WalSummaryRange) * header.nranges);
+	FIN_CRC32C(crc);
+	if (!EQ_CRC32C(crc, file_crc))
+	{
+		elog(WARNING, "WAL summary \"%s\" is corrupted, ignoring it", path);
+		wal_summary_free(summary);
+		return NULL;
+	}
+
+	return summary;
+}
+
+/*
+ * Save the summary into the backup catalog. The summary is written in a
+ * temporary file renamed once complete, so as a summary file is never
+ * seen partially written. Failures are not fatal, the segment would just
+ * be decoded again by the next differential backup.
+ */
+void
+wal_summary_write(WalSummary *summary)
+{
+	char		path[MAXPGPATH];
+	char		tmp_path[MAXPGPATH];
+	FILE	   *fp;
+	WalSummaryHeader header;
+	pg_crc32	crc;
+
+	join_path_components(path, backup_path, WAL_SUMMARY_DIR);
+	dir_create_dir(path, DIR_PERMISSION);
+
+	wal_summary_get_path(summary->tli, summary->segno, path, lengthof(path));
+	snprintf(tmp_path, lengthof(tmp_path), "%s.tmp", path);
+
+	memset(&header, 0, sizeof(header));
+	header.magic = WAL_SUMMARY_MAGIC;
+	header.version = WAL_SUMMARY_VERSION;
+	header.tli = summary->tli;
+	header.nranges = summary->nranges;
+	header.segno = summary->segno;
+	header.system_identifier = current.system_identifier;
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, &header, sizeof(header));
+	COMP_CRC32C(crc, summary->ranges, sizeof(WalSummaryRange) * summary->nranges);
+	FIN_CRC32C(crc);
+
+	fp = fopen(tmp_path, "w");
+	if (fp == NULL)
+	{
+		elog(WARNING, "cannot create WAL summary \"%s\": %s",
+			 tmp_path, strerror(errno));
+		return;
+	}
+
+	if (fwrite(&header, 1, sizeof(header), fp) != sizeof(header) ||
+		fwrite(summary->ranges, sizeof(WalSummaryRange), summary->nranges, fp) != summary->nranges ||
+		fwrite(&crc, 1, sizeof(crc), fp) != sizeof(crc) ||
+		fclose(fp) != 0)
+	{
+		elog(WARNING, "cannot write WAL summary \"%s\": %s",
+			 tmp_path, strerror(errno));
+		unlink(tmp_path);
+		return;
+	}
+
+	if (rename(tmp_path, path) == -1)
+	{
+		elog(WARNING, "cannot rename \"%s\" to \"%s\": %s",
+			 tmp_path, path, strerror(errno));
+		unlink(tmp_path);
+	}
+}
+
+/*
+ * Remove the summary of an archived WAL segment, if any. This is called
+ * when the segment itself is removed from the archive.
+ */
+void
+wal_summary_remove(const char *wal_fname)
+{
+	char		path[MAXPGPATH];
+
+	snprintf(path, lengthof(path), "%s/%s/%s", backup_path,
+			 WAL_SUMMARY_DIR, wal_fname);
+	if (unlink(path) == 0)
+		elog(LOG, "removed WAL summary \"%s\"", path);
+	else if (errno != ENOENT)
+		elog(WARNING, "could not remove file \"%s\": %s",
+			 path, strerror(errno));
+}
+
+/*
+ * Summaries are named after the WAL segment they describe.
+ */
+static void
+wal_summary_get_path(TimeLineID tli, XLogSegNo segno, char *path, size_t len)
+{
+	char		xlogfname[MAXFNAMELEN];
+
+	XLogFileName(xlogfname, tli, segno);
+	snprintf(path, len, "%s/%s/%s", backup_path, WAL_SUMMARY_DIR, xlogfname);
+}
+
+static int
+wal_summary_range_compare(const void *r1, const void *r2)
+{
+	const WalSummaryRange *r1p = (const WalSummaryRange *) r1;
+	const WalSummaryRange *r2p = (const WalSummaryRange *) r2;
+
+	if (r1p->rnode.spcNode != r2p->rnode.spcNode)
+		return r1p->rnode.spcNode < r2p->rnode.spcNode ? -1 : 1;
+	if (r1p->rnode.dbNode != r2p->rnode.dbNode)
+		return r1p->rnode.dbNode < r2p->rnode.dbNode ? -1 : 1;
+	if (r1p->rnode.relNode != r2p->rnode.relNode)
+		return r1p->rnode.relNode < r2p->rnode.relNode ? -1 : 1;
+	if (r1p->forknum != r2p->forknum)
+		return r1p->forknum < r2p->forknum ? -1 : 1;
+	if (r1p->blkno != r2p->blkno)
+		return r1p->blkno < r2p->blkno ? -1 : 1;
+	return 0;
+}